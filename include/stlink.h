@@ -10,6 +10,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -18,9 +19,10 @@ extern "C" {
 #define STLINK_ARRAY_SIZE(x) (sizeof(x)/sizeof(x[0]))
 
     // Max data transfer size.
-    // 6kB = max mem32_read block, 8kB sram
-    //#define Q_BUF_LEN	96
-#define Q_BUF_LEN			(1024 * 100)
+    // The biggest single transfer is a flash loader block, memory reads
+    // and writes go in 0x1800 byte pieces
+#define STLINK_LOADER_BLOCK		(1024 * 32)
+#define Q_BUF_LEN			STLINK_LOADER_BLOCK
 
     // STLINK_DEBUG_RESETSYS, etc:
 #define STLINK_CORE_RUNNING		0x80
@@ -32,6 +34,7 @@ extern "C" {
 #define STLINK_GET_TARGET_VOLTAGE	0xF7
 
 #define STLINK_DEBUG_COMMAND		0xF2
+#define STLINK_DEBUG_ERR_OK		0x80
 #define STLINK_DFU_COMMAND		0xF3
 #define STLINK_DFU_EXIT		0x07
 
@@ -86,6 +89,9 @@ extern "C" {
         STLINK_FLASH_TYPE_L4
     };
 
+    // r0..r15, xpsr, main_sp, process_sp, rw, rw2 as numbered by the stlink
+#define STLINK_REG_COUNT	21
+
     struct stlink_reg {
         uint32_t r[16];
         uint32_t s[32];
@@ -123,6 +129,27 @@ typedef struct flash_loader {
         uint32_t stlink_pid;
     } stlink_version_t;
 
+    /* One piece of a scatter/gather memory access */
+    struct stlink_mem_seg {
+        stm32_addr_t addr;
+        void *buf;
+        size_t len;
+    };
+
+    /* A single adapter transfer, as planned by stlink_read_memv()/stlink_write_memv() */
+    enum stlink_mem_op_type {
+        STLINK_MEM_READ32,
+        STLINK_MEM_WRITE32,
+        STLINK_MEM_WRITE8
+    };
+
+    struct stlink_mem_op {
+        enum stlink_mem_op_type type;
+        uint32_t addr;
+        uint16_t len;
+        unsigned char *data;
+    };
+
     enum transport_type {
         TRANSPORT_TYPE_ZERO = 0,
         TRANSPORT_TYPE_LIBSG,
@@ -134,14 +161,24 @@ typedef struct flash_loader {
 
 #include "stlink/backend.h"
 
+    /*
+     * Thread safety: every stlink_* call on a handle takes the handle's
+     * (recursive) lock, so one handle may be used from several threads and
+     * different handles never share state.  q_buf and c_buf belong to the
+     * lock holder; a caller filling q_buf before stlink_write_mem32() or
+     * reading it after stlink_read_mem32() must hold stlink_lock() across
+     * the whole sequence.
+     */
     struct _stlink {
         struct _stlink_backend *backend;
         void *backend_data;
+        pthread_mutex_t lock;
 
         // Room for the command header
         unsigned char c_buf[C_BUF_LEN];
-        // Data transferred from or to device
-        unsigned char q_buf[Q_BUF_LEN];
+        // Data transferred from or to device, Q_BUF_LEN bytes allocated
+        // by the backend
+        unsigned char *q_buf;
         int q_len;
 
         // transport layer verboseness: 0 for no debug info, 10 for lots
@@ -167,8 +204,22 @@ typedef struct flash_loader {
         size_t sys_size;
 
         struct stlink_version_ version;
+
+        // flash loader left at sram_base by stlink_flash_loader_init(),
+        // forgotten on reset and checked again once something else could
+        // have changed that sram
+        struct {
+            const uint8_t *code;    // which loader, NULL if none
+            size_t size;
+            uint32_t checksum;
+            bool verify;
+            int voltage;            // mV as used to pick the loader, 0 if not read
+        } loader;
     };
 
+    int stlink_init_lock(stlink_t *sl);
+    void stlink_lock(stlink_t *sl);
+    void stlink_unlock(stlink_t *sl);
     int stlink_enter_swd_mode(stlink_t *sl);
     int stlink_enter_jtag_mode(stlink_t *sl);
     int stlink_exit_debug_mode(stlink_t *sl);
@@ -185,17 +236,26 @@ typedef struct flash_loader {
     int stlink_write_debug32(stlink_t *sl, uint32_t addr, uint32_t data);
     int stlink_write_mem32(stlink_t *sl, uint32_t addr, uint16_t len);
     int stlink_write_mem8(stlink_t *sl, uint32_t addr, uint16_t len);
+    int stlink_read_mem(stlink_t *sl, stm32_addr_t addr, void *buf, size_t len);
+    int stlink_write_mem(stlink_t *sl, stm32_addr_t addr, const void *buf, size_t len);
+    int stlink_read_memv(stlink_t *sl, const struct stlink_mem_seg *segs, int count);
+    int stlink_write_memv(stlink_t *sl, const struct stlink_mem_seg *segs, int count);
     int stlink_read_all_regs(stlink_t *sl, struct stlink_reg *regp);
     int stlink_read_all_unsupported_regs(stlink_t *sl, struct stlink_reg *regp);
     int stlink_read_reg(stlink_t *sl, int r_idx, struct stlink_reg *regp);
     int stlink_read_unsupported_reg(stlink_t *sl, int r_idx, struct stlink_reg *regp);
     int stlink_write_unsupported_reg(stlink_t *sl, uint32_t value, int r_idx, struct stlink_reg *regp);
     int stlink_write_reg(stlink_t *sl, uint32_t reg, int idx);
+    int stlink_write_regs(stlink_t *sl, uint32_t mask, const uint32_t *regs);
+    int stlink_write_regs_run(stlink_t *sl, uint32_t mask, const uint32_t *regs);
+    int stlink_read_regs(stlink_t *sl, uint32_t mask, uint32_t *regs);
     int stlink_step(stlink_t *sl);
     int stlink_current_mode(stlink_t *sl);
     int stlink_force_debug(stlink_t *sl);
     int stlink_target_voltage(stlink_t *sl);
     int stlink_set_swdclk(stlink_t *sl, uint16_t divisor);
+    int stlink_swdclk_autotune(stlink_t *sl);
+    int stlink_swdclk_restore(stlink_t *sl);
 
     int stlink_erase_flash_mass(stlink_t* sl);
     int stlink_write_flash(stlink_t* sl, stm32_addr_t address, uint8_t* data, uint32_t length, uint8_t eraseonly);
@@ -29,6 +29,10 @@
         int (*force_debug) (stlink_t *sl);
         int32_t (*target_voltage) (stlink_t *sl);
         int (*set_swdclk) (stlink_t * stl, uint16_t divisor);		
+        /* optional, runs a list of memory transfers in one go */
+        int (*mem_ops) (stlink_t *sl, const struct stlink_mem_op *ops, int count);
+        /* optional, writes the registers in mask and maybe runs the core in one go */
+        int (*write_regs) (stlink_t *sl, uint32_t mask, const uint32_t *regs, int run);
     } stlink_backend_t;
 
 #endif /* STLINK_BACKEND_H_ */
@@ -19,6 +19,9 @@ extern "C" {
 int stlink_flash_loader_init(stlink_t *sl, flash_loader_t* fl);
 int stlink_flash_loader_write_to_sram(stlink_t *sl, stm32_addr_t* addr, size_t* size);
 int stlink_flash_loader_run(stlink_t *sl, flash_loader_t* fl, stm32_addr_t target, const uint8_t* buf, size_t size);
+int stlink_flash_loader_voltage(stlink_t *sl);
+void stlink_flash_loader_touch(stlink_t *sl, stm32_addr_t addr, size_t len);
+void stlink_flash_loader_forget(stlink_t *sl);
 
 #ifdef __cplusplus
 }
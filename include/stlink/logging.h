@@ -17,23 +17,48 @@ enum ugly_loglevel {
 	UFATAL = 10
 };
 
+/* Runtime threshold set by ugly_init(), messages above it are dropped */
+extern int ugly_max_level;
+
 int ugly_init(int maximum_threshold);
 int ugly_log(int level, const char *tag, const char *format, ...);
 
+/* Hand formatted messages to a background writer instead of writing them
+ * from the caller, returns 0 on success */
+int ugly_set_async(int enable);
+/* Write out everything still queued for the background writer */
+void ugly_flush(void);
+
 #ifndef CMAKE_SOURCE_DIR_LENGTH
 #define CMAKE_SOURCE_DIR_LENGTH 0
 #endif
 #define UGLY_LOG_FILE (__FILE__+CMAKE_SOURCE_DIR_LENGTH)
 
+/* Compile time threshold, log calls above it are removed by the compiler.
+ * e.g. -DUGLY_LOG_MAX_LEVEL=50 strips all DLOG calls */
+#ifndef UGLY_LOG_MAX_LEVEL
+#define UGLY_LOG_MAX_LEVEL UDEBUG
+#endif
+
+/* Checked before the arguments are evaluated */
+#define UGLY_LOG_ENABLED(level) \
+	((level) <= UGLY_LOG_MAX_LEVEL && (level) <= ugly_max_level)
+
+#define UGLY_LOG_IF(level, format, ...) \
+	do { \
+		if (UGLY_LOG_ENABLED(level)) \
+			ugly_log(level, UGLY_LOG_FILE, format, __VA_ARGS__); \
+	} while (0)
+
 /** @todo we need to write this in a more generic way, for now this should compile
  on visual studio (See http://stackoverflow.com/a/8673872/1836746) */
-#define DLOG_HELPER(format, ...)   ugly_log(UDEBUG, UGLY_LOG_FILE, format, __VA_ARGS__)
+#define DLOG_HELPER(format, ...)   UGLY_LOG_IF(UDEBUG, format, __VA_ARGS__)
 #define DLOG(...) DLOG_HELPER(__VA_ARGS__, "")
-#define ILOG_HELPER(format, ...)   ugly_log(UINFO, UGLY_LOG_FILE, format, __VA_ARGS__)
+#define ILOG_HELPER(format, ...)   UGLY_LOG_IF(UINFO, format, __VA_ARGS__)
 #define ILOG(...) ILOG_HELPER(__VA_ARGS__, "")
-#define WLOG_HELPER(format, ...)   ugly_log(UWARN, UGLY_LOG_FILE, format, __VA_ARGS__)
+#define WLOG_HELPER(format, ...)   UGLY_LOG_IF(UWARN, format, __VA_ARGS__)
 #define WLOG(...) WLOG_HELPER(__VA_ARGS__, "")
-#define ELOG_HELPER(format, ...)   ugly_log(UERROR, UGLY_LOG_FILE, format, __VA_ARGS__)
+#define ELOG_HELPER(format, ...)   UGLY_LOG_IF(UERROR, format, __VA_ARGS__)
 #define ELOG(...) ELOG_HELPER(__VA_ARGS__, "")
 #define fatal_helper(format, ...)  ugly_log(UFATAL, UGLY_LOG_FILE, format, __VA_ARGS__)
 #define fatal(...) fatal_helper(__VA_ARGS__, "")
@@ -43,4 +68,3 @@ int ugly_log(int level, const char *tag, const char *format, ...);
 #endif
 
 #endif	/* UGLYLOGGING_H */
-
@@ -7,6 +7,8 @@
 #define DEBUG_LOG_LEVEL 100
 #define STND_LOG_LEVEL  50
 
+#define FLASH_GANG_MAX  64
+
 enum flash_cmd {FLASH_CMD_NONE = 0, FLASH_CMD_WRITE = 1, FLASH_CMD_READ = 2, FLASH_CMD_ERASE = 3, CMD_RESET = 4};
 enum flash_format {FLASH_FORMAT_BINARY = 0, FLASH_FORMAT_IHEX = 1};
 struct flash_opts
@@ -20,9 +22,14 @@ struct flash_opts
     int reset;
     int log_level;
     enum flash_format format;
+    int gang_all;           /* program every attached stlink */
+    int gang_count;         /* or the ones listed in gang_serials */
+    uint8_t gang_serials[FLASH_GANG_MAX][16];
+    int gang_serial_sizes[FLASH_GANG_MAX];
+    int tune_swdclk;        /* find the fastest reliable SWD clock first */
 };
 
-#define FLASH_OPTS_INITIALIZER {0, NULL, {}, NULL, 0, 0, 0, 0, 0 }
+#define FLASH_OPTS_INITIALIZER {0, NULL, {}, NULL, 0, 0, 0, 0, 0, 0, 0, {}, {}, 0 }
 
 int flash_get_opts(struct flash_opts* o, int ac, char** av);
 
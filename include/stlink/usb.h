@@ -34,6 +34,27 @@ extern "C" {
         int protocoll;
         unsigned int sg_transfer_idx;
         unsigned int cmd_len;
+        bool q_buf_dev_mem;     /* q_buf comes from libusb_dev_mem_alloc */
+    };
+
+    /**
+     * Take a reference on the libusb context shared by all programmers, the
+     * first one creates it and starts the thread handling its events
+     * @retval NULL   libusb could not be initialized
+     */
+    libusb_context *stlink_usb_context_ref(void);
+    /** Drop a reference, the last one stops the event thread and exits libusb */
+    void stlink_usb_context_unref(void);
+
+    /* What can be learned about a programmer without touching its target */
+    struct stlink_usb_info {
+        char serial[16];
+        int serial_size;
+        uint16_t pid;
+        uint8_t bus;
+        uint8_t addr;
+        int busy;       /* in use by another process, version is unknown */
+        struct stlink_version_ version;
     };
 
     /**
@@ -45,6 +66,18 @@ extern "C" {
      * @retval !NULL  Stlink found and ready to use
      */
     stlink_t *stlink_open_usb(enum ugly_loglevel verbose, bool reset, char serial[16]);
+    /**
+     * List the connected programmers from their USB descriptors and firmware
+     * version only, the interface is claimed briefly and the target is left alone
+     * @param infos   Set to a list that must be released with free()
+     * @return        Number of programmers in the list
+     */
+    size_t stlink_enumerate_usb(struct stlink_usb_info **infos);
+    /**
+     * Connect to all programmers in parallel without resetting their targets
+     * @param stdevs  Set to a list that must be released with stlink_probe_usb_free()
+     * @return        Number of programmers that could be opened
+     */
     size_t stlink_probe_usb(stlink_t **stdevs[]);
     void stlink_probe_usb_free(stlink_t **stdevs[], size_t size);
 
@@ -6,6 +6,7 @@
 #include <string.h>
 
 #include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
@@ -472,6 +473,32 @@ static inline void write_flash_cr_bker_pnb(stlink_t *sl, uint32_t n) {
     stlink_write_debug32(sl, STM32L4_FLASH_CR, x);
 }
 
+/*
+ * Every call below runs with the handle lock held, so a handle can be
+ * shared between threads.  q_buf is only valid while the lock is held:
+ * callers that fill or read it around a memory call must wrap the
+ * sequence in stlink_lock()/stlink_unlock() themselves.
+ */
+int stlink_init_lock(stlink_t *sl) {
+    pthread_mutexattr_t attr;
+    int ret;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    ret = pthread_mutex_init(&sl->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    return ret ? -1 : 0;
+}
+
+void stlink_lock(stlink_t *sl) {
+    pthread_mutex_lock(&sl->lock);
+}
+
+void stlink_unlock(stlink_t *sl) {
+    pthread_mutex_unlock(&sl->lock);
+}
+
 // Delegates to the backends...
 
 void stlink_close(stlink_t *sl) {
@@ -479,6 +506,7 @@ void stlink_close(stlink_t *sl) {
     if (!sl)
          return;
     sl->backend->close(sl);
+    pthread_mutex_destroy(&sl->lock);
     free(sl);
 }
 
@@ -490,36 +518,58 @@ int stlink_exit_debug_mode(stlink_t *sl) {
     if (ret == -1)
         return ret;
 
-    return sl->backend->exit_debug_mode(sl);
+    stlink_lock(sl);
+    stlink_flash_loader_touch(sl, sl->sram_base, sl->loader.size);
+    ret = sl->backend->exit_debug_mode(sl);
+    stlink_unlock(sl);
+    return ret;
 }
 
 int stlink_enter_swd_mode(stlink_t *sl) {
+    int ret;
+
     DLOG("*** stlink_enter_swd_mode ***\n");
-    return sl->backend->enter_swd_mode(sl);
+    stlink_lock(sl);
+    ret = sl->backend->enter_swd_mode(sl);
+    stlink_unlock(sl);
+    return ret;
 }
 
 // Force the core into the debug mode -> halted state.
 int stlink_force_debug(stlink_t *sl) {
+    int ret;
+
     DLOG("*** stlink_force_debug_mode ***\n");
-    return sl->backend->force_debug(sl);
+    stlink_lock(sl);
+    ret = sl->backend->force_debug(sl);
+    stlink_unlock(sl);
+    return ret;
 }
 
 int stlink_exit_dfu_mode(stlink_t *sl) {
+    int ret;
+
     DLOG("*** stlink_exit_dfu_mode ***\n");
-    return sl->backend->exit_dfu_mode(sl);
+    stlink_lock(sl);
+    ret = sl->backend->exit_dfu_mode(sl);
+    stlink_unlock(sl);
+    return ret;
 }
 
 int stlink_core_id(stlink_t *sl) {
     int ret;
 
     DLOG("*** stlink_core_id ***\n");
+    stlink_lock(sl);
     ret = sl->backend->core_id(sl);
     if (ret == -1) {
+        stlink_unlock(sl);
         ELOG("Failed to read core_id\n");
         return ret;
     }
     if (sl->verbose > 2)
         stlink_print_data(sl);
+    stlink_unlock(sl);
     DLOG("core_id = 0x%08x\n", sl->core_id);
     return ret;
 }
@@ -555,26 +605,107 @@ int stlink_cpu_id(stlink_t *sl, cortex_m3_cpuid_t *cpuid) {
     return 0;
 }
 
+/*
+ * Device parameter cache.  When STLINK_CACHE_DIR is set, the values read
+ * while connecting are stored in <dir>/<serial>.params.  On the next
+ * connect the raw chip id is read and, if it matches the cached one, the
+ * core id and cpuid reads are skipped.  The flash size is always read, a
+ * board swapped for one with the same chip id may have a different one.
+ */
+#define STLINK_PARAMS_CACHE_MAGIC "stlink-params-v2"
+
+struct stlink_params_cache {
+    uint32_t chip_id_raw;
+    uint32_t chip_id;
+    uint32_t core_id;
+};
+
+static int stlink_params_cache_path(stlink_t *sl, const char *suffix, char *path, size_t len) {
+    const char *dir = getenv("STLINK_CACHE_DIR");
+    size_t n;
+    int i;
+
+    if (dir == NULL || *dir == 0 || sl->serial_size <= 0)
+        return -1;
+
+    n = snprintf(path, len, "%s/", dir);
+    for (i = 0; i < sl->serial_size && n + 3 < len; i++)
+        n += snprintf(path + n, len - n, "%02x", (unsigned char) sl->serial[i]);
+    if (n + strlen(suffix) + 1 > len)
+        return -1;
+    strcpy(path + n, suffix);
+    return 0;
+}
+
+static int stlink_params_cache_load(stlink_t *sl, struct stlink_params_cache *pc) {
+    char path[PATH_MAX];
+    char magic[32];
+    FILE *fp;
+    int ret;
+
+    if (stlink_params_cache_path(sl, ".params", path, sizeof(path)))
+        return -1;
+
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+
+    ret = fscanf(fp, "%31s %x %x %x", magic, &pc->chip_id_raw, &pc->chip_id, &pc->core_id);
+    fclose(fp);
+
+    if (ret != 4 || strcmp(magic, STLINK_PARAMS_CACHE_MAGIC) != 0)
+        return -1;
+    return 0;
+}
+
+static void stlink_params_cache_store(stlink_t *sl, const struct stlink_params_cache *pc) {
+    char path[PATH_MAX];
+    FILE *fp;
+
+    if (stlink_params_cache_path(sl, ".params", path, sizeof(path)))
+        return;
+
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        DLOG("Cannot write parameter cache %s: %s\n", path, strerror(errno));
+        return;
+    }
+    fprintf(fp, "%s %08x %08x %08x\n", STLINK_PARAMS_CACHE_MAGIC, pc->chip_id_raw,
+            pc->chip_id, pc->core_id);
+    fclose(fp);
+}
+
 /**
  * reads and decodes the flash parameters, as dynamically as possible
  * @param sl
  * @return 0 for success, or -1 for unsupported core type.
  */
-int stlink_load_device_params(stlink_t *sl) {
+static int stlink_load_device_params_nolock(stlink_t *sl) {
     ILOG("Loading device parameters....\n");
     const struct stlink_chipid_params *params = NULL;
-    stlink_core_id(sl);
+    struct stlink_params_cache pc;
     uint32_t chip_id;
     uint32_t flash_size;
+    int cached;
 
-    stlink_chip_id(sl, &chip_id);
-    sl->chip_id = chip_id & 0xfff;
-    /* Fix chip_id for F4 rev A errata , Read CPU ID, as CoreID is the same for F2/F4*/
-    if (sl->chip_id == 0x411) {
-        uint32_t cpuid;
-        stlink_read_debug32(sl, 0xE000ED00, &cpuid);
-        if ((cpuid  & 0xfff0) == 0xc240)
-            sl->chip_id = 0x413;
+    if (stlink_chip_id(sl, &chip_id) == -1)
+        return -1;
+
+    cached = stlink_params_cache_load(sl, &pc) == 0 && pc.chip_id_raw == chip_id;
+    if (cached) {
+        DLOG("Using cached device parameters\n");
+        sl->core_id = pc.core_id;
+        sl->chip_id = pc.chip_id;
+    } else {
+        stlink_core_id(sl);
+        sl->chip_id = chip_id & 0xfff;
+        /* Fix chip_id for F4 rev A errata , Read CPU ID, as CoreID is the same for F2/F4*/
+        if (sl->chip_id == 0x411) {
+            uint32_t cpuid;
+            stlink_read_debug32(sl, 0xE000ED00, &cpuid);
+            if ((cpuid  & 0xfff0) == 0xc240)
+                sl->chip_id = 0x413;
+        }
     }
 
     params = stlink_chipid_get_params(sl->chip_id);
@@ -588,6 +719,13 @@ int stlink_load_device_params(stlink_t *sl) {
         return -1;
     }
 
+    if (!cached) {
+        pc.chip_id_raw = chip_id;
+        pc.chip_id = sl->chip_id;
+        pc.core_id = sl->core_id;
+        stlink_params_cache_store(sl, &pc);
+    }
+
     // These are fixed...
     sl->flash_base = STM32_FLASH_BASE;
     sl->sram_base = STM32_SRAM_BASE;
@@ -630,32 +768,216 @@ int stlink_load_device_params(stlink_t *sl) {
     return 0;
 }
 
+int stlink_load_device_params(stlink_t *sl) {
+    int ret;
+
+    stlink_lock(sl);
+    ret = stlink_load_device_params_nolock(sl);
+    stlink_unlock(sl);
+    return ret;
+}
+
+/*
+ * SWD clock tuning.  The divisors are tried from the fastest clock down,
+ * each one has to pass a write/readback of target SRAM with several
+ * patterns.  The result is stored next to the parameter cache as
+ * <serial>.swdclk and picked up again by stlink_swdclk_restore().
+ */
+#define STLINK_SWDCLK_TUNE_LEN     1024
+#define STLINK_SWDCLK_TUNE_ROUNDS  8
+
+static const uint16_t stlink_swdclk_divisors[] = {
+    STLINK_SWDCLK_4MHZ_DIVISOR,
+    STLINK_SWDCLK_1P8MHZ_DIVISOR,
+    STLINK_SWDCLK_1P2MHZ_DIVISOR,
+    STLINK_SWDCLK_950KHZ_DIVISOR,
+    STLINK_SWDCLK_480KHZ_DIVISOR,
+    STLINK_SWDCLK_240KHZ_DIVISOR,
+    STLINK_SWDCLK_125KHZ_DIVISOR,
+    STLINK_SWDCLK_100KHZ_DIVISOR,
+    STLINK_SWDCLK_50KHZ_DIVISOR,
+    STLINK_SWDCLK_25KHZ_DIVISOR,
+    STLINK_SWDCLK_15KHZ_DIVISOR,
+    STLINK_SWDCLK_5KHZ_DIVISOR,
+};
+
+static uint8_t stlink_swdclk_pattern(int round, uint32_t i) {
+    switch (round & 3) {
+    case 0:  return 0x55;
+    case 1:  return 0xaa;
+    case 2:  return (uint8_t) (1 << ((i + round) & 7));     /* walking ones */
+    default: return (uint8_t) ((i * 2654435761u + round) >> 24);
+    }
+}
+
+/* Called with the lock held, clobbers addr..addr+len */
+static int stlink_swdclk_check(stlink_t *sl, stm32_addr_t addr, uint16_t len) {
+    for (int round = 0; round < STLINK_SWDCLK_TUNE_ROUNDS; round++) {
+        for (uint32_t i = 0; i < len; i++)
+            sl->q_buf[i] = stlink_swdclk_pattern(round, i);
+        if (stlink_write_mem32(sl, addr, len))
+            return -1;
+
+        memset(sl->q_buf, 0, len);
+        if (stlink_read_mem32(sl, addr, len))
+            return -1;
+
+        for (uint32_t i = 0; i < len; i++) {
+            if (sl->q_buf[i] != stlink_swdclk_pattern(round, i))
+                return -1;
+        }
+    }
+    return 0;
+}
+
+int stlink_swdclk_restore(stlink_t *sl) {
+    char path[PATH_MAX];
+    unsigned int divisor;
+    FILE *fp;
+    size_t n;
+    int ret;
+
+    if (stlink_params_cache_path(sl, ".swdclk", path, sizeof(path)))
+        return -1;
+
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+    ret = fscanf(fp, "%u", &divisor);
+    fclose(fp);
+    if (ret != 1)
+        return -1;
+
+    for (n = 0; n < STLINK_ARRAY_SIZE(stlink_swdclk_divisors); n++) {
+        if (stlink_swdclk_divisors[n] == divisor) {
+            DLOG("Using tuned SWD clock divisor %u\n", divisor);
+            return stlink_set_swdclk(sl, (uint16_t) divisor);
+        }
+    }
+    return -1;
+}
+
+int stlink_swdclk_autotune(stlink_t *sl) {
+    uint8_t saved[STLINK_SWDCLK_TUNE_LEN];
+    stm32_addr_t addr = sl->sram_base;
+    uint16_t len = STLINK_SWDCLK_TUNE_LEN;
+    int was_running;
+    int found = -1;
+    size_t n;
+
+    if (sl->backend->set_swdclk == NULL || sl->sram_size == 0)
+        return -1;
+    if (sl->sram_size < len)
+        len = (uint16_t) (sl->sram_size & ~3u);
+
+    stlink_lock(sl);
+
+    /* keep the target from touching the test area, and put it back afterwards */
+    stlink_status(sl);
+    was_running = sl->core_stat == STLINK_CORE_RUNNING;
+    stlink_force_debug(sl);
+
+    if (stlink_read_mem32(sl, addr, len))
+        goto restore;
+    memcpy(saved, sl->q_buf, len);
+
+    for (n = 0; n < STLINK_ARRAY_SIZE(stlink_swdclk_divisors); n++) {
+        if (stlink_set_swdclk(sl, stlink_swdclk_divisors[n]))
+            break;
+        if (stlink_swdclk_check(sl, addr, len) == 0) {
+            found = (int) n;
+            break;
+        }
+        DLOG("SWD clock divisor %u failed the SRAM check\n", stlink_swdclk_divisors[n]);
+    }
+
+    /* a faster clock failed, so this one is close to the limit: back off one step */
+    if (found > 0 && (size_t) found + 1 < STLINK_ARRAY_SIZE(stlink_swdclk_divisors))
+        found++;
+
+    stlink_set_swdclk(sl, found < 0 ? STLINK_SWDCLK_1P8MHZ_DIVISOR : stlink_swdclk_divisors[found]);
+
+    memcpy(sl->q_buf, saved, len);
+    stlink_write_mem32(sl, addr, len);
+
+restore:
+    if (was_running)
+        stlink_run(sl);
+
+    stlink_unlock(sl);
+
+    if (found < 0) {
+        WLOG("No SWD clock passed the SRAM check\n");
+        return -1;
+    }
+
+    ILOG("SWD clock divisor %u selected\n", stlink_swdclk_divisors[found]);
+
+    char path[PATH_MAX];
+    if (stlink_params_cache_path(sl, ".swdclk", path, sizeof(path)) == 0) {
+        FILE *fp = fopen(path, "w");
+        if (fp != NULL) {
+            fprintf(fp, "%u\n", stlink_swdclk_divisors[found]);
+            fclose(fp);
+        } else {
+            DLOG("Cannot write %s: %s\n", path, strerror(errno));
+        }
+    }
+
+    return stlink_swdclk_divisors[found];
+}
+
 int stlink_reset(stlink_t *sl) {
+    int ret;
+
     DLOG("*** stlink_reset ***\n");
-    return sl->backend->reset(sl);
+    stlink_lock(sl);
+    stlink_flash_loader_forget(sl);
+    ret = sl->backend->reset(sl);
+    stlink_unlock(sl);
+    return ret;
 }
 
 int stlink_jtag_reset(stlink_t *sl, int value) {
+    int ret;
+
     DLOG("*** stlink_jtag_reset ***\n");
-    return sl->backend->jtag_reset(sl, value);
+    stlink_lock(sl);
+    stlink_flash_loader_forget(sl);
+    ret = sl->backend->jtag_reset(sl, value);
+    stlink_unlock(sl);
+    return ret;
 }
 
 int stlink_run(stlink_t *sl) {
+    int ret;
+
     DLOG("*** stlink_run ***\n");
-    return sl->backend->run(sl);
+    stlink_lock(sl);
+    stlink_flash_loader_touch(sl, sl->sram_base, sl->loader.size);
+    ret = sl->backend->run(sl);
+    stlink_unlock(sl);
+    return ret;
 }
 
 int stlink_set_swdclk(stlink_t *sl, uint16_t divisor) {
+    int ret;
+
     DLOG("*** set_swdclk ***\n");
-    return sl->backend->set_swdclk(sl, divisor);
+    stlink_lock(sl);
+    ret = sl->backend->set_swdclk(sl, divisor);
+    stlink_unlock(sl);
+    return ret;
 }
 
 int stlink_status(stlink_t *sl) {
     int ret;
 
     DLOG("*** stlink_status ***\n");
+    stlink_lock(sl);
     ret = sl->backend->status(sl);
     stlink_core_stat(sl);
+    stlink_unlock(sl);
 
     return ret;
 }
@@ -687,10 +1009,14 @@ void _parse_version(stlink_t *sl, stlink_version_t *slv) {
 
 int stlink_version(stlink_t *sl) {
     DLOG("*** looking up stlink version\n");
-    if (sl->backend->version(sl))
+    stlink_lock(sl);
+    if (sl->backend->version(sl)) {
+        stlink_unlock(sl);
         return -1;
+    }
 
     _parse_version(sl, &sl->version);
+    stlink_unlock(sl);
 
     DLOG("st vid         = 0x%04x (expect 0x%04x)\n", sl->version.st_vid, STLINK_USB_VID_ST);
     DLOG("stlink pid     = 0x%04x\n", sl->version.stlink_pid);
@@ -711,7 +1037,9 @@ int stlink_target_voltage(stlink_t *sl) {
     int voltage = -1;
     DLOG("*** reading target voltage\n");
     if (sl->backend->target_voltage != NULL) {
+        stlink_lock(sl);
         voltage = sl->backend->target_voltage(sl);
+        stlink_unlock(sl);
         if (voltage != -1) {
             DLOG("target voltage = %ldmV\n", voltage);
         } else {
@@ -726,7 +1054,9 @@ int stlink_target_voltage(stlink_t *sl) {
 int stlink_read_debug32(stlink_t *sl, uint32_t addr, uint32_t *data) {
     int ret;
 
+    stlink_lock(sl);
     ret = sl->backend->read_debug32(sl, addr, data);
+    stlink_unlock(sl);
     if (!ret)
 	    DLOG("*** stlink_read_debug32 %x is %#x\n", *data, addr);
 
@@ -734,55 +1064,451 @@ int stlink_read_debug32(stlink_t *sl, uint32_t addr, uint32_t *data) {
 }
 
 int stlink_write_debug32(stlink_t *sl, uint32_t addr, uint32_t data) {
+    int ret;
+
     DLOG("*** stlink_write_debug32 %x to %#x\n", data, addr);
-    return sl->backend->write_debug32(sl, addr, data);
+    stlink_lock(sl);
+    stlink_flash_loader_touch(sl, addr, 4);
+    ret = sl->backend->write_debug32(sl, addr, data);
+    stlink_unlock(sl);
+    return ret;
 }
 
 int stlink_write_mem32(stlink_t *sl, uint32_t addr, uint16_t len) {
+    int ret;
+
     DLOG("*** stlink_write_mem32 %u bytes to %#x\n", len, addr);
     if (len % 4 != 0) {
         fprintf(stderr, "Error: Data length doesn't have a 32 bit alignment: +%d byte.\n", len % 4);
         abort();
     }
-    return sl->backend->write_mem32(sl, addr, len);
+    if (len > Q_BUF_LEN) {
+        ELOG("Write of %u bytes does not fit the transfer buffer\n", len);
+        return -1;
+    }
+    stlink_lock(sl);
+    stlink_flash_loader_touch(sl, addr, len);
+    ret = sl->backend->write_mem32(sl, addr, len);
+    stlink_unlock(sl);
+    return ret;
 }
 
 int stlink_read_mem32(stlink_t *sl, uint32_t addr, uint16_t len) {
+    int ret;
+
     DLOG("*** stlink_read_mem32 ***\n");
     if (len % 4 != 0) { // !!! never ever: fw gives just wrong values
         fprintf(stderr, "Error: Data length doesn't have a 32 bit alignment: +%d byte.\n",
                 len % 4);
         abort();
     }
-    return sl->backend->read_mem32(sl, addr, len);
+    if (len > Q_BUF_LEN) {
+        ELOG("Read of %u bytes does not fit the transfer buffer\n", len);
+        return -1;
+    }
+    stlink_lock(sl);
+    ret = sl->backend->read_mem32(sl, addr, len);
+    stlink_unlock(sl);
+    return ret;
 }
 
 int stlink_write_mem8(stlink_t *sl, uint32_t addr, uint16_t len) {
+    int ret;
+
     DLOG("*** stlink_write_mem8 ***\n");
     if (len > 0x40 ) { // !!! never ever: Writing more then 0x40 bytes gives unexpected behaviour
         fprintf(stderr, "Error: Data length > 64: +%d byte.\n",
                 len);
         abort();
     }
-    return sl->backend->write_mem8(sl, addr, len);
+    stlink_lock(sl);
+    stlink_flash_loader_touch(sl, addr, len);
+    ret = sl->backend->write_mem8(sl, addr, len);
+    stlink_unlock(sl);
+    return ret;
+}
+
+/*
+ * Scatter/gather memory access.  The segments are planned into as few
+ * adapter transfers as possible: touching segments are joined, writes use
+ * mem8 for an unaligned head and tail and mem32 for the rest, reads are
+ * widened to whole words.  A backend with mem_ops gets the whole plan at
+ * once and can queue it on the transport instead of doing a round trip
+ * per transfer.
+ */
+#define STLINK_MEMV_BLOCK   0x1800
+#define STLINK_MEMV_MEM8    0x40
+
+struct stlink_mem_plan {
+    struct stlink_mem_op *ops;
+    int count;
+    int size;
+};
+
+static int stlink_mem_plan_add(struct stlink_mem_plan *plan, enum stlink_mem_op_type type,
+                               uint32_t addr, uint16_t len, unsigned char *data) {
+    struct stlink_mem_op *op;
+
+    if (plan->count == plan->size) {
+        int size = plan->size ? plan->size * 2 : 16;
+        op = realloc(plan->ops, size * sizeof(*op));
+        if (op == NULL)
+            return -1;
+        plan->ops = op;
+        plan->size = size;
+    }
+
+    op = &plan->ops[plan->count++];
+    op->type = type;
+    op->addr = addr;
+    op->len = len;
+    op->data = data;
+    return 0;
+}
+
+/* One contiguous write: mem8 for the unaligned edges, mem32 blocks between */
+static int stlink_mem_plan_write(struct stlink_mem_plan *plan, uint32_t addr,
+                                 unsigned char *data, size_t len) {
+    /* a short unaligned run is cheaper as a single mem8 */
+    if (len <= STLINK_MEMV_MEM8 && ((addr | len) & 3))
+        return stlink_mem_plan_add(plan, STLINK_MEM_WRITE8, addr, (uint16_t) len, data);
+
+    while (len > 0) {
+        enum stlink_mem_op_type type = STLINK_MEM_WRITE32;
+        size_t n;
+
+        if (addr & 3) {
+            n = 4 - (addr & 3);
+            type = STLINK_MEM_WRITE8;
+        } else if (len < 4) {
+            n = len;
+            type = STLINK_MEM_WRITE8;
+        } else {
+            n = len & ~(size_t) 3;
+            if (n > STLINK_MEMV_BLOCK)
+                n = STLINK_MEMV_BLOCK;
+        }
+        if (n > len)
+            n = len;
+
+        if (stlink_mem_plan_add(plan, type, addr, (uint16_t) n, data))
+            return -1;
+        addr += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int stlink_mem_plan_read(struct stlink_mem_plan *plan, uint32_t addr,
+                                unsigned char *data, size_t len) {
+    while (len > 0) {
+        size_t n = len > STLINK_MEMV_BLOCK ? STLINK_MEMV_BLOCK : len;
+
+        if (stlink_mem_plan_add(plan, STLINK_MEM_READ32, addr, (uint16_t) n, data))
+            return -1;
+        addr += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Called with the lock held */
+static int stlink_mem_run(stlink_t *sl, const struct stlink_mem_op *ops, int count) {
+    if (sl->backend->mem_ops)
+        return sl->backend->mem_ops(sl, ops, count);
+
+    for (int i = 0; i < count; i++) {
+        int ret;
+
+        switch (ops[i].type) {
+        case STLINK_MEM_READ32:
+            ret = sl->backend->read_mem32(sl, ops[i].addr, ops[i].len);
+            memcpy(ops[i].data, sl->q_buf, ops[i].len);
+            break;
+        case STLINK_MEM_WRITE32:
+            memcpy(sl->q_buf, ops[i].data, ops[i].len);
+            ret = sl->backend->write_mem32(sl, ops[i].addr, ops[i].len);
+            break;
+        default:
+            memcpy(sl->q_buf, ops[i].data, ops[i].len);
+            ret = sl->backend->write_mem8(sl, ops[i].addr, ops[i].len);
+            break;
+        }
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+struct stlink_read_range {
+    uint32_t start;     /* word aligned */
+    uint32_t end;
+    int seg;
+};
+
+static int stlink_read_range_cmp(const void *a, const void *b) {
+    const struct stlink_read_range *ra = a, *rb = b;
+
+    if (ra->start != rb->start)
+        return ra->start < rb->start ? -1 : 1;
+    return ra->seg - rb->seg;
+}
+
+/**
+ * Read a list of memory segments, the segments may come in any order and
+ * overlap.  Every segment is read as whole words.
+ * @return 0 on success, -1 on error
+ */
+int stlink_read_memv(stlink_t *sl, const struct stlink_mem_seg *segs, int count) {
+    struct stlink_mem_plan plan = { NULL, 0, 0 };
+    struct stlink_read_range *ranges;
+    uint32_t *offsets;
+    unsigned char *stage = NULL;
+    size_t total = 0;
+    int n = 0, ret = -1;
+
+    ranges = malloc(count * sizeof(*ranges) + 1);
+    offsets = malloc(count * sizeof(*offsets) + 1);
+    if (ranges == NULL || offsets == NULL)
+        goto out;
+
+    for (int i = 0; i < count; i++) {
+        if (segs[i].len == 0)
+            continue;
+        ranges[n].start = segs[i].addr & ~3u;
+        ranges[n].end = (uint32_t) ((segs[i].addr + segs[i].len + 3) & ~3u);
+        ranges[n].seg = i;
+        n++;
+    }
+    qsort(ranges, n, sizeof(*ranges), stlink_read_range_cmp);
+
+    /* first pass sizes the staging buffer, the second plans into it */
+    for (int pass = 0; pass < 2; pass++) {
+        size_t off = 0;
+
+        for (int i = 0; i < n; ) {
+            uint32_t start = ranges[i].start, end = ranges[i].end;
+            int j = i;
+
+            for (; j < n && ranges[j].start <= end; j++) {
+                if (ranges[j].end > end)
+                    end = ranges[j].end;
+                offsets[ranges[j].seg] = (uint32_t) (off + (segs[ranges[j].seg].addr - start));
+            }
+
+            if (pass == 1 && stlink_mem_plan_read(&plan, start, stage + off, end - start))
+                goto out;
+            off += end - start;
+            i = j;
+        }
+
+        if (pass == 0) {
+            total = off;
+            stage = malloc(total + 1);
+            if (stage == NULL)
+                goto out;
+        }
+    }
+
+    DLOG("*** stlink_read_memv %d segments, %u bytes in %d transfers\n",
+         count, (unsigned) total, plan.count);
+
+    stlink_lock(sl);
+    ret = stlink_mem_run(sl, plan.ops, plan.count);
+    stlink_unlock(sl);
+
+    if (ret == 0) {
+        for (int i = 0; i < n; i++) {
+            const struct stlink_mem_seg *seg = &segs[ranges[i].seg];
+            memcpy(seg->buf, stage + offsets[ranges[i].seg], seg->len);
+        }
+    }
+
+out:
+    free(stage);
+    free(plan.ops);
+    free(offsets);
+    free(ranges);
+    return ret ? -1 : 0;
+}
+
+/**
+ * Write a list of memory segments in the given order, any alignment
+ * @return 0 on success, -1 on error
+ */
+int stlink_write_memv(stlink_t *sl, const struct stlink_mem_seg *segs, int count) {
+    struct stlink_mem_plan plan = { NULL, 0, 0 };
+    unsigned char *stage;
+    size_t total = 0, off = 0;
+    int ret = -1;
+
+    for (int i = 0; i < count; i++)
+        total += segs[i].len;
+
+    /* gathered into one buffer so touching segments become one run */
+    stage = malloc(total + 1);
+    if (stage == NULL)
+        return -1;
+
+    for (int i = 0; i < count; ) {
+        uint32_t addr = segs[i].addr;
+        size_t run = off;
+        int j = i;
+
+        for (; j < count && segs[j].addr == addr + (off - run); j++) {
+            memcpy(stage + off, segs[j].buf, segs[j].len);
+            off += segs[j].len;
+        }
+
+        if (off > run && stlink_mem_plan_write(&plan, addr, stage + run, off - run))
+            goto out;
+        i = j;
+    }
+
+    DLOG("*** stlink_write_memv %d segments, %u bytes in %d transfers\n",
+         count, (unsigned) total, plan.count);
+
+    stlink_lock(sl);
+    for (int i = 0; i < count; i++)
+        stlink_flash_loader_touch(sl, segs[i].addr, segs[i].len);
+    ret = stlink_mem_run(sl, plan.ops, plan.count);
+    stlink_unlock(sl);
+
+out:
+    free(plan.ops);
+    free(stage);
+    return ret ? -1 : 0;
+}
+
+/**
+ * Read len bytes at any address, only the words holding them are read
+ * @return 0 on success, -1 on error
+ */
+int stlink_read_mem(stlink_t *sl, stm32_addr_t addr, void *buf, size_t len) {
+    struct stlink_mem_seg seg = { addr, buf, len };
+
+    return stlink_read_memv(sl, &seg, 1);
+}
+
+/**
+ * Write len bytes at any address, nothing around them is touched
+ * @return 0 on success, -1 on error
+ */
+int stlink_write_mem(stlink_t *sl, stm32_addr_t addr, const void *buf, size_t len) {
+    struct stlink_mem_seg seg = { addr, (void *) buf, len };
+
+    return stlink_write_memv(sl, &seg, 1);
 }
 
 int stlink_read_all_regs(stlink_t *sl, struct stlink_reg *regp) {
+    int ret;
+
     DLOG("*** stlink_read_all_regs ***\n");
-    return sl->backend->read_all_regs(sl, regp);
+    stlink_lock(sl);
+    ret = sl->backend->read_all_regs(sl, regp);
+    stlink_unlock(sl);
+    return ret;
 }
 
 int stlink_read_all_unsupported_regs(stlink_t *sl, struct stlink_reg *regp) {
+    int ret;
+
     DLOG("*** stlink_read_all_unsupported_regs ***\n");
-    return sl->backend->read_all_unsupported_regs(sl, regp);
+    stlink_lock(sl);
+    ret = sl->backend->read_all_unsupported_regs(sl, regp);
+    stlink_unlock(sl);
+    return ret;
 }
 
 int stlink_write_reg(stlink_t *sl, uint32_t reg, int idx) {
+    int ret;
+
     DLOG("*** stlink_write_reg\n");
-    return sl->backend->write_reg(sl, reg, idx);
+    stlink_lock(sl);
+    ret = sl->backend->write_reg(sl, reg, idx);
+    stlink_unlock(sl);
+    return ret;
+}
+
+static int stlink_write_regs_nolock(stlink_t *sl, uint32_t mask, const uint32_t *regs, int run) {
+    if (sl->backend->write_regs)
+        return sl->backend->write_regs(sl, mask, regs, run);
+
+    for (int i = 0; i < STLINK_REG_COUNT; i++) {
+        if ((mask & (1u << i)) && sl->backend->write_reg(sl, regs[i], i))
+            return -1;
+    }
+    return run ? sl->backend->run(sl) : 0;
+}
+
+/**
+ * Write several core registers in one exchange
+ * @param mask bit n selects register n, see STLINK_REG_COUNT
+ * @param regs values indexed by register number
+ */
+int stlink_write_regs(stlink_t *sl, uint32_t mask, const uint32_t *regs) {
+    int ret;
+
+    DLOG("*** stlink_write_regs %#x\n", mask);
+    stlink_lock(sl);
+    ret = stlink_write_regs_nolock(sl, mask, regs, 0);
+    stlink_unlock(sl);
+    return ret;
+}
+
+/* Same as stlink_write_regs(), the core is started in the same exchange */
+int stlink_write_regs_run(stlink_t *sl, uint32_t mask, const uint32_t *regs) {
+    int ret;
+
+    DLOG("*** stlink_write_regs_run %#x\n", mask);
+    stlink_lock(sl);
+    /* the flash loader leaves itself alone, anything else may not */
+    if (!(mask & (1u << 15)) || regs[15] != sl->sram_base)
+        stlink_flash_loader_touch(sl, sl->sram_base, sl->loader.size);
+    ret = stlink_write_regs_nolock(sl, mask, regs, 1);
+    stlink_unlock(sl);
+    return ret;
+}
+
+/**
+ * Read the core registers in mask into regs (indexed by register number),
+ * more than one register is read with a single read all registers command
+ */
+int stlink_read_regs(stlink_t *sl, uint32_t mask, uint32_t *regs) {
+    struct stlink_reg rr;
+    int ret;
+
+    stlink_lock(sl);
+    if ((mask & (mask - 1)) == 0) {
+        int idx = __builtin_ctz(mask | (1u << 31));
+        ret = idx < STLINK_REG_COUNT ? sl->backend->read_reg(sl, idx, &rr) : 0;
+    } else {
+        ret = sl->backend->read_all_regs(sl, &rr);
+    }
+    stlink_unlock(sl);
+    if (ret)
+        return ret;
+
+    for (int i = 0; i < STLINK_REG_COUNT; i++) {
+        if (!(mask & (1u << i)))
+            continue;
+        switch (i) {
+        case 16: regs[i] = rr.xpsr; break;
+        case 17: regs[i] = rr.main_sp; break;
+        case 18: regs[i] = rr.process_sp; break;
+        case 19: regs[i] = rr.rw; break;
+        case 20: regs[i] = rr.rw2; break;
+        default: regs[i] = rr.r[i]; break;
+        }
+    }
+    return 0;
 }
 
 int stlink_read_reg(stlink_t *sl, int r_idx, struct stlink_reg *regp) {
+    int ret;
+
     DLOG("*** stlink_read_reg\n");
     DLOG(" (%d) ***\n", r_idx);
 
@@ -791,11 +1517,15 @@ int stlink_read_reg(stlink_t *sl, int r_idx, struct stlink_reg *regp) {
         return -1;
     }
 
-    return sl->backend->read_reg(sl, r_idx, regp);
+    stlink_lock(sl);
+    ret = sl->backend->read_reg(sl, r_idx, regp);
+    stlink_unlock(sl);
+    return ret;
 }
 
 int stlink_read_unsupported_reg(stlink_t *sl, int r_idx, struct stlink_reg *regp) {
     int r_convert;
+    int ret;
 
     DLOG("*** stlink_read_unsupported_reg\n");
     DLOG(" (%d) ***\n", r_idx);
@@ -812,11 +1542,15 @@ int stlink_read_unsupported_reg(stlink_t *sl, int r_idx, struct stlink_reg *regp
         return -1;
     }
 
-    return sl->backend->read_unsupported_reg(sl, r_convert, regp);
+    stlink_lock(sl);
+    ret = sl->backend->read_unsupported_reg(sl, r_convert, regp);
+    stlink_unlock(sl);
+    return ret;
 }
 
 int stlink_write_unsupported_reg(stlink_t *sl, uint32_t val, int r_idx, struct stlink_reg *regp) {
     int r_convert;
+    int ret;
 
     DLOG("*** stlink_write_unsupported_reg\n");
     DLOG(" (%d) ***\n", r_idx);
@@ -833,27 +1567,42 @@ int stlink_write_unsupported_reg(stlink_t *sl, uint32_t val, int r_idx, struct s
         return -1;
     }
 
-    return sl->backend->write_unsupported_reg(sl, val, r_convert, regp);
+    stlink_lock(sl);
+    ret = sl->backend->write_unsupported_reg(sl, val, r_convert, regp);
+    stlink_unlock(sl);
+    return ret;
 }
 
 bool stlink_is_core_halted(stlink_t *sl)
 {
 	bool ret = false;
 
+	stlink_lock(sl);
 	stlink_status(sl);
 	if (sl->q_buf[0] == STLINK_CORE_HALTED)
 		ret = true;
+	stlink_unlock(sl);
 
 	return ret;
 }
 
 int stlink_step(stlink_t *sl) {
+    int ret;
+
     DLOG("*** stlink_step ***\n");
-    return sl->backend->step(sl);
+    stlink_lock(sl);
+    stlink_flash_loader_touch(sl, sl->sram_base, sl->loader.size);
+    ret = sl->backend->step(sl);
+    stlink_unlock(sl);
+    return ret;
 }
 
 int stlink_current_mode(stlink_t *sl) {
-    int mode = sl->backend->current_mode(sl);
+    int mode;
+
+    stlink_lock(sl);
+    mode = sl->backend->current_mode(sl);
+    stlink_unlock(sl);
     switch (mode) {
     case STLINK_DEV_DFU_MODE:
         DLOG("stlink current mode: dfu\n");
@@ -909,7 +1658,7 @@ void stlink_run_at(stlink_t *sl, stm32_addr_t addr) {
         usleep(3000000);
 }
 
-void stlink_core_stat(stlink_t *sl) {
+static void stlink_core_stat_nolock(stlink_t *sl) {
     if (sl->q_len <= 0)
         return;
 
@@ -928,6 +1677,12 @@ void stlink_core_stat(stlink_t *sl) {
     }
 }
 
+void stlink_core_stat(stlink_t *sl) {
+    stlink_lock(sl);
+    stlink_core_stat_nolock(sl);
+    stlink_unlock(sl);
+}
+
 void stlink_print_data(stlink_t * sl) {
     if (sl->q_len <= 0 || sl->verbose < UDEBUG)
         return;
@@ -1005,18 +1760,13 @@ static int check_file(stlink_t* sl, mapped_file_t* mf, stm32_addr_t addr) {
         n_cmp = 0x1800;
 
     for (off = 0; off < mf->len; off += n_cmp) {
-        size_t aligned_size;
-
         /* adjust last page size */
         size_t cmp_size = n_cmp;
         if ((off + n_cmp) > mf->len)
             cmp_size = mf->len - off;
 
-        aligned_size = cmp_size;
-        if (aligned_size & (4 - 1))
-            aligned_size = (cmp_size + 4) & ~(4 - 1);
-
-        stlink_read_mem32(sl, addr + (uint32_t) off, aligned_size);
+        if (stlink_read_mem(sl, addr + (uint32_t) off, sl->q_buf, cmp_size))
+            return -1;
 
         if (memcmp(sl->q_buf, mf->base + off, cmp_size))
             return -1;
@@ -1036,12 +1786,10 @@ static void stlink_fwrite_finalize(stlink_t *sl, stm32_addr_t addr) {
     stlink_run(sl);
 }
 
-int stlink_mwrite_sram(stlink_t * sl, uint8_t* data, uint32_t length, stm32_addr_t addr) {
+static int stlink_mwrite_sram_nolock(stlink_t * sl, uint8_t* data, uint32_t length, stm32_addr_t addr) {
     /* write the file in sram at addr */
 
     int error = -1;
-    size_t off;
-    size_t len;
 
     /* check addr range is inside the sram */
     if (addr < sl->sram_base) {
@@ -1059,30 +1807,9 @@ int stlink_mwrite_sram(stlink_t * sl, uint8_t* data, uint32_t length, stm32_addr
         goto on_error;
     }
 
-    len = length;
-
-    if(len & 3) {
-      len -= len & 3;
-    }
-
-    /* do the copy by 1k blocks */
-    for (off = 0; off < len; off += 1024) {
-        size_t size = 1024;
-        if ((off + size) > len)
-            size = len - off;
-
-        memcpy(sl->q_buf, data + off, size);
-
-        /* round size if needed */
-        if (size & 3)
-            size += 2;
-
-        stlink_write_mem32(sl, addr + (uint32_t) off, size);
-    }
-
-    if(length > len) {
-        memcpy(sl->q_buf, data + len, length - len);
-        stlink_write_mem8(sl, addr + (uint32_t) len, length - len);
+    if (stlink_write_mem(sl, addr, data, length)) {
+        fprintf(stderr, "write to sram failed\n");
+        goto on_error;
     }
 
     /* success */
@@ -1093,12 +1820,19 @@ on_error:
     return error;
 }
 
-int stlink_fwrite_sram(stlink_t * sl, const char* path, stm32_addr_t addr) {
+int stlink_mwrite_sram(stlink_t * sl, uint8_t* data, uint32_t length, stm32_addr_t addr) {
+    int ret;
+
+    stlink_lock(sl);
+    ret = stlink_mwrite_sram_nolock(sl, data, length, addr);
+    stlink_unlock(sl);
+    return ret;
+}
+
+static int stlink_fwrite_sram_nolock(stlink_t * sl, const char* path, stm32_addr_t addr) {
     /* write the file in sram at addr */
 
     int error = -1;
-    size_t off;
-    size_t len;
     mapped_file_t mf = MAPPED_FILE_INITIALIZER;
 
     if (map_file(&mf, path) == -1) {
@@ -1122,30 +1856,9 @@ int stlink_fwrite_sram(stlink_t * sl, const char* path, stm32_addr_t addr) {
         goto on_error;
     }
 
-    len = mf.len;
-
-    if(len & 3) {
-      len -= len & 3;
-    }
-
-    /* do the copy by 1k blocks */
-    for (off = 0; off < len; off += 1024) {
-        size_t size = 1024;
-        if ((off + size) > len)
-            size = len - off;
-
-        memcpy(sl->q_buf, mf.base + off, size);
-
-        /* round size if needed */
-        if (size & 3)
-            size += 2;
-
-        stlink_write_mem32(sl, addr + (uint32_t) off, size);
-    }
-
-    if(mf.len > len) {
-        memcpy(sl->q_buf, mf.base + len, mf.len - len);
-        stlink_write_mem8(sl, addr + (uint32_t) len, mf.len - len);
+    if (stlink_write_mem(sl, addr, mf.base, mf.len)) {
+        fprintf(stderr, "write to sram failed\n");
+        goto on_error;
     }
 
     /* check the file ha been written */
@@ -1163,6 +1876,15 @@ on_error:
     return error;
 }
 
+int stlink_fwrite_sram(stlink_t * sl, const char* path, stm32_addr_t addr) {
+    int ret;
+
+    stlink_lock(sl);
+    ret = stlink_fwrite_sram_nolock(sl, path, addr);
+    stlink_unlock(sl);
+    return ret;
+}
+
 typedef bool (*save_block_fn)(void* arg, uint8_t* block, ssize_t len);
 
 static int stlink_read(stlink_t* sl, stm32_addr_t addr, size_t size, save_block_fn fn, void* fn_arg) {
@@ -1177,19 +1899,14 @@ static int stlink_read(stlink_t* sl, stm32_addr_t addr, size_t size, save_block_
 
     size_t cmp_size = (sl->flash_pgsz > 0x1800)? 0x1800:sl->flash_pgsz;
     for (size_t off = 0; off < size; off += cmp_size) {
-        size_t aligned_size;
-
         /* adjust last page size */
         if ((off + cmp_size) > size)
             cmp_size = size - off;
 
-        aligned_size = cmp_size;
-        if (aligned_size & (4 - 1))
-            aligned_size = (cmp_size + 4) & ~(4 - 1);
-
-        stlink_read_mem32(sl, addr + (uint32_t) off, aligned_size);
+        if (stlink_read_mem(sl, addr + (uint32_t) off, sl->q_buf, cmp_size))
+            goto on_error;
 
-        if (!fn(fn_arg, sl->q_buf, aligned_size)) {
+        if (!fn(fn_arg, sl->q_buf, cmp_size)) {
             goto on_error;
         }
     }
@@ -1208,7 +1925,7 @@ struct stlink_fread_worker_arg {
 static bool stlink_fread_worker(void* arg, uint8_t* block, ssize_t len) {
     struct stlink_fread_worker_arg* the_arg = (struct stlink_fread_worker_arg*)arg;
     if (write(the_arg->fd, block, len) != len) {
-        fprintf(stderr, "write() != aligned_size\n");
+        fprintf(stderr, "write() != len\n");
         return false;
     }
     else {
@@ -1299,7 +2016,7 @@ static bool stlink_fread_ihex_finalize(struct stlink_fread_ihex_worker_arg* the_
     return (0 == fclose(the_arg->file));
 }
 
-int stlink_fread(stlink_t* sl, const char* path, bool is_ihex, stm32_addr_t addr, size_t size) {
+static int stlink_fread_nolock(stlink_t* sl, const char* path, bool is_ihex, stm32_addr_t addr, size_t size) {
     /* read size bytes from addr to file */
 
     int error;
@@ -1331,7 +2048,16 @@ int stlink_fread(stlink_t* sl, const char* path, bool is_ihex, stm32_addr_t addr
     return error;
 }
 
-int write_buffer_to_sram(stlink_t *sl, flash_loader_t* fl, const uint8_t* buf, size_t size) {
+int stlink_fread(stlink_t* sl, const char* path, bool is_ihex, stm32_addr_t addr, size_t size) {
+    int ret;
+
+    stlink_lock(sl);
+    ret = stlink_fread_nolock(sl, path, is_ihex, addr, size);
+    stlink_unlock(sl);
+    return ret;
+}
+
+static int write_buffer_to_sram_nolock(stlink_t *sl, flash_loader_t* fl, const uint8_t* buf, size_t size) {
     /* write the buffer right after the loader */
     size_t chunk = size & ~0x3;
     size_t rem   = size & 0x3;
@@ -1346,6 +2072,15 @@ int write_buffer_to_sram(stlink_t *sl, flash_loader_t* fl, const uint8_t* buf, s
     return 0;
 }
 
+int write_buffer_to_sram(stlink_t *sl, flash_loader_t* fl, const uint8_t* buf, size_t size) {
+    int ret;
+
+    stlink_lock(sl);
+    ret = write_buffer_to_sram_nolock(sl, fl, buf, size);
+    stlink_unlock(sl);
+    return ret;
+}
+
 uint32_t calculate_F4_sectornum(uint32_t flashaddr){
     uint32_t offset = 0;
     flashaddr &= ~STM32_FLASH_BASE;	//Page now holding the actual flash address
@@ -1388,7 +2123,10 @@ uint32_t calculate_L4_page(stlink_t *sl, uint32_t flashaddr) {
     return bker | flashaddr/sl->flash_pgsz;
 }
 
+/* Size of the page or sector holding flashaddr, sl->flash_pgsz is left alone */
 uint32_t stlink_calculate_pagesize(stlink_t *sl, uint32_t flashaddr){
+    size_t pgsz = sl->flash_pgsz;
+
     if ((sl->chip_id == STLINK_CHIPID_STM32_F2) || (sl->chip_id == STLINK_CHIPID_STM32_F4) || (sl->chip_id == STLINK_CHIPID_STM32_F4_DE) ||
             (sl->chip_id == STLINK_CHIPID_STM32_F4_LP) || (sl->chip_id == STLINK_CHIPID_STM32_F4_HD) || (sl->chip_id == STLINK_CHIPID_STM32_F411RE) ||
             (sl->chip_id == STLINK_CHIPID_STM32_F446) || (sl->chip_id == STLINK_CHIPID_STM32_F4_DSI)) {
@@ -1396,17 +2134,17 @@ uint32_t stlink_calculate_pagesize(stlink_t *sl, uint32_t flashaddr){
         if (sector>= 12) {
             sector -= 12;
         }
-        if (sector<4) sl->flash_pgsz=0x4000;
-        else if(sector<5) sl->flash_pgsz=0x10000;
-        else sl->flash_pgsz=0x20000;
+        if (sector<4) pgsz=0x4000;
+        else if(sector<5) pgsz=0x10000;
+        else pgsz=0x20000;
     }
     else if (sl->chip_id == STLINK_CHIPID_STM32_F7 || sl->chip_id == STLINK_CHIPID_STM32_F7XXXX) {
         uint32_t sector=calculate_F7_sectornum(flashaddr);
-        if (sector<4) sl->flash_pgsz=0x8000;
-        else if(sector<5) sl->flash_pgsz=0x20000;
-        else sl->flash_pgsz=0x40000;
+        if (sector<4) pgsz=0x8000;
+        else if(sector<5) pgsz=0x20000;
+        else pgsz=0x40000;
     }
-    return (uint32_t) sl->flash_pgsz;
+    return (uint32_t) pgsz;
 }
 
 /**
@@ -1415,7 +2153,7 @@ uint32_t stlink_calculate_pagesize(stlink_t *sl, uint32_t flashaddr){
  * @param flashaddr an address in the flash page to erase
  * @return 0 on success -ve on failure
  */
-int stlink_erase_flash_page(stlink_t *sl, stm32_addr_t flashaddr)
+static int stlink_erase_flash_page_nolock(stlink_t *sl, stm32_addr_t flashaddr)
 {
     if (sl->flash_type == STLINK_FLASH_TYPE_F4 || sl->flash_type == STLINK_FLASH_TYPE_L4) {
         /* wait for ongoing op to finish */
@@ -1562,7 +2300,17 @@ int stlink_erase_flash_page(stlink_t *sl, stm32_addr_t flashaddr)
     return 0;
 }
 
-int stlink_erase_flash_mass(stlink_t *sl) {
+int stlink_erase_flash_page(stlink_t *sl, stm32_addr_t flashaddr)
+{
+    int ret;
+
+    stlink_lock(sl);
+    ret = stlink_erase_flash_page_nolock(sl, flashaddr);
+    stlink_unlock(sl);
+    return ret;
+}
+
+static int stlink_erase_flash_mass_nolock(stlink_t *sl) {
     if (sl->flash_type == STLINK_FLASH_TYPE_L0) {
         /* erase each page */
         int i = 0, num_pages = (int) sl->flash_size/sl->flash_pgsz;
@@ -1604,7 +2352,16 @@ int stlink_erase_flash_mass(stlink_t *sl) {
     return 0;
 }
 
-int stlink_fcheck_flash(stlink_t *sl, const char* path, stm32_addr_t addr) {
+int stlink_erase_flash_mass(stlink_t *sl) {
+    int ret;
+
+    stlink_lock(sl);
+    ret = stlink_erase_flash_mass_nolock(sl);
+    stlink_unlock(sl);
+    return ret;
+}
+
+static int stlink_fcheck_flash_nolock(stlink_t *sl, const char* path, stm32_addr_t addr) {
     /* check the contents of path are at addr */
 
     int res;
@@ -1620,6 +2377,15 @@ int stlink_fcheck_flash(stlink_t *sl, const char* path, stm32_addr_t addr) {
     return res;
 }
 
+int stlink_fcheck_flash(stlink_t *sl, const char* path, stm32_addr_t addr) {
+    int ret;
+
+    stlink_lock(sl);
+    ret = stlink_fcheck_flash_nolock(sl, path, addr);
+    stlink_unlock(sl);
+    return ret;
+}
+
 /**
  * Verify addr..addr+len is binary identical to base...base+len
  * @param sl stlink context
@@ -1628,24 +2394,17 @@ int stlink_fcheck_flash(stlink_t *sl, const char* path, stm32_addr_t addr) {
  * @param length how much
  * @return 0 for success, -ve for failure
  */
-int stlink_verify_write_flash(stlink_t *sl, stm32_addr_t address, uint8_t *data, unsigned length) {
+static int stlink_verify_write_flash_nolock(stlink_t *sl, stm32_addr_t address, uint8_t *data, unsigned length) {
     size_t off;
     size_t cmp_size = (sl->flash_pgsz > 0x1800)? 0x1800:sl->flash_pgsz;
     ILOG("Starting verification of write complete\n");
     for (off = 0; off < length; off += cmp_size) {
-        size_t aligned_size;
-
         /* adjust last page size */
         if ((off + cmp_size) > length)
             cmp_size = length - off;
 
-        aligned_size = cmp_size;
-        if (aligned_size & (4 - 1))
-            aligned_size = (cmp_size + 4) & ~(4 - 1);
-
-        stlink_read_mem32(sl, address + (uint32_t) off, aligned_size);
-
-        if (memcmp(sl->q_buf, data + off, cmp_size)) {
+        if (stlink_read_mem(sl, address + (uint32_t) off, sl->q_buf, cmp_size) ||
+            memcmp(sl->q_buf, data + off, cmp_size)) {
 	  ELOG("Verification of flash failed at offset: %u\n", (unsigned int)off);
             return -1;
         }
@@ -1655,6 +2414,15 @@ int stlink_verify_write_flash(stlink_t *sl, stm32_addr_t address, uint8_t *data,
 
 }
 
+int stlink_verify_write_flash(stlink_t *sl, stm32_addr_t address, uint8_t *data, unsigned length) {
+    int ret;
+
+    stlink_lock(sl);
+    ret = stlink_verify_write_flash_nolock(sl, address, data, length);
+    stlink_unlock(sl);
+    return ret;
+}
+
 int stm32l1_write_half_pages(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uint32_t len, uint32_t pagesize)
 {
     unsigned int count;
@@ -1715,13 +2483,13 @@ int stm32l1_write_half_pages(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uin
     return 0;
 }
 
-int stlink_write_flash(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uint32_t len, uint8_t eraseonly) {
+static int stlink_write_flash_nolock(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uint32_t len, uint8_t eraseonly) {
     size_t off;
     flash_loader_t fl;
     ILOG("Attempting to write %d (%#x) bytes to stm32 address: %u (%#x)\n",
             len, len, addr, addr);
     /* check addr range is inside the flash */
-    stlink_calculate_pagesize(sl, addr);
+    uint32_t start_pagesize = stlink_calculate_pagesize(sl, addr);
     if (addr < sl->flash_base) {
         ELOG("addr too low %#x < %#x\n", addr, sl->flash_base);
         return -1;
@@ -1737,7 +2505,7 @@ int stlink_write_flash(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uint32_t
     } else if (len & 1) {
         WLOG("unaligned len 0x%x -- padding with zero\n", len);
         len += 1;
-    } else if (addr & (sl->flash_pgsz - 1)) {
+    } else if (addr & (start_pagesize - 1)) {
         ELOG("addr not a multiple of pagesize, not supported\n");
         return -1;
     }
@@ -1787,7 +2555,7 @@ int stlink_write_flash(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uint32_t
             }
             else {
                 /* set parallelisim to 32 bit*/
-                int voltage = stlink_target_voltage(sl);
+                int voltage = stlink_flash_loader_voltage(sl);
                 if (voltage == -1) {
                     printf("Failed to read Target voltage\n");
                     return voltage;
@@ -1801,7 +2569,7 @@ int stlink_write_flash(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uint32_t
             }
         } else {
             /* L4 does not have a byte-write mode */
-            int voltage = stlink_target_voltage(sl);
+            int voltage = stlink_flash_loader_voltage(sl);
             if (voltage == -1) {
                 printf("Failed to read Target voltage\n");
                 return voltage;
@@ -1815,7 +2583,7 @@ int stlink_write_flash(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uint32_t
         set_flash_cr_pg(sl);
 
         for(off = 0; off < len;) {
-            size_t size = len - off > 0x8000 ? 0x8000 : len - off;
+            size_t size = len - off > STLINK_LOADER_BLOCK ? STLINK_LOADER_BLOCK : len - off;
 
             printf("size: %u\n", (unsigned int)size);
 
@@ -1947,6 +2715,15 @@ int stlink_write_flash(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uint32_t
     return stlink_verify_write_flash(sl, addr, base, len);
 }
 
+int stlink_write_flash(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uint32_t len, uint8_t eraseonly) {
+    int ret;
+
+    stlink_lock(sl);
+    ret = stlink_write_flash_nolock(sl, addr, base, len, eraseonly);
+    stlink_unlock(sl);
+    return ret;
+}
+
 // note: length not checked
 static uint8_t stlink_parse_hex(const char* hex) {
     uint8_t d[2];
@@ -2110,7 +2887,7 @@ uint8_t stlink_get_erased_pattern(stlink_t *sl) {
         return 0xff;
 }
 
-int stlink_mwrite_flash(stlink_t *sl, uint8_t* data, uint32_t length, stm32_addr_t addr) {
+static int stlink_mwrite_flash_nolock(stlink_t *sl, uint8_t* data, uint32_t length, stm32_addr_t addr) {
     /* write the block in flash at addr */
     int err;
     unsigned int num_empty, idx;
@@ -2132,6 +2909,15 @@ int stlink_mwrite_flash(stlink_t *sl, uint8_t* data, uint32_t length, stm32_addr
     return err;
 }
 
+int stlink_mwrite_flash(stlink_t *sl, uint8_t* data, uint32_t length, stm32_addr_t addr) {
+    int ret;
+
+    stlink_lock(sl);
+    ret = stlink_mwrite_flash_nolock(sl, data, length, addr);
+    stlink_unlock(sl);
+    return ret;
+}
+
 /**
  * Write the given binary file into flash at address "addr"
  * @param sl
@@ -2139,7 +2925,7 @@ int stlink_mwrite_flash(stlink_t *sl, uint8_t* data, uint32_t length, stm32_addr
  * @param addr where to start writing
  * @return 0 on success, -ve on failure.
  */
-int stlink_fwrite_flash(stlink_t *sl, const char* path, stm32_addr_t addr) {
+static int stlink_fwrite_flash_nolock(stlink_t *sl, const char* path, stm32_addr_t addr) {
     /* write the file in flash at addr */
     int err;
     unsigned int num_empty, idx;
@@ -2167,3 +2953,12 @@ int stlink_fwrite_flash(stlink_t *sl, const char* path, stm32_addr_t addr) {
     unmap_file(&mf);
     return err;
 }
+
+int stlink_fwrite_flash(stlink_t *sl, const char* path, stm32_addr_t addr) {
+    int ret;
+
+    stlink_lock(sl);
+    ret = stlink_fwrite_flash_nolock(sl, path, addr);
+    stlink_unlock(sl);
+    return ret;
+}
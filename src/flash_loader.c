@@ -1,6 +1,7 @@
 #include "stlink.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -174,10 +175,80 @@ static const uint8_t loader_code_stm32vl[] = {
 
 
 
-int stlink_flash_loader_init(stlink_t *sl, flash_loader_t *fl)
+/* FNV-1a, only has to notice the loader being overwritten */
+static uint32_t stlink_flash_loader_checksum(const uint8_t *data, size_t len)
+{
+    uint32_t sum = 2166136261u;
+
+    while (len--)
+        sum = (sum ^ *data++) * 16777619u;
+    return sum;
+}
+
+/* Called with the lock held for everything that writes target memory */
+void stlink_flash_loader_touch(stlink_t *sl, stm32_addr_t addr, size_t len)
+{
+    if (sl->loader.code != NULL &&
+        addr < sl->sram_base + sl->loader.size && addr + len > sl->sram_base)
+        sl->loader.verify = true;
+}
+
+/* After a reset the target ran on its own, nothing it left in sram can be trusted */
+void stlink_flash_loader_forget(stlink_t *sl)
+{
+    sl->loader.code = NULL;
+    sl->loader.verify = false;
+    sl->loader.voltage = 0;
+}
+
+/* Target voltage as used to pick the loader and flash parallelism, read once per reset */
+int stlink_flash_loader_voltage(stlink_t *sl)
+{
+    if (sl->loader.voltage <= 0) {
+        int voltage = stlink_target_voltage(sl);
+        if (voltage == -1)
+            return -1;
+        sl->loader.voltage = voltage;
+    }
+    return sl->loader.voltage;
+}
+
+static bool stlink_flash_loader_resident(stlink_t *sl)
+{
+    uint8_t *buf;
+    bool ok;
+
+    if (sl->loader.code == NULL)
+        return false;
+    if (!sl->loader.verify)
+        return true;
+
+    /* the core ran or that sram was written, look whether the loader survived */
+    buf = malloc(sl->loader.size);
+    ok = buf != NULL &&
+         stlink_read_mem(sl, sl->sram_base, buf, sl->loader.size) == 0 &&
+         stlink_flash_loader_checksum(buf, sl->loader.size) == sl->loader.checksum;
+    free(buf);
+
+    if (ok)
+        sl->loader.verify = false;
+    else
+        sl->loader.code = NULL;
+    return ok;
+}
+
+static int stlink_flash_loader_init_nolock(stlink_t *sl, flash_loader_t *fl)
 {
 	size_t size;
 
+	/* still in sram from an earlier write */
+	if (stlink_flash_loader_resident(sl)) {
+		fl->loader_addr = sl->sram_base;
+		fl->buf_addr = fl->loader_addr + (uint32_t) sl->loader.size;
+		DLOG("Flash loader still in sram\n");
+		return 0;
+	}
+
 	/* allocate the loader in sram */
 	if (stlink_flash_loader_write_to_sram(sl, &fl->loader_addr, &size) == -1) {
 		WLOG("Failed to write flash loader to sram!\n");
@@ -191,7 +262,17 @@ int stlink_flash_loader_init(stlink_t *sl, flash_loader_t *fl)
 	return 0;
 }
 
-int stlink_flash_loader_write_to_sram(stlink_t *sl, stm32_addr_t* addr, size_t* size)
+int stlink_flash_loader_init(stlink_t *sl, flash_loader_t *fl)
+{
+    int ret;
+
+    stlink_lock(sl);
+    ret = stlink_flash_loader_init_nolock(sl, fl);
+    stlink_unlock(sl);
+    return ret;
+}
+
+static int stlink_flash_loader_write_to_sram_nolock(stlink_t *sl, stm32_addr_t* addr, size_t* size)
 {
     const uint8_t* loader_code;
     size_t loader_size;
@@ -228,7 +309,7 @@ int stlink_flash_loader_write_to_sram(stlink_t *sl, stm32_addr_t* addr, size_t*
             loader_size = sizeof(loader_code_stm32f4);
         }
         else {
-            int voltage = stlink_target_voltage(sl);
+            int voltage = stlink_flash_loader_voltage(sl);
             if (voltage == -1) {
                 printf("Failed to read Target voltage\n");
                 return voltage;
@@ -259,7 +340,13 @@ int stlink_flash_loader_write_to_sram(stlink_t *sl, stm32_addr_t* addr, size_t*
     }
 
     memcpy(sl->q_buf, loader_code, loader_size);
-    stlink_write_mem32(sl, sl->sram_base, loader_size);
+    if (stlink_write_mem32(sl, sl->sram_base, loader_size))
+        return -1;
+
+    sl->loader.code = loader_code;
+    sl->loader.size = loader_size;
+    sl->loader.checksum = stlink_flash_loader_checksum(loader_code, loader_size);
+    sl->loader.verify = false;
 
     *addr = sl->sram_base;
     *size = loader_size;
@@ -268,9 +355,19 @@ int stlink_flash_loader_write_to_sram(stlink_t *sl, stm32_addr_t* addr, size_t*
     return 0;
 }
 
-int stlink_flash_loader_run(stlink_t *sl, flash_loader_t* fl, stm32_addr_t target, const uint8_t* buf, size_t size)
+int stlink_flash_loader_write_to_sram(stlink_t *sl, stm32_addr_t* addr, size_t* size)
 {
-    struct stlink_reg rr;
+    int ret;
+
+    stlink_lock(sl);
+    ret = stlink_flash_loader_write_to_sram_nolock(sl, addr, size);
+    stlink_unlock(sl);
+    return ret;
+}
+
+static int stlink_flash_loader_run_nolock(stlink_t *sl, flash_loader_t* fl, stm32_addr_t target, const uint8_t* buf, size_t size)
+{
+    uint32_t regs[STLINK_REG_COUNT];
     int i = 0;
     size_t count = 0;
 
@@ -296,15 +393,16 @@ int stlink_flash_loader_run(stlink_t *sl, flash_loader_t* fl, stm32_addr_t targe
             ++count;
     }
 
-    /* setup core */
-    stlink_write_reg(sl, fl->buf_addr, 0); /* source */
-    stlink_write_reg(sl, target, 1); /* target */
-    stlink_write_reg(sl, (uint32_t) count, 2); /* count */
-    stlink_write_reg(sl, 0, 3); /* flash bank 0 (input), only used on F0, but armless fopr others */
-    stlink_write_reg(sl, fl->loader_addr, 15); /* pc register */
-
-    /* run loader */
-    stlink_run(sl);
+    /* setup core and run loader, all in one exchange */
+    regs[0] = fl->buf_addr; /* source */
+    regs[1] = target; /* target */
+    regs[2] = (uint32_t) count; /* count */
+    regs[3] = 0; /* flash bank 0 (input), only used on F0, but armless fopr others */
+    regs[15] = fl->loader_addr; /* pc register */
+    if (stlink_write_regs_run(sl, 0x800f, regs)) {
+        ELOG("flash loader setup error\n");
+        return -1;
+    }
 
 #define WAIT_ROUNDS 10000
     /* wait until done (reaches breakpoint) */
@@ -320,11 +418,20 @@ int stlink_flash_loader_run(stlink_t *sl, flash_loader_t* fl, stm32_addr_t targe
     }
 
     /* check written byte count */
-    stlink_read_reg(sl, 2, &rr);
-    if (rr.r[2] != 0) {
-        ELOG("write error, count == %u\n", rr.r[2]);
+    if (stlink_read_regs(sl, 1u << 2, regs) || regs[2] != 0) {
+        ELOG("write error, count == %u\n", regs[2]);
         return -1;
     }
 
     return 0;
 }
+
+int stlink_flash_loader_run(stlink_t *sl, flash_loader_t* fl, stm32_addr_t target, const uint8_t* buf, size_t size)
+{
+    int ret;
+
+    stlink_lock(sl);
+    ret = stlink_flash_loader_run_nolock(sl, fl, target, buf, size);
+    stlink_unlock(sl);
+    return ret;
+}
@@ -8,152 +8,324 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <errno.h>
 #ifdef __MINGW32__
 #include <mingw.h>
 #else
 #include <unistd.h>
-#include <sys/poll.h>
+#include <fcntl.h>
 #endif
 
-static const char hex[] = "0123456789abcdef";
+#include "gdb-remote.h"
 
-int gdb_send_packet(int fd, char* data) {
-    unsigned int data_length = (unsigned int) strlen(data);
-    int length = data_length + 4;
-    char* packet = malloc(length); /* '$' data (hex) '#' cksum (hex) */
+/* "00" "01" ... "ff": the two digits of every byte value */
+#define HEX_ROW(h) h "0" h "1" h "2" h "3" h "4" h "5" h "6" h "7" \
+                   h "8" h "9" h "a" h "b" h "c" h "d" h "e" h "f"
+static const char hex_pairs[] =
+    HEX_ROW("0") HEX_ROW("1") HEX_ROW("2") HEX_ROW("3")
+    HEX_ROW("4") HEX_ROW("5") HEX_ROW("6") HEX_ROW("7")
+    HEX_ROW("8") HEX_ROW("9") HEX_ROW("a") HEX_ROW("b")
+    HEX_ROW("c") HEX_ROW("d") HEX_ROW("e") HEX_ROW("f");
 
-    memset(packet, 0, length);
+/* Digit value plus one, 0 for anything that is not a hex digit */
+static const uint8_t hex_values[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
 
-    packet[0] = '$';
+/* out gets 2 * len digits, no NUL */
+unsigned int gdb_hex_encode(const uint8_t* in, unsigned int len, char* out) {
+    for(unsigned int i = 0; i < len; i++)
+        memcpy(&out[2 * i], &hex_pairs[2 * in[i]], 2);
+
+    return 2 * len;
+}
 
-    uint8_t cksum = 0;
-    for(unsigned int i = 0; i < data_length; i++) {
-        packet[i + 1] = data[i];
-        cksum += data[i];
+/* Decodes up to len bytes, stops early at the first non hex digit */
+unsigned int gdb_hex_decode(const char* in, unsigned int len, uint8_t* out) {
+    unsigned int i;
+
+    for(i = 0; i < len; i++) {
+        unsigned int hi = hex_values[(uint8_t) in[2 * i]], lo;
+
+        if(hi == 0 || (lo = hex_values[(uint8_t) in[2 * i + 1]]) == 0)
+            break;
+        out[i] = (uint8_t) ((hi - 1) << 4 | (lo - 1));
     }
 
-    packet[length - 3] = '#';
-    packet[length - 2] = hex[cksum >> 4];
-    packet[length - 1] = hex[cksum & 0xf];
+    return i;
+}
 
-    while(1) {
-        if(write(fd, packet, length) != length) {
-            free(packet);
+/* Modulo 256 sum of the payload, four bytes per round */
+uint8_t gdb_checksum(const char* data, unsigned int len) {
+    const uint8_t* p = (const uint8_t*) data;
+    unsigned int a = 0, b = 0, c = 0, d = 0, i = 0;
+
+    for(; i + 4 <= len; i += 4) {
+        a += p[i];
+        b += p[i + 1];
+        c += p[i + 2];
+        d += p[i + 3];
+    }
+    for(; i < len; i++)
+        a += p[i];
+
+    return (uint8_t) (a + b + c + d);
+}
+
+void gdb_conn_init(struct gdb_conn* conn, int fd) {
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = fd;
+    conn->out_fd = fd;
+}
+
+/* One client must not stall the others: reads and writes never wait */
+void gdb_conn_nonblock(struct gdb_conn* conn) {
+#ifdef __MINGW32__
+    u_long mode = 1;
+    ioctlsocket(conn->fd, FIONBIO, &mode);
+#else
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+    if(conn->out_fd != conn->fd)
+        fcntl(conn->out_fd, F_SETFL, fcntl(conn->out_fd, F_GETFL) | O_NONBLOCK);
+#endif
+}
+
+void gdb_conn_free(struct gdb_conn* conn) {
+    free(conn->packet);
+    free(conn->out);
+    conn->packet = conn->out = NULL;
+    conn->packet_size = conn->out_size = 0;
+    conn->out_pos = conn->out_len = conn->out_last = 0;
+}
+
+/* Next byte from the client, read in chunks */
+static int gdb_getc(struct gdb_conn* conn) {
+    if(conn->in_pos == conn->in_len) {
+        ssize_t n = read(conn->fd, conn->in, sizeof(conn->in));
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return GDB_AGAIN;
+        if(n <= 0)
             return -2;
-        }
+        conn->in_pos = 0;
+        conn->in_len = (unsigned) n;
+    }
+
+    return (unsigned char) conn->in[conn->in_pos++];
+}
 
-        char ack;
-        if(read(fd, &ack, 1) != 1) {
-            free(packet);
+/* Writes what the fd takes of the pending output, GDB_AGAIN if some is left */
+int gdb_flush(struct gdb_conn* conn) {
+    while(conn->out_pos < conn->out_len) {
+        ssize_t n = write(conn->out_fd, conn->out + conn->out_pos, conn->out_len - conn->out_pos);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return GDB_AGAIN;
+        if(n <= 0)
             return -2;
-        }
+        conn->out_pos += (unsigned) n;
+    }
+
+    return 0;
+}
+
+int gdb_send_packet(struct gdb_conn* conn, char* data) {
+    return gdb_send_packet_len(conn, data, (unsigned int) strlen(data));
+}
+
+/*
+ * Queues the packet behind whatever is not written yet and writes as much
+ * as the fd takes.  The ack is picked up later by gdb_recv_packet().
+ */
+int gdb_send_packet_len(struct gdb_conn* conn, const char* data, unsigned int data_length) {
+    unsigned int length = data_length + 4; /* '$' data '#' cksum (hex) */
+    unsigned int keep = conn->out_len - conn->out_pos;
+
+    if(keep + length > conn->out_size) {
+        char* out = realloc(conn->out, keep + length);
+        if(out == NULL)
+            return -1;
+        conn->out = out;
+        conn->out_size = keep + length;
+    }
+
+    memmove(conn->out, conn->out + conn->out_pos, keep);
+    conn->out_pos = 0;
+    conn->out_last = keep;
+    conn->out_len = keep + length;
+
+    char* packet = conn->out + keep;
+    packet[0] = '$';
+    memcpy(packet + 1, data, data_length);
+
+    uint8_t cksum = gdb_checksum(data, data_length);
+
+    packet[length - 3] = '#';
+    memcpy(&packet[length - 2], &hex_pairs[2 * cksum], 2);
 
-        if(ack == '+') {
-            free(packet);
-            return 0;
+    conn->ack_pending = !conn->noack;
+
+    int ret = gdb_flush(conn);
+    return ret == GDB_AGAIN ? 0 : ret;
+}
+
+/*
+ * Binary packet payloads escape '#', '$', '}' and '*' as '}' followed by the
+ * byte xor 0x20.  out must have room for 2 * len bytes.
+ */
+unsigned int gdb_escape_binary(const uint8_t* in, unsigned int len, char* out) {
+    unsigned int o = 0;
+
+    for(unsigned int i = 0; i < len; i++) {
+        uint8_t c = in[i];
+
+        if(c == '#' || c == '$' || c == '}' || c == '*') {
+            out[o++] = '}';
+            c ^= 0x20;
         }
+        out[o++] = (char) c;
     }
+
+    return o;
+}
+
+/* Undoes gdb_escape_binary in place, returns the decoded length */
+unsigned int gdb_unescape_binary(char* data, unsigned int len) {
+    unsigned int o = 0;
+
+    for(unsigned int i = 0; i < len; i++) {
+        if(data[i] == '}' && i + 1 < len)
+            data[o++] = data[++i] ^ 0x20;
+        else
+            data[o++] = data[i];
+    }
+
+    return o;
 }
 
 #define ALLOC_STEP 1024
 
-int gdb_recv_packet(int fd, char** buffer) {
-    unsigned packet_size = ALLOC_STEP + 1, packet_idx = 0;
-    uint8_t cksum = 0;
-    char recv_cksum[3] = {0};
-    char* packet_buffer = malloc(packet_size);
-    unsigned state;
+/*
+ * Feeds what the client sent so far through the packet parser.  Returns the
+ * length of a complete packet, GDB_AGAIN while it is not complete yet, and
+ * takes care of acks both ways on the way.
+ */
+int gdb_recv_packet(struct gdb_conn* conn, char** buffer) {
+    int c;
 
-start:
-    state = 0;
     /*
      * 0: waiting $
      * 1: data, waiting #
      * 2: cksum 1
      * 3: cksum 2
-     * 4: fin
      */
-
-    char c;
-    while(state != 4) {
-        if(read(fd, &c, 1) != 1) {
-            return -2;
+    while(1) {
+        if((c = gdb_getc(conn)) < 0) {
+            return c;
         }
 
-        switch(state) {
+        switch(conn->rx_state) {
         case 0:
-            if(c != '$') {
-                // ignore
-            } else {
-                state = 1;
+            if(c == '$') {
+                conn->rx_state = 1;
+                conn->rx_len = 0;
+                conn->rx_cksum = 0;
+            } else if(c == '+' && conn->ack_pending) {
+                conn->ack_pending = 0;
+            } else if(c == '-' && conn->ack_pending && conn->out_pos == conn->out_len) {
+                /* resend the last packet */
+                conn->out_pos = conn->out_last;
+                int ret = gdb_flush(conn);
+                if(ret != 0)
+                    return ret;
             }
             break;
 
-        case 1:
+        case 1: {
             if(c == '#') {
-                state = 2;
-            } else {
-                packet_buffer[packet_idx++] = c;
-                cksum += c;
-
-                if(packet_idx == packet_size) {
-                    packet_size += ALLOC_STEP;
-                    packet_buffer = realloc(packet_buffer, packet_size);
-                }
+                conn->rx_state = 2;
+                break;
+            }
+
+            /* the rest of the buffer up to '#' in one go, c is its first byte */
+            const char* data = &conn->in[conn->in_pos - 1];
+            unsigned avail = conn->in_len - conn->in_pos + 1;
+            const char* end = memchr(data, '#', avail);
+            unsigned n = end ? (unsigned) (end - data) : avail;
+
+            /* one spare byte for the terminating NUL */
+            if(conn->rx_len + n + 1 > conn->packet_size) {
+                unsigned size = conn->packet_size ? conn->packet_size : ALLOC_STEP;
+                while(conn->rx_len + n + 1 > size)
+                    size *= 2;
+                char* packet = realloc(conn->packet, size);
+                if(packet == NULL)
+                    return -1;
+                conn->packet = packet;
+                conn->packet_size = size;
+            }
+
+            memcpy(&conn->packet[conn->rx_len], data, n);
+            conn->rx_cksum += gdb_checksum(data, n);
+            conn->rx_len += n;
+            conn->in_pos += n - 1;
+            if(end) {
+                conn->in_pos++;
+                conn->rx_state = 2;
             }
             break;
+        }
 
         case 2:
-            recv_cksum[0] = c;
-            state = 3;
+            conn->rx_digits[0] = hex_values[c];
+            conn->rx_state = 3;
             break;
 
-        case 3:
-            recv_cksum[1] = c;
-            state = 4;
-            break;
-        }
-    }
+        case 3: {
+            unsigned len = conn->rx_len;
 
-    uint8_t recv_cksum_int = strtoul(recv_cksum, NULL, 16);
-    if(recv_cksum_int != cksum) {
-        char nack = '-';
-        if(write(fd, &nack, 1) != 1) {
-            return -2;
-        }
+            conn->rx_digits[1] = hex_values[c];
+            conn->rx_state = 0;
 
-        goto start;
-    } else {
-        char ack = '+';
-        if(write(fd, &ack, 1) != 1) {
-            return -2;
-        }
-    }
+            if(!conn->noack) {
+                char ack = '+';
+
+                if(conn->rx_digits[0] == 0 || conn->rx_digits[1] == 0 ||
+                   (uint8_t) ((conn->rx_digits[0] - 1) << 4 | (conn->rx_digits[1] - 1)) != conn->rx_cksum)
+                    ack = '-';
+                if(write(conn->out_fd, &ack, 1) != 1) {
+                    return -2;
+                }
+                if(ack == '-')
+                    break;      /* GDB sends it again */
+            }
+
+            if(conn->packet == NULL && (conn->packet = malloc(ALLOC_STEP)) != NULL)
+                conn->packet_size = ALLOC_STEP;
+            if(conn->packet == NULL)
+                return -1;
 
-    packet_buffer[packet_idx] = 0;
-    *buffer = packet_buffer;
+            conn->packet[len] = 0;
+            *buffer = conn->packet;
 
-    return packet_idx;
+            return (int) len;
+        }
+        }
+    }
 }
 
 // Here we skip any characters which are not \x03, GDB interrupt.
-// As we use the mode with ACK, in a (very unlikely) situation of a packet
-// lost because of this skipping, it will be resent anyway.
-int gdb_check_for_interrupt(int fd) {
-    struct pollfd pfd;
-    pfd.fd = fd;
-    pfd.events = POLLIN;
-
-    if(poll(&pfd, 1, 0) != 0) {
-        char c;
-
-        if(read(fd, &c, 1) != 1)
-            return -2;
+// GDB sends nothing else while the target runs; in the mode with ACK, in a
+// (very unlikely) situation of a packet lost because of this skipping, it
+// will be resent anyway.  Everything readable right now is looked at.
+int gdb_check_for_interrupt(struct gdb_conn* conn) {
+    int c;
 
+    while((c = gdb_getc(conn)) >= 0) {
         if(c == '\x03') // ^C
             return 1;
     }
 
-    return 0;
+    return c == GDB_AGAIN ? 0 : -2;
 }
-
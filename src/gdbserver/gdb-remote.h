@@ -1,8 +1,54 @@
 #ifndef _GDB_REMOTE_H_
 #define _GDB_REMOTE_H_
 
-int gdb_send_packet(int fd, char* data);
-int gdb_recv_packet(int fd, char** buffer);
-int gdb_check_for_interrupt(int fd);
+#include <stdint.h>
+
+#define GDB_CONN_BUF 4096
+
+/* Nothing complete yet, wait until the fd is ready again */
+#define GDB_AGAIN (-3)
+
+/*
+ * One client connection: buffered input, and packet buffers that are kept
+ * and reused for the whole session.  A received packet stays valid until
+ * the next gdb_recv_packet().  With non-blocking fds a packet may arrive
+ * in pieces and a reply may go out in pieces, so both are kept here.
+ */
+struct gdb_conn {
+    int fd;
+    int out_fd;             /* same as fd, except for a pipe */
+    int noack;              /* QStartNoAckMode negotiated */
+
+    char in[GDB_CONN_BUF];
+    unsigned in_pos, in_len;
+
+    char* packet;
+    unsigned packet_size;
+    unsigned rx_state;      /* where gdb_recv_packet() stopped */
+    unsigned rx_len;
+    uint8_t rx_cksum;
+    uint8_t rx_digits[2];
+
+    char* out;
+    unsigned out_size;
+    unsigned out_pos, out_len;  /* out[out_pos..out_len) is not written yet */
+    unsigned out_last;          /* start of the last packet, for a resend */
+    int ack_pending;            /* the last packet was not acked yet */
+};
+
+void gdb_conn_init(struct gdb_conn* conn, int fd);
+void gdb_conn_nonblock(struct gdb_conn* conn);
+void gdb_conn_free(struct gdb_conn* conn);
+
+int gdb_flush(struct gdb_conn* conn);
+int gdb_send_packet(struct gdb_conn* conn, char* data);
+int gdb_send_packet_len(struct gdb_conn* conn, const char* data, unsigned int data_length);
+int gdb_recv_packet(struct gdb_conn* conn, char** buffer);
+unsigned int gdb_hex_encode(const uint8_t* in, unsigned int len, char* out);
+unsigned int gdb_hex_decode(const char* in, unsigned int len, uint8_t* out);
+uint8_t gdb_checksum(const char* data, unsigned int len);
+unsigned int gdb_escape_binary(const uint8_t* in, unsigned int len, char* out);
+unsigned int gdb_unescape_binary(char* data, unsigned int len);
+int gdb_check_for_interrupt(struct gdb_conn* conn);
 
 #endif
@@ -10,15 +10,21 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #ifdef __MINGW32__
 #include <mingw.h>
 #else
 #include <unistd.h>
+#include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #endif
 
+#include <pthread.h>
+
 #include <stlink.h>
 #include <stlink/logging.h>
 
@@ -31,18 +37,10 @@
 /* Semihosting doesn't have a short option, we define a value to identify it */
 #define SEMIHOSTING_OPTION 128
 #define SERIAL_OPTION 127
+#define PIPE_OPTION 126
+#define UNIX_SOCKET_OPTION 125
 
-//Allways update the FLASH_PAGE before each use, by calling stlink_calculate_pagesize
-#define FLASH_PAGE (sl->flash_pgsz)
-
-static stlink_t *connected_stlink = NULL;
-static bool semihosting = false;
-static bool serial_specified = false;
-static char serialnumber[28] = {0};
-
-static const char hex[] = "0123456789abcdef";
-
-static const char* current_memory_map = NULL;
+#define UNIX_SOCKET_PATH_MAX 104    /* smallest sun_path around */
 
 typedef struct _st_state_t {
     // things from command line, bleh
@@ -51,21 +49,186 @@ typedef struct _st_state_t {
     int listen_port;
     int persistent;
     int reset;
+    bool semihosting;
+    bool serial_specified;
+    char serialnumber[28];
+    bool pipe;                  /* RSP on stdin/stdout */
+    char unix_socket[UNIX_SOCKET_PATH_MAX];     /* listen here instead of on listen_port */
 } st_state_t;
 
+/*
+ * DWT_COMP0     0xE0001020
+ * DWT_MASK0     0xE0001024
+ * DWT_FUNCTION0 0xE0001028
+ * DWT_COMP1     0xE0001030
+ * DWT_MASK1     0xE0001034
+ * DWT_FUNCTION1 0xE0001038
+ * DWT_COMP2     0xE0001040
+ * DWT_MASK2     0xE0001044
+ * DWT_FUNCTION2 0xE0001048
+ * DWT_COMP3     0xE0001050
+ * DWT_MASK3     0xE0001054
+ * DWT_FUNCTION3 0xE0001058
+ */
+
+#define DATA_WATCH_NUM 4
+
+enum watchfun { WATCHDISABLED = 0, WATCHREAD = 5, WATCHWRITE = 6, WATCHACCESS = 7 };
+
+struct code_hw_watchpoint {
+    stm32_addr_t addr;
+    uint8_t mask;
+    enum watchfun fun;
+};
+
+#define CODE_BREAK_NUM_MAX	15
+#define CODE_BREAK_LOW	0x01
+#define CODE_BREAK_HIGH	0x02
+
+struct code_hw_breakpoint {
+    stm32_addr_t addr;
+    int          type;
+};
+
+#define FLASH_STREAM_CHUNK  0x4000
+
+struct flash_block {
+    stm32_addr_t addr;
+    unsigned     length;
+    uint8_t*     data;
+
+    unsigned     filled;        /* bytes written by GDB from the start on */
+    unsigned     queued;        /* handed to the worker, page aligned */
+    unsigned     programmed;    /* done by the worker */
+    bool         rewrite;       /* GDB wrote below queued, program it all again */
+};
+
+struct cache_level_desc
+{
+  unsigned int nsets;
+  unsigned int nways;
+  unsigned int log2_nways;
+  unsigned int width;
+};
+
+struct cache_desc_t
+{
+  /* Minimal line size in bytes.  */
+  unsigned int dminline;
+  unsigned int iminline;
+
+  /* Last level of unification (uniprocessor).  */
+  unsigned int louu;
+
+  struct cache_level_desc icache[7];
+  struct cache_level_desc dcache[7];
+};
+
+/*
+ * Scratch memory for handling one packet: replies and the buffers they are
+ * built from come out of it and it is reset before the next packet.  Once
+ * the chunks consolidated into one big enough for the largest packet seen,
+ * the request/response path does not touch the heap any more.
+ */
+#define ARENA_CHUNK         0x4000
+
+struct arena_chunk {
+    struct arena_chunk* next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+#define MEM_CACHE_LINE      64
+#define MEM_CACHE_LINES     256
+#define MEM_CACHE_AHEAD     8
+
+/*
+ * Everything that belongs to one probe: its options, the open stlink, the
+ * listening socket and the GDB connection, and what we track of the target.
+ */
+struct gdb_session {
+    st_state_t st;
+    stlink_t *sl;
+    const char* memory_map;
+    bool semihosting;
+
+    int listen_sock;
+    int client;                 /* -1 while no GDB is connected */
+    struct gdb_conn conn;
+    unsigned int attached;
+    bool running;               /* resumed by c, waiting for the core to halt */
+    int poll_delay;             /* ms between halt polls */
+    long long next_poll;        /* ms, see now_ms() */
+
+    struct code_hw_watchpoint data_watches[DATA_WATCH_NUM];
+    int code_break_num;
+    int code_lit_num;
+    struct code_hw_breakpoint code_breaks[CODE_BREAK_NUM_MAX];
+
+    struct flash_block* flash_blocks;
+    unsigned flash_block_count;
+    struct {
+        pthread_mutex_t lock;
+        pthread_cond_t  cond;
+        pthread_t       thread;
+        bool            running;
+        bool            stop;
+        int             error;
+    } flash_stream;
+
+    struct cache_desc_t cache_desc;
+    int cache_modified;
+
+    struct {
+        stm32_addr_t addr[MEM_CACHE_LINES];
+        bool         valid[MEM_CACHE_LINES];
+        uint8_t      data[MEM_CACHE_LINES][MEM_CACHE_LINE];
+        stm32_addr_t next;      /* end of the last read */
+    } mem_cache;
+
+    struct {
+        struct stlink_reg regs;
+        bool core;              /* r0-r15, xPSR, MSP, PSP */
+        bool extra;             /* CONTROL, masks and, with an FPU, s0-s31 and FPSCR */
+    } reg_cache;
+
+    struct arena_chunk* arena;  /* newest chunk first */
+};
+
+/* all sessions, for the signal handler */
+static struct gdb_session **sessions;
+static int session_count;
+
+/* --serial may be given once per probe */
+#define MAX_TARGETS 32
+static char* target_serials[MAX_TARGETS];
+static int target_count;
+
+/* with --pipe, the original stdout */
+static int pipe_out = -1;
+
 
-int serve(stlink_t *sl, st_state_t *st);
+int serve(struct gdb_session **all, int count);
 char* make_memory_map(stlink_t *sl);
-static void init_cache (stlink_t *sl);
+static void init_cache (struct gdb_session *gs);
 
 static void cleanup(int signum) {
 	(void)signum;
 
-    if (connected_stlink) {
-        /* Switch back to mass storage mode before closing. */
-        stlink_run(connected_stlink);
-        stlink_exit_debug_mode(connected_stlink);
-        stlink_close(connected_stlink);
+    for (int i = 0; i < session_count; i++) {
+        stlink_t *sl = sessions[i]->sl;
+
+#ifndef __MINGW32__
+        if (sessions[i]->listen_sock >= 0 && sessions[i]->st.unix_socket[0])
+            unlink(sessions[i]->st.unix_socket);
+#endif
+        if (sl) {
+            /* Switch back to mass storage mode before closing. */
+            stlink_run(sl);
+            stlink_exit_debug_mode(sl);
+            stlink_close(sl);
+        }
     }
 
     exit(1);
@@ -76,8 +239,8 @@ static stlink_t* do_connect(st_state_t *st) {
     stlink_t *ret = NULL;
     switch (st->stlink_version) {
         case 2:
-            if(serial_specified){
-                ret = stlink_open_usb(st->logging_level, st->reset, serialnumber);
+            if(st->serial_specified){
+                ret = stlink_open_usb(st->logging_level, st->reset, st->serialnumber);
             }
             else{
                 ret = stlink_open_usb(st->logging_level, st->reset, NULL);
@@ -103,6 +266,8 @@ int parse_options(int argc, char** argv, st_state_t *st) {
         {"version", no_argument, NULL, 'V'},
         {"semihosting", no_argument, NULL, SEMIHOSTING_OPTION},
 	  {"serial", required_argument, NULL, SERIAL_OPTION},
+        {"pipe", no_argument, NULL, PIPE_OPTION},
+        {"unix-socket", required_argument, NULL, UNIX_SOCKET_OPTION},
         {0, 0, 0, 0},
     };
     const char * help_str = "%s - usage:\n\n"
@@ -123,8 +288,15 @@ int parse_options(int argc, char** argv, st_state_t *st) {
         "\t\t\tDo not reset board on connection.\n"
         "  --semihosting\n"
         "\t\t\tEnable semihosting support.\n"
-        "  --serial <serial>\n"
-        "\t\t\tUse a specific serial number.\n"
+        "  --serial <serial>[:<port>|:<socket>]\n"
+        "\t\t\tUse a specific serial number. Given more than once, one\n"
+        "\t\t\tst-util serves all the probes, each on its own port\n"
+        "\t\t\t(by default the listen port, plus one for every probe).\n"
+        "  --pipe\n"
+        "\t\t\tTalk to GDB on stdin and stdout instead of listening,\n"
+        "\t\t\tfor (gdb) target remote | st-util --pipe\n"
+        "  --unix-socket <path>\n"
+        "\t\t\tListen on a Unix domain socket instead of a TCP port.\n"
         "\n"
         "The STLINKv2 device to use can be specified in the environment\n"
         "variable STLINK_DEVICE on the format <USB_BUS>:<USB_ADDR>.\n"
@@ -179,20 +351,24 @@ int parse_options(int argc, char** argv, st_state_t *st) {
                 printf("v%s\n", STLINK_VERSION);
                 exit(EXIT_SUCCESS);
             case SEMIHOSTING_OPTION:
-                semihosting = true;
+                st->semihosting = true;
                 break;
             case SERIAL_OPTION:
-                printf("use serial %s\n",optarg);
-                            /** @todo This is not really portable, as strlen really returns size_t we need to obey and not cast it to a signed type. */
-                int j = (int)strlen(optarg);
-                int length = j / 2;  //the length of the destination-array
-                if(j % 2 != 0) return -1;
-                for(size_t k = 0; j >= 0 && k < sizeof(serialnumber); ++k, j -= 2) {
-                    char buffer[3] = {0};
-                    memcpy(buffer, optarg + j, 2);
-                    serialnumber[length - k] = (uint8_t)strtol(buffer, NULL, 16);
+                if (target_count == MAX_TARGETS) {
+                    fprintf(stderr, "At most %d probes can be served\n", MAX_TARGETS);
+                    exit(EXIT_FAILURE);
+                }
+                target_serials[target_count++] = optarg;
+                break;
+            case PIPE_OPTION:
+                st->pipe = true;
+                break;
+            case UNIX_SOCKET_OPTION:
+                if (strlen(optarg) >= sizeof(st->unix_socket)) {
+                    fprintf(stderr, "Socket path too long: %s\n", optarg);
+                    exit(EXIT_FAILURE);
                 }
-                serial_specified = true;
+                strcpy(st->unix_socket, optarg);
                 break;
         }
     }
@@ -206,8 +382,80 @@ int parse_options(int argc, char** argv, st_state_t *st) {
     return 0;
 }
 
+/* Serial number as --serial gives it, optionally followed by :port or :socket */
+static int parse_serial(const char *arg, st_state_t *st) {
+    char serial[2 * sizeof(st->serialnumber) + 1] = {0};
+    const char *port = strchr(arg, ':');
+    size_t len = port ? (size_t) (port - arg) : strlen(arg);
+
+    /* the bytes are stored reversed, behind a terminating zero */
+    if (len > 2 * sizeof(st->serialnumber) - 2)
+        return -1;
+    memcpy(serial, arg, len);
+    if (port && port[1 + strspn(port + 1, "0123456789")] != '\0') {
+        if (strlen(port + 1) >= sizeof(st->unix_socket))
+            return -1;
+        strcpy(st->unix_socket, port + 1);
+    } else if (port) {
+        st->listen_port = atoi(port + 1);
+        st->unix_socket[0] = '\0';
+    }
+
+    fprintf(stderr, "use serial %s\n", serial);
+    /** @todo This is not really portable, as strlen really returns size_t we need to obey and not cast it to a signed type. */
+    int j = (int)strlen(serial);
+    int length = j / 2;  //the length of the destination-array
+    if(j % 2 != 0) return -1;
+    for(size_t k = 0; j >= 0 && k < sizeof(st->serialnumber); ++k, j -= 2) {
+        char buffer[3] = {0};
+        memcpy(buffer, serial + j, 2);
+        st->serialnumber[length - k] = (uint8_t)strtol(buffer, NULL, 16);
+    }
+    st->serial_specified = true;
+    return 0;
+}
+
+static bool port_taken(const st_state_t *targets, int count, int port) {
+    for (int i = 0; i < count; i++) {
+        if (!targets[i].unix_socket[0] && targets[i].listen_port == port)
+            return true;
+    }
+    return false;
+}
+
+static struct gdb_session* session_open(st_state_t *st) {
+    struct gdb_session *gs = calloc(1, sizeof(*gs));
+    if (gs == NULL)
+        return NULL;
+
+    gs->st = *st;
+    gs->semihosting = st->semihosting;
+    gs->listen_sock = -1;
+    gs->client = -1;
+    pthread_mutex_init(&gs->flash_stream.lock, NULL);
+    pthread_cond_init(&gs->flash_stream.cond, NULL);
+
+    gs->sl = do_connect(st);
+    if (gs->sl == NULL) {
+        free(gs);
+        return NULL;
+    }
+
+    if (st->reset) {
+        stlink_reset(gs->sl);
+    }
+
+    ILOG("Chip ID is %08x, Core ID is  %08x.\n", gs->sl->chip_id, gs->sl->core_id);
+
+    gs->sl->verbose=0;
+    gs->memory_map = make_memory_map(gs->sl);
+
+    init_cache(gs);
+
+    return gs;
+}
+
 int main(int argc, char** argv) {
-    stlink_t *sl = NULL;
     st_state_t state;
     memset(&state, 0, sizeof(state));
 
@@ -218,26 +466,69 @@ int main(int argc, char** argv) {
     state.reset = 1;    /* By default, reset board */
     parse_options(argc, argv, &state);
 
+    if (state.pipe) {
+        if (target_count > 1) {
+            fprintf(stderr, "--pipe serves a single probe\n");
+            return 1;
+        }
+#ifndef __MINGW32__
+        /* stdout carries the packets now, everything else goes to stderr */
+        pipe_out = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+#endif
+    }
+
     printf("st-util %s\n", STLINK_VERSION);
+    ugly_init(state.logging_level);
 
-    sl = do_connect(&state);
-    if(sl == NULL) return 1;
+    /* keep logging off the packet path */
+    ugly_set_async(1);
+
+    int count = target_count ? target_count : 1;
+    sessions = calloc(count, sizeof(*sessions));
+    if (sessions == NULL) return 1;
 
-    connected_stlink = sl;
     signal(SIGINT, &cleanup);
     signal(SIGTERM, &cleanup);
     signal(SIGSEGV, &cleanup);
 
-    if (state.reset) {
-        stlink_reset(sl);
-    }
+    st_state_t targets[MAX_TARGETS];
+    int next_port = state.listen_port;
 
+    for (int i = 0; i < count; i++) {
+        st_state_t *st = &targets[i];
 
+        *st = state;
+        st->listen_port = 0;    /* unless --serial gives one */
+        if (i > 0 && state.unix_socket[0] &&
+            snprintf(st->unix_socket, sizeof(st->unix_socket), "%s.%d", state.unix_socket, i) >= (int) sizeof(st->unix_socket)) {
+            fprintf(stderr, "Socket path too long: %s\n", state.unix_socket);
+            cleanup(0);
+        }
+        if (target_count && parse_serial(target_serials[i], st) != 0) {
+            fprintf(stderr, "Bad serial number: %s\n", target_serials[i]);
+            cleanup(0);
+        }
+        if (st->listen_port && port_taken(targets, i, st->listen_port)) {
+            fprintf(stderr, "Port %d is given twice\n", st->listen_port);
+            cleanup(0);
+        }
+    }
 
-    ILOG("Chip ID is %08x, Core ID is  %08x.\n", sl->chip_id, sl->core_id);
+    /* the rest count up from -p, around the ports given with --serial */
+    for (int i = 0; i < count; i++) {
+        if (targets[i].listen_port || targets[i].unix_socket[0])
+            continue;
+        while (port_taken(targets, count, next_port))
+            next_port++;
+        targets[i].listen_port = next_port++;
+    }
 
-    sl->verbose=0;
-    current_memory_map = make_memory_map(sl);
+    for (int i = 0; i < count; i++) {
+        sessions[i] = session_open(&targets[i]);
+        if (sessions[i] == NULL) cleanup(0);
+        session_count++;
+    }
 
 #ifdef __MINGW32__
     WSADATA	wsadata;
@@ -246,30 +537,14 @@ int main(int argc, char** argv) {
     }
 #endif
 
-    init_cache(sl);
-
-    do {
-        if (serve(sl, &state)) {
-	  sleep (1); // don't go bezurk if serve returns with error
-	}
-
-        /* in case serve() changed the connection */
-        sl = connected_stlink;
-
-        /* Continue */
-        stlink_run(sl);
-    } while (state.persistent);
+    int ret = serve(sessions, session_count);
 
 #ifdef __MINGW32__
 winsock_error:
     WSACleanup();
 #endif
 
-    /* Switch back to mass storage mode before closing. */
-    stlink_exit_debug_mode(sl);
-    stlink_close(sl);
-
-    return 0;
+    return ret;
 }
 
 static const char* const target_description_F4 =
@@ -528,34 +803,9 @@ char* make_memory_map(stlink_t *sl) {
 }
 
 
-/*
- * DWT_COMP0     0xE0001020
- * DWT_MASK0     0xE0001024
- * DWT_FUNCTION0 0xE0001028
- * DWT_COMP1     0xE0001030
- * DWT_MASK1     0xE0001034
- * DWT_FUNCTION1 0xE0001038
- * DWT_COMP2     0xE0001040
- * DWT_MASK2     0xE0001044
- * DWT_FUNCTION2 0xE0001048
- * DWT_COMP3     0xE0001050
- * DWT_MASK3     0xE0001054
- * DWT_FUNCTION3 0xE0001058
- */
-
-#define DATA_WATCH_NUM 4
-
-enum watchfun { WATCHDISABLED = 0, WATCHREAD = 5, WATCHWRITE = 6, WATCHACCESS = 7 };
-
-struct code_hw_watchpoint {
-    stm32_addr_t addr;
-    uint8_t mask;
-    enum watchfun fun;
-};
-
-static struct code_hw_watchpoint data_watches[DATA_WATCH_NUM];
+static void init_data_watchpoints(struct gdb_session *gs) {
+    stlink_t *sl = gs->sl;
 
-static void init_data_watchpoints(stlink_t *sl) {
     uint32_t data;
     DLOG("init watchpoints\n");
 
@@ -566,13 +816,15 @@ static void init_data_watchpoints(stlink_t *sl) {
 
     // make sure all watchpoints are cleared
     for(int i = 0; i < DATA_WATCH_NUM; i++) {
-        data_watches[i].fun = WATCHDISABLED;
+        gs->data_watches[i].fun = WATCHDISABLED;
         stlink_write_debug32(sl, 0xe0001028 + i * 16, 0);
     }
 }
 
-static int add_data_watchpoint(stlink_t *sl, enum watchfun wf,
+static int add_data_watchpoint(struct gdb_session *gs, enum watchfun wf,
                                stm32_addr_t addr, unsigned int len) {
+    stlink_t *sl = gs->sl;
+
     int i = 0;
     uint32_t mask, dummy;
 
@@ -590,12 +842,12 @@ static int add_data_watchpoint(stlink_t *sl, enum watchfun wf,
     if((mask != (uint32_t)-1) && (mask < 16)) {
         for(i = 0; i < DATA_WATCH_NUM; i++) {
             // is this an empty slot ?
-            if(data_watches[i].fun == WATCHDISABLED) {
+            if(gs->data_watches[i].fun == WATCHDISABLED) {
                 DLOG("insert watchpoint %d addr %x wf %u mask %u len %d\n", i, addr, wf, mask, len);
 
-                data_watches[i].fun = wf;
-                data_watches[i].addr = addr;
-                data_watches[i].mask = mask;
+                gs->data_watches[i].fun = wf;
+                gs->data_watches[i].addr = addr;
+                gs->data_watches[i].mask = mask;
 
                 // insert comparator address
                 stlink_write_debug32(sl, 0xE0001020 + i * 16, addr);
@@ -617,15 +869,17 @@ static int add_data_watchpoint(stlink_t *sl, enum watchfun wf,
     return -1;
 }
 
-static int delete_data_watchpoint(stlink_t *sl, stm32_addr_t addr)
+static int delete_data_watchpoint(struct gdb_session *gs, stm32_addr_t addr)
 {
+    stlink_t *sl = gs->sl;
+
     int i;
 
     for(i = 0 ; i < DATA_WATCH_NUM; i++) {
-        if((data_watches[i].addr == addr) && (data_watches[i].fun != WATCHDISABLED)) {
+        if((gs->data_watches[i].addr == addr) && (gs->data_watches[i].fun != WATCHDISABLED)) {
             DLOG("delete watchpoint %d addr %x\n", i, addr);
 
-            data_watches[i].fun = WATCHDISABLED;
+            gs->data_watches[i].fun = WATCHDISABLED;
             stlink_write_debug32(sl, 0xe0001028 + i * 16, 0);
 
             return 0;
@@ -637,46 +891,36 @@ static int delete_data_watchpoint(stlink_t *sl, stm32_addr_t addr)
     return -1;
 }
 
-static int code_break_num;
-static int code_lit_num;
-#define CODE_BREAK_NUM_MAX	15
-#define CODE_BREAK_LOW	0x01
-#define CODE_BREAK_HIGH	0x02
-
-struct code_hw_breakpoint {
-    stm32_addr_t addr;
-    int          type;
-};
-
-static struct code_hw_breakpoint code_breaks[CODE_BREAK_NUM_MAX];
+static void init_code_breakpoints(struct gdb_session *gs) {
+    stlink_t *sl = gs->sl;
 
-static void init_code_breakpoints(stlink_t *sl) {
     unsigned int val;
-    memset(sl->q_buf, 0, 4);
     stlink_write_debug32(sl, STLINK_REG_CM3_FP_CTRL, 0x03 /*KEY | ENABLE4*/);
     stlink_read_debug32(sl, STLINK_REG_CM3_FP_CTRL, &val);
-    code_break_num = ((val >> 4) & 0xf);
-    code_lit_num = ((val >> 8) & 0xf);
+    gs->code_break_num = ((val >> 4) & 0xf);
+    gs->code_lit_num = ((val >> 8) & 0xf);
 
-    ILOG("Found %i hw breakpoint registers\n", code_break_num);
+    ILOG("Found %i hw breakpoint registers\n", gs->code_break_num);
 
-    for(int i = 0; i < code_break_num; i++) {
-        code_breaks[i].type = 0;
+    for(int i = 0; i < gs->code_break_num; i++) {
+        gs->code_breaks[i].type = 0;
         stlink_write_debug32(sl, STLINK_REG_CM3_FP_COMP0 + i * 4, 0);
     }
 }
 
-static int has_breakpoint(stm32_addr_t addr)
+static int has_breakpoint(struct gdb_session *gs, stm32_addr_t addr)
 {
-    for(int i = 0; i < code_break_num; i++) {
-        if (code_breaks[i].addr == addr) {
+    for(int i = 0; i < gs->code_break_num; i++) {
+        if (gs->code_breaks[i].addr == addr) {
             return 1;
         }
     }
     return 0;
 }
 
-static int update_code_breakpoint(stlink_t *sl, stm32_addr_t addr, int set) {
+static int update_code_breakpoint(struct gdb_session *gs, stm32_addr_t addr, int set) {
+    stlink_t *sl = gs->sl;
+
     stm32_addr_t fpb_addr;
     uint32_t mask;
     int type = (addr & 0x2) ? CODE_BREAK_HIGH : CODE_BREAK_LOW;
@@ -693,9 +937,9 @@ static int update_code_breakpoint(stlink_t *sl, stm32_addr_t addr, int set) {
 	}
 
     int id = -1;
-    for(int i = 0; i < code_break_num; i++) {
-        if(fpb_addr == code_breaks[i].addr ||
-                (set && code_breaks[i].type == 0)) {
+    for(int i = 0; i < gs->code_break_num; i++) {
+        if(fpb_addr == gs->code_breaks[i].addr ||
+                (set && gs->code_breaks[i].type == 0)) {
             id = i;
             break;
         }
@@ -706,7 +950,7 @@ static int update_code_breakpoint(stlink_t *sl, stm32_addr_t addr, int set) {
         else	return 0;  // Breakpoint is already removed
     }
 
-    struct code_hw_breakpoint* bp = &code_breaks[id];
+    struct code_hw_breakpoint* bp = &gs->code_breaks[id];
 
     bp->addr = fpb_addr;
 
@@ -739,45 +983,223 @@ static int update_code_breakpoint(stlink_t *sl, stm32_addr_t addr, int set) {
 }
 
 
-struct flash_block {
-    stm32_addr_t addr;
-    unsigned     length;
-    uint8_t*     data;
+/*
+ * vFlashErase/vFlashWrite are staged into an image of address sorted,
+ * coalesced blocks.  Each block is handed to the flash code in few large
+ * jobs: one erase pass, loader session and verify per job instead of per
+ * page.
+ *
+ * GDB sends the data of a block in order, so as soon as the start of a block
+ * is filled up to a page boundary a worker thread programs it while later
+ * packets are still arriving.  vFlashDone then only waits for the tail.
+ */
+/* Program (or only erase, when there is nothing but the erased pattern) a page aligned range */
+static int flash_program(stlink_t *sl, stm32_addr_t addr, uint8_t *data, unsigned len) {
+    uint8_t erased = stlink_get_erased_pattern(sl);
+    unsigned i;
 
-    struct flash_block* next;
-};
+    for (i = 0; i < len && data[i] == erased; i++)
+        ;
+    DLOG("flash_do: %s %08x -> %04x\n", i == len ? "erase" : "program", addr, len);
+    return stlink_write_flash(sl, addr, data, len, i == len);
+}
+
+static void *flash_stream_main(void *arg) {
+    struct gdb_session *gs = arg;
+
+    pthread_mutex_lock(&gs->flash_stream.lock);
+    for (;;) {
+        struct flash_block* fb = NULL;
+
+        for (unsigned i = 0; i < gs->flash_block_count && fb == NULL; i++) {
+            if (gs->flash_blocks[i].programmed < gs->flash_blocks[i].queued)
+                fb = &gs->flash_blocks[i];
+        }
+        if (fb == NULL) {
+            if (gs->flash_stream.stop)
+                break;
+            pthread_cond_wait(&gs->flash_stream.cond, &gs->flash_stream.lock);
+            continue;
+        }
+
+        unsigned off = fb->programmed, len = fb->queued - fb->programmed;
+        pthread_mutex_unlock(&gs->flash_stream.lock);
+
+        int ret = gs->flash_stream.error ? -1 :
+                  flash_program(gs->sl, fb->addr + off, fb->data + off, len);
+
+        pthread_mutex_lock(&gs->flash_stream.lock);
+        if (ret < 0)
+            gs->flash_stream.error = -1;
+        fb->programmed = off + len;
+        pthread_cond_broadcast(&gs->flash_stream.cond);
+    }
+    pthread_mutex_unlock(&gs->flash_stream.lock);
+
+    return NULL;
+}
+
+/* Wait until the worker caught up with everything queued */
+static void flash_stream_drain(struct gdb_session *gs) {
+    pthread_mutex_lock(&gs->flash_stream.lock);
+    for (unsigned i = 0; i < gs->flash_block_count; i++) {
+        while (gs->flash_blocks[i].programmed < gs->flash_blocks[i].queued)
+            pthread_cond_wait(&gs->flash_stream.cond, &gs->flash_stream.lock);
+    }
+    pthread_mutex_unlock(&gs->flash_stream.lock);
+}
 
-static struct flash_block* flash_root;
+static void flash_stream_stop(struct gdb_session *gs) {
+    if (!gs->flash_stream.running)
+        return;
 
-static int flash_add_block(stm32_addr_t addr, unsigned length, stlink_t *sl) {
+    pthread_mutex_lock(&gs->flash_stream.lock);
+    gs->flash_stream.stop = true;
+    pthread_cond_broadcast(&gs->flash_stream.cond);
+    pthread_mutex_unlock(&gs->flash_stream.lock);
+
+    pthread_join(gs->flash_stream.thread, NULL);
+    gs->flash_stream.running = false;
+}
+
+/* Some kinds of clock settings do not allow writing to flash */
+static void flash_prepare(stlink_t *sl) {
+    stlink_reset(sl);
+    stlink_force_debug(sl);
+}
+
+/* Queue the page aligned, filled start of a block once there is enough of it */
+static void flash_stream_queue(struct gdb_session *gs, struct flash_block* fb) {
+    stlink_t *sl = gs->sl;
+
+    stm32_addr_t page = fb->addr + fb->queued;
+
+    while (page < fb->addr + fb->filled) {
+        uint32_t pagesize = stlink_calculate_pagesize(sl, page);
+        if (page + pagesize > fb->addr + fb->filled)
+            break;
+        page += pagesize;
+    }
+    if (page - fb->addr - fb->queued < FLASH_STREAM_CHUNK && page < fb->addr + fb->length)
+        return;
+    if (page == fb->addr + fb->queued)
+        return;
+
+    if (!gs->flash_stream.running) {
+        flash_prepare(sl);
+        gs->flash_stream.stop = false;
+        gs->flash_stream.error = 0;
+        if (pthread_create(&gs->flash_stream.thread, NULL, flash_stream_main, gs) != 0)
+            return;     /* everything gets programmed by vFlashDone */
+        gs->flash_stream.running = true;
+    }
+
+    pthread_mutex_lock(&gs->flash_stream.lock);
+    fb->queued = page - fb->addr;
+    pthread_cond_broadcast(&gs->flash_stream.cond);
+    pthread_mutex_unlock(&gs->flash_stream.lock);
+}
+
+/* Index of the first block starting above addr */
+static unsigned flash_find_block(struct gdb_session *gs, stm32_addr_t addr) {
+    unsigned lo = 0, hi = gs->flash_block_count;
+
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        if (gs->flash_blocks[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int flash_add_block(struct gdb_session *gs, stm32_addr_t addr, unsigned length) {
+    stlink_t *sl = gs->sl;
 
     if(addr < FLASH_BASE || addr + length > FLASH_BASE + sl->flash_size) {
         ELOG("flash_add_block: incorrect bounds\n");
         return -1;
     }
 
-    stlink_calculate_pagesize(sl, addr);
-    if(addr % FLASH_PAGE != 0 || length % FLASH_PAGE != 0) {
+    uint32_t pagesize = stlink_calculate_pagesize(sl, addr);
+    if(addr % pagesize != 0 || length % pagesize != 0) {
         ELOG("flash_add_block: unaligned block\n");
         return -1;
     }
 
-    struct flash_block* new = malloc(sizeof(struct flash_block));
-    new->next = flash_root;
+    /* nothing left in flight, the worker only scans the array from here on */
+    flash_stream_drain(gs);
+
+    /* blocks [first, last) touch or overlap the new one and are merged into it */
+    unsigned first = flash_find_block(gs, addr), last = first;
+    stm32_addr_t start = addr, end = addr + length;
+
+    if (first > 0 && gs->flash_blocks[first - 1].addr + gs->flash_blocks[first - 1].length >= addr)
+        first--;
+    while (last < gs->flash_block_count && gs->flash_blocks[last].addr <= end)
+        last++;
+    if (first < last) {
+        if (gs->flash_blocks[first].addr < start)
+            start = gs->flash_blocks[first].addr;
+        if (gs->flash_blocks[last - 1].addr + gs->flash_blocks[last - 1].length > end)
+            end = gs->flash_blocks[last - 1].addr + gs->flash_blocks[last - 1].length;
+    }
+
+    uint8_t* data = malloc(end - start);
+    if (data == NULL)
+        return -1;
+    /* unwritten parts stay erased */
+    memset(data, stlink_get_erased_pattern(sl), end - start);
+
+    /* the worker scans the array under the lock, it must not see it move */
+    pthread_mutex_lock(&gs->flash_stream.lock);
+
+    struct flash_block merged = { start, end - start, data, 0, 0, 0, false };
+    for (unsigned i = first; i < last; i++) {
+        struct flash_block* fb = &gs->flash_blocks[i];
+        memcpy(data + (fb->addr - start), fb->data, fb->length);
+        free(fb->data);
+        /* what was already programmed stays valid only at the very start */
+        if (i == first && fb->addr == start) {
+            merged.filled = fb->filled;
+            merged.queued = merged.programmed = fb->programmed;
+        }
+        merged.rewrite |= fb->rewrite;
+    }
 
-    new->addr   = addr;
-    new->length = length;
-    new->data   = calloc(length, 1);
+    if (first == last) {
+        struct flash_block* blocks = realloc(gs->flash_blocks, (gs->flash_block_count + 1) * sizeof(*blocks));
+        if (blocks == NULL) {
+            pthread_mutex_unlock(&gs->flash_stream.lock);
+            free(data);
+            return -1;
+        }
+        gs->flash_blocks = blocks;
+        memmove(&gs->flash_blocks[first + 1], &gs->flash_blocks[first],
+                (gs->flash_block_count - first) * sizeof(*blocks));
+        gs->flash_block_count++;
+    } else {
+        memmove(&gs->flash_blocks[first + 1], &gs->flash_blocks[last],
+                (gs->flash_block_count - last) * sizeof(*gs->flash_blocks));
+        gs->flash_block_count -= last - first - 1;
+    }
 
-    flash_root = new;
+    gs->flash_blocks[first] = merged;
+    pthread_mutex_unlock(&gs->flash_stream.lock);
 
     return 0;
 }
 
-static int flash_populate(stm32_addr_t addr, uint8_t* data, unsigned length) {
+static int flash_populate(struct gdb_session *gs, stm32_addr_t addr, uint8_t* data, unsigned length) {
     unsigned int fit_blocks = 0, fit_length = 0;
+    unsigned i = flash_find_block(gs, addr);
 
-    for(struct flash_block* fb = flash_root; fb; fb = fb->next) {
+    /* the block holding addr, if any, and the ones after it */
+    if (i > 0)
+        i--;
+    for(; i < gs->flash_block_count && gs->flash_blocks[i].addr < addr + length; i++) {
+        struct flash_block* fb = &gs->flash_blocks[i];
         /* Block: ------X------Y--------
          * Data:            a-----b
          *                a--b
@@ -793,7 +1215,18 @@ static int flash_populate(stm32_addr_t addr, uint8_t* data, unsigned length) {
             unsigned start = (a > X ? a : X) - X;
             unsigned end   = (b > Y ? Y : b) - X;
 
-            memcpy(fb->data + start, data, end - start);
+            if (start < fb->queued) {
+                /* out of order, too late for streaming this block */
+                flash_stream_drain(gs);
+                fb->rewrite = true;
+            }
+
+            memcpy(fb->data + start, data + (X + start - a), end - start);
+
+            if (start <= fb->filled && end > fb->filled)
+                fb->filled = end;
+            if (!fb->rewrite)
+                flash_stream_queue(gs, fb);
 
             fit_blocks++;
             fit_length += end - start;
@@ -814,28 +1247,52 @@ static int flash_populate(stm32_addr_t addr, uint8_t* data, unsigned length) {
     return 0;
 }
 
-static int flash_go(stlink_t *sl) {
-    int error = -1;
-
-    // Some kinds of clock settings do not allow writing to flash.
-    stlink_reset(sl);
-    stlink_force_debug(sl);
-
-    for(struct flash_block* fb = flash_root; fb; fb = fb->next) {
-        DLOG("flash_do: block %08x -> %04x\n", fb->addr, fb->length);
-
-        for(stm32_addr_t page = fb->addr; page < fb->addr + fb->length; page += FLASH_PAGE) {
-            unsigned length = fb->length - (page - fb->addr);
+static void flash_free(struct gdb_session *gs) {
+    flash_stream_stop(gs);
+    for(unsigned i = 0; i < gs->flash_block_count; i++)
+        free(gs->flash_blocks[i].data);
+    free(gs->flash_blocks);
+    gs->flash_blocks = NULL;
+    gs->flash_block_count = 0;
+}
 
-            //Update FLASH_PAGE
-            stlink_calculate_pagesize(sl, page);
+static int flash_go(struct gdb_session *gs) {
+    stlink_t *sl = gs->sl;
 
-            DLOG("flash_do: page %08x\n", page);
-            unsigned len = (length > FLASH_PAGE) ? (unsigned) FLASH_PAGE : length;
-            int ret = stlink_write_flash(sl, page, fb->data + (page - fb->addr), len, 0);
-            if (ret < 0)
+    int error = -1;
+    uint8_t erased = stlink_get_erased_pattern(sl);
+
+    if (!gs->flash_stream.running)
+        flash_prepare(sl);
+
+    flash_stream_drain(gs);
+    if (gs->flash_stream.error)
+        goto error;
+
+    for(unsigned i = 0; i < gs->flash_block_count; i++) {
+        struct flash_block* fb = &gs->flash_blocks[i];
+        stm32_addr_t page, end = fb->addr + fb->length;
+        unsigned from = fb->rewrite ? 0 : fb->programmed;
+        unsigned len = fb->length;
+
+        /* nothing to program in the erased tail, like st-flash does */
+        while (len > from && fb->data[len - 1] == erased)
+            len--;
+        len = (len + 3) & ~3u;
+
+        DLOG("flash_do: block %08x -> %04x, %04x..%04x left to program\n",
+             fb->addr, fb->length, from, len);
+
+        if (len > from && flash_program(sl, fb->addr + from, fb->data + from, len - from) < 0)
+            goto error;
+
+        /* pages past the data were asked to be erased all the same */
+        for (page = fb->addr + from; page < fb->addr + len; page += stlink_calculate_pagesize(sl, page))
+            ;
+        for (; page < end; page += stlink_calculate_pagesize(sl, page)) {
+            DLOG("flash_do: erase page %08x\n", page);
+            if (stlink_erase_flash_page(sl, page) < 0)
                 goto error;
-            length -= len;
         }
     }
 
@@ -844,13 +1301,7 @@ static int flash_go(stlink_t *sl) {
     error = 0;
 
 error:
-    for(struct flash_block* fb = flash_root, *next; fb; fb = next) {
-        next = fb->next;
-        free(fb->data);
-        free(fb);
-    }
-
-    flash_root = NULL;
+    flash_free(gs);
 
     return error;
 }
@@ -865,42 +1316,19 @@ error:
 #define DCCSW   0xE000EF6C
 #define ICIALLU 0xE000EF50
 
-struct cache_level_desc
+/* Return the smallest R so that V <= (1 << R).  Not performance critical.  */
+static unsigned ceil_log2(unsigned v)
 {
-  unsigned int nsets;
-  unsigned int nways;
-  unsigned int log2_nways;
-  unsigned int width;
-};
+  unsigned res;
+  for (res = 0; (1U << res) < v; res++)
+    ;
+  return res;
+}
 
-struct cache_desc_t
+static void read_cache_level_desc(stlink_t *sl, struct cache_level_desc *desc)
 {
-  /* Minimal line size in bytes.  */
-  unsigned int dminline;
-  unsigned int iminline;
-
-  /* Last level of unification (uniprocessor).  */
-  unsigned int louu;
-
-  struct cache_level_desc icache[7];
-  struct cache_level_desc dcache[7];
-};
-
-static struct cache_desc_t cache_desc;
-
-/* Return the smallest R so that V <= (1 << R).  Not performance critical.  */
-static unsigned ceil_log2(unsigned v)
-{
-  unsigned res;
-  for (res = 0; (1U << res) < v; res++)
-    ;
-  return res;
-}
-
-static void read_cache_level_desc(stlink_t *sl, struct cache_level_desc *desc)
-{
-  unsigned int ccsidr;
-  unsigned int log2_nsets;
+  unsigned int ccsidr;
+  unsigned int log2_nsets;
 
   stlink_read_debug32(sl, CCSIDR, &ccsidr);
   desc->nsets = ((ccsidr >> 13) & 0x3fff) + 1;
@@ -912,7 +1340,9 @@ static void read_cache_level_desc(stlink_t *sl, struct cache_level_desc *desc)
        ccsidr, 4 << (ccsidr & 7), desc->nways, desc->nsets, desc->width);
 }
 
-static void init_cache (stlink_t *sl) {
+static void init_cache (struct gdb_session *gs) {
+    stlink_t *sl = gs->sl;
+
   unsigned int clidr;
   unsigned int ccr;
   unsigned int ctr;
@@ -925,29 +1355,29 @@ static void init_cache (stlink_t *sl) {
   stlink_read_debug32(sl, CLIDR, &clidr);
   stlink_read_debug32(sl, CCR, &ccr);
   stlink_read_debug32(sl, CTR, &ctr);
-  cache_desc.dminline = 4 << ((ctr >> 16) & 0x0f);
-  cache_desc.iminline = 4 << (ctr & 0x0f);
-  cache_desc.louu = (clidr >> 27) & 7;
+  gs->cache_desc.dminline = 4 << ((ctr >> 16) & 0x0f);
+  gs->cache_desc.iminline = 4 << (ctr & 0x0f);
+  gs->cache_desc.louu = (clidr >> 27) & 7;
 
   ILOG("Chip clidr: %08x, I-Cache: %s, D-Cache: %s\n",
        clidr, ccr & CCR_IC ? "on" : "off", ccr & CCR_DC ? "on" : "off");
   ILOG(" cache: LoUU: %u, LoC: %u, LoUIS: %u\n",
        (clidr >> 27) & 7, (clidr >> 24) & 7, (clidr >> 21) & 7);
   ILOG(" cache: ctr: %08x, DminLine: %u bytes, IminLine: %u bytes\n", ctr,
-       cache_desc.dminline, cache_desc.iminline);
+       gs->cache_desc.dminline, gs->cache_desc.iminline);
   for(i = 0; i < 7; i++)
     {
       unsigned int ct = (clidr >> (3 * i)) & 0x07;
 
-      cache_desc.dcache[i].width = 0;
-      cache_desc.icache[i].width = 0;
+      gs->cache_desc.dcache[i].width = 0;
+      gs->cache_desc.icache[i].width = 0;
 
       if(ct == 2 || ct == 3 || ct == 4)
 	{
 	  /* Data.  */
 	  stlink_write_debug32(sl, CSSELR, i << 1);
 	  ILOG("D-Cache L%d: ", i);
-	  read_cache_level_desc(sl, &cache_desc.dcache[i]);
+	  read_cache_level_desc(sl, &gs->cache_desc.dcache[i]);
 	}
 
       if(ct == 1 || ct == 3)
@@ -955,24 +1385,26 @@ static void init_cache (stlink_t *sl) {
 	  /* Instruction.  */
 	  stlink_write_debug32(sl, CSSELR, (i << 1) | 1);
 	  ILOG("I-Cache L%d: ", i);
-	  read_cache_level_desc(sl, &cache_desc.icache[i]);
+	  read_cache_level_desc(sl, &gs->cache_desc.icache[i]);
 	}
     }
 }
 
-static void cache_flush(stlink_t *sl, unsigned ccr) {
+static void cache_flush(struct gdb_session *gs, unsigned ccr) {
+    stlink_t *sl = gs->sl;
+
   int level;
 
   if (ccr & CCR_DC)
-    for (level = cache_desc.louu - 1; level >= 0; level--)
+    for (level = gs->cache_desc.louu - 1; level >= 0; level--)
       {
-	struct cache_level_desc *desc = &cache_desc.dcache[level];
+	struct cache_level_desc *desc = &gs->cache_desc.dcache[level];
 	unsigned addr;
 	unsigned max_addr = 1 << desc->width;
 	unsigned way_sh = 32 - desc->log2_nways;
 
 	/* D-cache clean by set-ways.  */
-	for (addr = (level << 1); addr < max_addr; addr += cache_desc.dminline)
+	for (addr = (level << 1); addr < max_addr; addr += gs->cache_desc.dminline)
 	  {
 	    unsigned int way;
 
@@ -986,51 +1418,524 @@ static void cache_flush(stlink_t *sl, unsigned ccr) {
     stlink_write_debug32(sl, ICIALLU, 0);
 }
 
-static int cache_modified;
-
-static void cache_change(stm32_addr_t start, unsigned count)
+static void cache_change(struct gdb_session *gs, stm32_addr_t start, unsigned count)
 {
   if (count == 0)
     return;
   (void)start;
-  cache_modified = 1;
+  gs->cache_modified = 1;
 }
 
-static void cache_sync(stlink_t *sl)
+static void cache_sync(struct gdb_session *gs)
 {
+    stlink_t *sl = gs->sl;
+
   unsigned ccr;
 
   if(sl->core_id!=STM32F7_CORE_ID)
     return;
-  if (!cache_modified)
+  if (!gs->cache_modified)
     return;
-  cache_modified = 0;
+  gs->cache_modified = 0;
 
   stlink_read_debug32(sl, CCR, &ccr);
   if (ccr & (CCR_IC | CCR_DC))
-    cache_flush(sl, ccr);
+    cache_flush(gs, ccr);
 }
 
-static size_t unhexify(const char *in, char *out, size_t out_count)
-{
-    size_t i;
-    unsigned int c;
+/*
+ * Cache of target memory for the time the core is halted.  GDB reads the
+ * same stack, globals and vector table over and over at every stop.  Only
+ * flash, SRAM and system memory are cached, never peripherals or the system
+ * control space.  Lines are direct mapped; misses of one request are fetched
+ * in a single scatter read, with some read-ahead when GDB reads sequentially.
+ * Writes go through, and everything that may let the core or the flash
+ * controller change memory throws the whole cache away.
+ */
+static void mem_cache_invalidate(struct gdb_session *gs) {
+    memset(gs->mem_cache.valid, 0, sizeof(gs->mem_cache.valid));
+    gs->mem_cache.next = 0;
+}
+
+/* End of the cacheable region holding [addr, addr + len), 0 if there is none */
+static stm32_addr_t mem_cache_region_end(stlink_t *sl, stm32_addr_t addr, unsigned len) {
+    const struct { stm32_addr_t base; size_t size; } regions[] = {
+        { sl->flash_base, sl->flash_size },
+        { sl->sram_base,  sl->sram_size },
+        { sl->sys_base,   sl->sys_size },
+    };
+
+    for (unsigned i = 0; i < sizeof(regions) / sizeof(regions[0]); i++) {
+        if (regions[i].size == 0)
+            continue;
+        if (addr >= regions[i].base && addr + len <= regions[i].base + regions[i].size)
+            return regions[i].base + (stm32_addr_t) regions[i].size;
+    }
+
+    return 0;
+}
+
+static int mem_cache_read(struct gdb_session *gs, stm32_addr_t addr, uint8_t *buf, unsigned len) {
+    stlink_t *sl = gs->sl;
+
+    stm32_addr_t region_end = mem_cache_region_end(sl, addr, len);
+    stm32_addr_t first = addr & ~(MEM_CACHE_LINE - 1);
+    stm32_addr_t end = (addr + len + MEM_CACHE_LINE - 1) & ~(MEM_CACHE_LINE - 1);
+
+    /* big dumps would only thrash the cache */
+    if (len == 0 || end > region_end || end - first > MEM_CACHE_LINES * MEM_CACHE_LINE)
+        return stlink_read_mem(sl, addr, buf, len);
+
+    stm32_addr_t fetch_end = end, line;
+    for (line = first; line < end; line += MEM_CACHE_LINE) {
+        unsigned i = (line / MEM_CACHE_LINE) % MEM_CACHE_LINES;
+        if (!gs->mem_cache.valid[i] || gs->mem_cache.addr[i] != line)
+            break;
+    }
+    if (line == end)
+        fetch_end = first;      /* all hits */
+    else if (addr == gs->mem_cache.next)
+        fetch_end += MEM_CACHE_AHEAD * MEM_CACHE_LINE;
+    if (fetch_end - first > MEM_CACHE_LINES * MEM_CACHE_LINE)
+        fetch_end = first + MEM_CACHE_LINES * MEM_CACHE_LINE;
+    if (fetch_end > region_end)
+        fetch_end = region_end;
+
+    struct stlink_mem_seg segs[MEM_CACHE_LINES];
+    int count = 0;
+
+    for (line = first; line + MEM_CACHE_LINE <= fetch_end; line += MEM_CACHE_LINE) {
+        unsigned i = (line / MEM_CACHE_LINE) % MEM_CACHE_LINES;
+
+        if (gs->mem_cache.valid[i] && gs->mem_cache.addr[i] == line)
+            continue;
+        gs->mem_cache.valid[i] = false;
+        gs->mem_cache.addr[i] = line;
+        segs[count].addr = line;
+        segs[count].buf = gs->mem_cache.data[i];
+        segs[count].len = MEM_CACHE_LINE;
+        count++;
+    }
+
+    if (count > 0) {
+        DLOG("gs->mem_cache: %08x+%x, %d line(s) missing\n", addr, len, count);
+        if (stlink_read_memv(sl, segs, count) != 0)
+            return -1;
+        for (int n = 0; n < count; n++)
+            gs->mem_cache.valid[(segs[n].addr / MEM_CACHE_LINE) % MEM_CACHE_LINES] = true;
+    }
+
+    for (line = first; line < end; line += MEM_CACHE_LINE) {
+        unsigned i = (line / MEM_CACHE_LINE) % MEM_CACHE_LINES;
+        stm32_addr_t from = line > addr ? line : addr;
+        stm32_addr_t to = line + MEM_CACHE_LINE < addr + len ? line + MEM_CACHE_LINE : addr + len;
+
+        memcpy(buf + (from - addr), gs->mem_cache.data[i] + (from - line), to - from);
+    }
+    gs->mem_cache.next = addr + len;
+
+    return 0;
+}
+
+static int mem_cache_write(struct gdb_session *gs, stm32_addr_t addr, const uint8_t *buf, unsigned len) {
+    stlink_t *sl = gs->sl;
+
+    int err = stlink_write_mem(sl, addr, buf, len);
+
+    if (err) {
+        mem_cache_invalidate(gs);
+        return err;
+    }
+
+    for (stm32_addr_t line = addr & ~(MEM_CACHE_LINE - 1); line < addr + len; line += MEM_CACHE_LINE) {
+        unsigned i = (line / MEM_CACHE_LINE) % MEM_CACHE_LINES;
+        stm32_addr_t from = line > addr ? line : addr;
+        stm32_addr_t to = line + MEM_CACHE_LINE < addr + len ? line + MEM_CACHE_LINE : addr + len;
+
+        if (gs->mem_cache.valid[i] && gs->mem_cache.addr[i] == line)
+            memcpy(gs->mem_cache.data[i] + (from - line), buf + (from - addr), to - from);
+    }
+
+    return 0;
+}
+
+/*
+ * Register file of the halted core, read at most once per stop.  The core
+ * registers come in one go and are expedited in the T05 stop reply; CONTROL,
+ * the masks and the FP registers are read together on first use.  Resuming
+ * or resetting the core drops the cache, register writes go through it.
+ */
+static void reg_cache_invalidate(struct gdb_session *gs) {
+    gs->reg_cache.core = false;
+    gs->reg_cache.extra = false;
+}
+
+/* Same parts that get the FP registers in the target description */
+static bool reg_cache_has_fpu(stlink_t *sl) {
+    return sl->chip_id == STLINK_CHIPID_STM32_F4
+        || sl->chip_id == STLINK_CHIPID_STM32_F4_HD
+        || sl->core_id == STM32F7_CORE_ID;
+}
+
+static struct stlink_reg *reg_cache_get(struct gdb_session *gs, bool extra) {
+    stlink_t *sl = gs->sl;
+
+    if (!gs->reg_cache.core) {
+        if (stlink_read_all_regs(sl, &gs->reg_cache.regs) != 0)
+            return NULL;
+        gs->reg_cache.core = true;
+    }
+
+    if (extra && !gs->reg_cache.extra) {
+        int ret = reg_cache_has_fpu(sl) ? stlink_read_all_unsupported_regs(sl, &gs->reg_cache.regs)
+                                        : stlink_read_unsupported_reg(sl, 0x1C, &gs->reg_cache.regs);
+        if (ret != 0)
+            return NULL;
+        gs->reg_cache.extra = true;
+    }
+
+    return &gs->reg_cache.regs;
+}
+
+static void* arena_alloc(struct gdb_session *gs, size_t size) {
+    struct arena_chunk* chunk = gs->arena;
+
+    size = (size + 7) & ~(size_t) 7;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunk_size = chunk ? 2 * chunk->size : ARENA_CHUNK;
+        while (chunk_size < size)
+            chunk_size *= 2;
+
+        /* earlier allocations stay where they are until the reset */
+        chunk = malloc(sizeof(*chunk) + chunk_size);
+        if (chunk == NULL)
+            return NULL;
+        chunk->next = gs->arena;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        gs->arena = chunk;
+    }
+
+    void* p = chunk->data + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+static char* arena_calloc(struct gdb_session *gs, size_t size) {
+    char* p = arena_alloc(gs, size);
+    if (p != NULL)
+        memset(p, 0, size);
+    return p;
+}
+
+static char* arena_strdup(struct gdb_session *gs, const char* str) {
+    size_t len = strlen(str) + 1;
+    char* p = arena_alloc(gs, len);
+    if (p != NULL)
+        memcpy(p, str, len);
+    return p;
+}
+
+static void arena_free(struct gdb_session *gs) {
+    while (gs->arena != NULL) {
+        struct arena_chunk* next = gs->arena->next;
+        free(gs->arena);
+        gs->arena = next;
+    }
+}
+
+/* Drops everything allocated so far; several chunks merge into one */
+static void arena_reset(struct gdb_session *gs) {
+    struct arena_chunk* chunk = gs->arena;
+
+    if (chunk == NULL)
+        return;
+    if (chunk->next != NULL) {
+        size_t total = 0;
+        for (; chunk != NULL; chunk = chunk->next)
+            total += chunk->size;
+        arena_free(gs);
+        arena_alloc(gs, total);
+        chunk = gs->arena;
+        if (chunk == NULL)
+            return;
+    }
+    chunk->used = 0;
+}
+
+/* Register values go over the wire in target (little endian) byte order */
+static void reg_to_hex(uint32_t value, char *out) {
+    uint8_t bytes[4];
+
+    write_uint32(bytes, value);
+    gdb_hex_encode(bytes, sizeof(bytes), out);
+}
+
+/* GDB may send fewer digits for narrow registers, the rest is zero */
+static int reg_from_hex(const char *in, uint32_t *value) {
+    uint8_t bytes[4] = {0};
+
+    if (gdb_hex_decode(in, sizeof(bytes), bytes) == 0)
+        return -1;
+    *value = read_uint32(bytes, 0);
+    return 0;
+}
+
+/* T05 with SP, LR, PC and xPSR, so GDB needs no g/p round trips to unwind */
+static char *stop_reply(struct gdb_session *gs) {
+    struct stlink_reg *regs = reg_cache_get(gs, false);
+    char *reply;
+
+    if (regs == NULL || (reply = arena_calloc(gs, 64)) == NULL)
+        return arena_strdup(gs, "S05");
+
+    strcpy(reply, "T050d:xxxxxxxx;0e:xxxxxxxx;0f:xxxxxxxx;19:xxxxxxxx;");
+    reg_to_hex(regs->r[13], &reply[6]);
+    reg_to_hex(regs->r[14], &reply[18]);
+    reg_to_hex(regs->r[15], &reply[30]);
+    reg_to_hex(regs->xpsr, &reply[42]);
+    return reply;
+}
+
+/*
+ * Largest packet GDB may send us, and the size memory reads are cut to.
+ * The library splits big reads into adapter transfers on its own, so only
+ * the old SCSI based probe stays at the former, smaller size.
+ */
+static unsigned gdb_packet_size(stlink_t *sl) {
+    return sl->version.stlink_v == 1 ? 0x3fff : 0x10000;
+}
+
+/* Bytes a single m/x read may return so the hex reply still fits a packet */
+static unsigned gdb_read_limit(stlink_t *sl, unsigned count) {
+    unsigned max = (gdb_packet_size(sl) - 4) / 2;
+    return count > max ? max : count;
+}
+
+/*
+ * Halt polling starts out fast right after resuming, so breakpoints close by
+ * and semihosting calls are seen at once, and backs off while the core keeps
+ * running.  Input from GDB ends any wait in serve() early.
+ */
+#define HALT_POLL_MIN_MS    1
+#define HALT_POLL_MAX_MS    100
 
-    for (i = 0; i < out_count; i++) {
-        if (sscanf(in + (2 * i), "%02x", &c) != 1) {
-            return i;
+static long long now_ms(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* Resume the core; serve() then polls it with continue_poll() */
+static void continue_start(struct gdb_session *gs) {
+    cache_sync(gs);
+    stlink_run(gs->sl);
+
+    gs->running = true;
+    gs->poll_delay = HALT_POLL_MIN_MS;
+    gs->next_poll = now_ms() + gs->poll_delay;
+}
+
+/*
+ * One halt poll of a resumed core.  Semihosting calls are served on the
+ * spot.  Returns 1 once the core stopped for GDB, 0 while it keeps running.
+ */
+static int continue_poll(struct gdb_session *gs) {
+    stlink_t *sl = gs->sl;
+
+    stlink_status(sl);
+    if(sl->core_stat == STLINK_CORE_HALTED) {
+        struct stlink_reg reg;
+        int ret;
+        stm32_addr_t pc;
+        stm32_addr_t addr;
+        uint16_t insn;
+
+        if (!gs->semihosting) {
+            return 1;
+        }
+
+        stlink_read_all_regs (sl, &reg);
+
+        /* Read PC */
+        pc = reg.r[15];
+
+        /* breakpoints are kept by word address */
+        addr = pc & ~3u;
+
+        ret = stlink_read_mem(sl, pc, &insn, sizeof(insn));
+
+        if (ret != 0) {
+            DLOG("Semihost: cannot read instructions at: "
+                 "0x%08x\n", pc);
+            return 1;
+        }
+
+        if (insn == 0xBEAB && !has_breakpoint(gs, addr)) {
+
+            do_semihosting (sl, reg.r[0], reg.r[1], &reg.r[0]);
+
+            /* Write return value */
+            stlink_write_reg(sl, reg.r[0], 0);
+
+            /* Jump over the break instruction */
+            stlink_write_reg(sl, reg.r[15] + 2, 15);
+
+            /* continue execution, and look again right away */
+            cache_sync(gs);
+            stlink_run(sl);
+            gs->poll_delay = HALT_POLL_MIN_MS;
+            gs->next_poll = now_ms();
+            return 0;
+        } else {
+            return 1;
+        }
+    }
+
+    gs->next_poll = now_ms() + gs->poll_delay;
+    if(gs->poll_delay < HALT_POLL_MAX_MS)
+        gs->poll_delay = gs->poll_delay * 2 > HALT_POLL_MAX_MS ? HALT_POLL_MAX_MS : gs->poll_delay * 2;
+
+    return 0;
+}
+
+#define DFSR            0xE000ED30
+#define DFSR_DWTTRAP    (1 << 2)
+
+static int breakpoint_at(struct gdb_session *gs, stm32_addr_t pc) {
+    stlink_t *sl = gs->sl;
+
+    int type = (pc & 0x2) ? CODE_BREAK_HIGH : CODE_BREAK_LOW;
+    stm32_addr_t fpb_addr = sl->core_id == STM32F7_CORE_ID ? pc : pc & ~0x3;
+
+    for(int i = 0; i < gs->code_break_num; i++) {
+        if(gs->code_breaks[i].addr == fpb_addr && (gs->code_breaks[i].type & type))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Range stepping: single step locally as long as PC stays in [start, end),
+ * only reading PC back, and let GDB know once it leaves the range or runs
+ * into a breakpoint or watchpoint.
+ */
+static int do_range_step(struct gdb_session *gs, stm32_addr_t start, stm32_addr_t end) {
+    stlink_t *sl = gs->sl;
+
+    struct stlink_reg reg;
+    int watching = 0;
+    uint32_t dfsr;
+
+    for(int i = 0; i < DATA_WATCH_NUM; i++)
+        watching |= gs->data_watches[i].fun != WATCHDISABLED;
+    if(watching)
+        stlink_write_debug32(sl, DFSR, DFSR_DWTTRAP);
+
+    cache_sync(gs);
+    for(unsigned n = 1; ; n++) {
+        if(stlink_step(sl) != 0 || stlink_read_reg(sl, 15, &reg) != 0)
+            break;
+        if(reg.r[15] < start || reg.r[15] >= end || breakpoint_at(gs, reg.r[15]))
+            break;
+        if(watching && stlink_read_debug32(sl, DFSR, &dfsr) == 0 && (dfsr & DFSR_DWTTRAP))
+            break;
+
+        if(n % 64 == 0) {
+            int status = gdb_check_for_interrupt(&gs->conn);
+            if(status < 0) {
+                ELOG("cannot check for int: %d\n", status);
+                return -1;
+            }
+            if(status == 1)
+                break;
+        }
+    }
+
+    return 0;
+}
+
+static void session_attach(struct gdb_session *gs, int client, int out);
+
+/* For log messages */
+static const char* session_name(struct gdb_session *gs) {
+    static char name[sizeof(gs->st.unix_socket) + 16];
+
+    if(gs->st.pipe)
+        return "stdin";
+    if(gs->st.unix_socket[0])
+        return gs->st.unix_socket;
+    snprintf(name, sizeof(name), "port %d", gs->st.listen_port);
+    return name;
+}
+
+#ifndef __MINGW32__
+static int session_listen_unix(struct gdb_session *gs) {
+    struct sockaddr_un serv_addr;
+    struct stat path_stat;
+
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sun_family = AF_UNIX;
+    if(strlen(gs->st.unix_socket) >= sizeof(serv_addr.sun_path)) {
+        ELOG("Socket path too long: %s\n", gs->st.unix_socket);
+        return -1;
+    }
+    strcpy(serv_addr.sun_path, gs->st.unix_socket);
+
+    /* a socket left behind by an earlier run goes, anything else stays */
+    if(lstat(gs->st.unix_socket, &path_stat) == 0) {
+        if(!S_ISSOCK(path_stat.st_mode)) {
+            ELOG("%s exists and is not a socket\n", gs->st.unix_socket);
+            return -1;
         }
-        out[i] = (char)c;
+        unlink(gs->st.unix_socket);
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    if(bind(sock, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+        perror("bind");
+        close(sock);
+        return -1;
+    }
+
+    if(listen(sock, 5) < 0) {
+        perror("listen");
+        close(sock);
+        unlink(gs->st.unix_socket);
+        return -1;
     }
 
-    return i;
+    ILOG("Listening at %s...\n", gs->st.unix_socket);
+
+    gs->listen_sock = sock;
+    return 0;
 }
+#endif
+
+static int session_listen(struct gdb_session *gs) {
+    if(gs->st.pipe || gs->st.unix_socket[0]) {
+#ifdef __MINGW32__
+        ELOG("--pipe and Unix domain sockets are not supported on Windows\n");
+        return -1;
+#else
+        if(gs->st.unix_socket[0])
+            return session_listen_unix(gs);
+
+        /* GDB is there from the start */
+        session_attach(gs, STDIN_FILENO, pipe_out);
+        return 0;
+#endif
+    }
 
-int serve(stlink_t *sl, st_state_t *st) {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if(sock < 0) {
         perror("socket");
-        return 1;
+        return -1;
     }
 
     unsigned int val = 1;
@@ -1040,718 +1945,962 @@ int serve(stlink_t *sl, st_state_t *st) {
     memset(&serv_addr,0,sizeof(struct sockaddr_in));
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(st->listen_port);
+    serv_addr.sin_port = htons(gs->st.listen_port);
 
     if(bind(sock, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
         perror("bind");
-        return 1;
+        close(sock);
+        return -1;
     }
 
     if(listen(sock, 5) < 0) {
         perror("listen");
-        return 1;
+        close(sock);
+        return -1;
     }
 
-    ILOG("Listening at *:%d...\n", st->listen_port);
+    ILOG("Listening at *:%d...\n", gs->st.listen_port);
+
+    gs->listen_sock = sock;
+    return 0;
+}
+
+static void session_accept(struct gdb_session *gs) {
+    int client = accept(gs->listen_sock, NULL, NULL);
 
-    int client = accept(sock, NULL, NULL);
-    //signal (SIGINT, SIG_DFL);
     if(client < 0) {
         perror("accept");
-        return 1;
+        return;
+    }
+
+    /* one GDB per probe */
+    if(gs->client >= 0) {
+        WLOG("%s is already in use by another GDB\n", session_name(gs));
+        close(client);
+        return;
     }
 
-    close(sock);
+    session_attach(gs, client, client);
+}
+
+/* Packets come in on client and go out on out, the same fd but for --pipe */
+static void session_attach(struct gdb_session *gs, int client, int out) {
+    stlink_t *sl = gs->sl;
+
+    gs->client = client;
+    gdb_conn_init(&gs->conn, client);
+    gs->conn.out_fd = out;
+    gdb_conn_nonblock(&gs->conn);
 
     stlink_force_debug(sl);
-    if (st->reset) {
+    if (gs->st.reset) {
         stlink_reset(sl);
     }
-    init_code_breakpoints(sl);
-    init_data_watchpoints(sl);
+    init_code_breakpoints(gs);
+    init_data_watchpoints(gs);
 
-    ILOG("GDB connected.\n");
+    mem_cache_invalidate(gs);
+    reg_cache_invalidate(gs);
 
     /*
      * To allow resetting the chip from GDB it is required to
      * emulate attaching and detaching to target.
      */
-    unsigned int attached = 1;
+    gs->attached = 1;
+    gs->running = false;
 
-    while(1) {
-        char* packet;
+    ILOG("GDB connected to %s.\n", session_name(gs));
+}
 
-        int status = gdb_recv_packet(client, &packet);
-        if(status < 0) {
-            ELOG("cannot recv: %d\n", status);
+/* Without -m the probe is let go once its GDB is gone */
+static void session_close(struct gdb_session *gs) {
+    if(gs->listen_sock >= 0) {
 #ifdef __MINGW32__
-            win32_close_socket(sock);
+        win32_close_socket(gs->listen_sock);
+#else
+        close(gs->listen_sock);
 #endif
-            return 1;
-        }
+#ifndef __MINGW32__
+        if(gs->st.unix_socket[0])
+            unlink(gs->st.unix_socket);
+#endif
+        gs->listen_sock = -1;
+    }
+
+    arena_free(gs);
+
+    /* Switch back to mass storage mode before closing. */
+    stlink_exit_debug_mode(gs->sl);
+    stlink_close(gs->sl);
+    gs->sl = NULL;
+}
+
+static void session_disconnect(struct gdb_session *gs) {
+    flash_free(gs);
+    gdb_conn_free(&gs->conn);
+    close(gs->client);
+    gs->client = -1;
+    gs->running = false;
+
+    ILOG("GDB disconnected from %s.\n", session_name(gs));
+
+    /* Continue */
+    stlink_run(gs->sl);
+
+    /* nobody can come back through a pipe */
+    if(!gs->st.persistent || gs->st.pipe)
+        session_close(gs);
+}
+
+static int send_reply(struct gdb_session *gs, char *reply, unsigned int reply_len) {
+    DLOG("send: %s\n", reply);
+
+    int result = reply_len ? gdb_send_packet_len(&gs->conn, reply, reply_len)
+                           : gdb_send_packet(&gs->conn, reply);
+    if(result != 0)
+        ELOG("cannot send: %d\n", result);
+
+    return result;
+}
 
-        DLOG("recv: %s\n", packet);
+/*
+ * Handles one packet of a halted target, -1 drops the connection.  The
+ * reply and any scratch buffers come from the session arena.
+ */
+static int process_packet(struct gdb_session *gs, char *packet, int status) {
+    stlink_t *sl = gs->sl;
+    char* reply = NULL;
+    unsigned int reply_len = 0;     /* set for binary replies only */
+    struct stlink_reg regp;
+
+    DLOG("recv: %s\n", packet);
+    arena_reset(gs);
+
+    switch(packet[0]) {
+        case 'q': {
+            if(packet[1] == 'P' || packet[1] == 'C' || packet[1] == 'L') {
+                reply = arena_strdup(gs, "");
+                break;
+            }
+
+            char *separator = strstr(packet, ":"), *params = "";
+            if(separator == NULL) {
+                separator = packet + strlen(packet);
+            } else {
+                params = separator + 1;
+            }
+
+            unsigned queryNameLength = (unsigned) (separator - &packet[1]);
+            char* queryName = arena_calloc(gs, queryNameLength + 1);
+            if(queryName == NULL) {
+                reply = arena_strdup(gs, "E00");
+                break;
+            }
+            strncpy(queryName, &packet[1], queryNameLength);
 
-        char* reply = NULL;
-        struct stlink_reg regp;
+            DLOG("query: %s;%s\n", queryName, params);
 
-        switch(packet[0]) {
-            case 'q': {
-                if(packet[1] == 'P' || packet[1] == 'C' || packet[1] == 'L') {
-                    reply = strdup("");
+            if(!strcmp(queryName, "Supported")) {
+                bool features = reg_cache_has_fpu(sl);
+
+                reply = arena_calloc(gs, 128);
+                if(reply == NULL) {
+                    reply = arena_strdup(gs, "E00");
                     break;
                 }
-
-                char *separator = strstr(packet, ":"), *params = "";
+                snprintf(reply, 128, "PacketSize=%x;qXfer:memory-map:read+;%sbinary-upload+;QStartNoAckMode+",
+                         gdb_packet_size(sl), features ? "qXfer:features:read+;" : "");
+            } else if(!strcmp(queryName, "Xfer")) {
+                char *type, *op, *__s_addr, *s_length;
+                char *tok = params;
+                char *annex __attribute__((unused));
+
+                type     = strsep(&tok, ":");
+                op       = strsep(&tok, ":");
+                annex    = strsep(&tok, ":");
+                __s_addr   = strsep(&tok, ",");
+                s_length = tok;
+
+                unsigned addr = (unsigned) strtoul(__s_addr, NULL, 16),
+                         length = (unsigned) strtoul(s_length, NULL, 16);
+
+                DLOG("Xfer: type:%s;op:%s;annex:%s;addr:%d;length:%d\n",
+                            type, op, annex, addr, length);
+
+                const char* data = NULL;
+
+                if(!strcmp(type, "memory-map") && !strcmp(op, "read"))
+                    data = gs->memory_map;
+
+                if(!strcmp(type, "features") && !strcmp(op, "read"))
+                    data = target_description_F4;
+
+                if(data) {
+                    unsigned data_length = (unsigned) strlen(data);
+                    if(addr >= data_length)
+                        length = 0;
+                    else if(length > data_length - addr)
+                        length = data_length - addr;
+
+                    if(length == 0) {
+                        reply = arena_strdup(gs, "l");
+                    } else if((reply = arena_calloc(gs, length + 2)) == NULL) {
+                        reply = arena_strdup(gs, "E00");
+                    } else {
+                        reply[0] = 'm';
+                        strncpy(&reply[1], data + addr, length);
+                    }
+                }
+            } else if(!strncmp(queryName, "Rcmd,",4)) {
+                /* monitor commands may run or reset the core */
+                mem_cache_invalidate(gs);
+                reg_cache_invalidate(gs);
+
+                // Rcmd uses the wrong separator
+                separator = strstr(packet, ",");
+                params = "";
                 if(separator == NULL) {
                     separator = packet + strlen(packet);
                 } else {
                     params = separator + 1;
                 }
 
-                unsigned queryNameLength = (unsigned) (separator - &packet[1]);
-                char* queryName = calloc(queryNameLength + 1, 1);
-                strncpy(queryName, &packet[1], queryNameLength);
+                size_t hex_len = strlen(params);
+                size_t alloc_size = (hex_len / 2) + 1;
+                size_t cmd_len;
+                char *cmd = arena_alloc(gs, alloc_size);
 
-                DLOG("query: %s;%s\n", queryName, params);
+                if (cmd == NULL) {
+                    DLOG("Rcmd unhexify allocation error\n");
+                    break;
+                }
 
-                if(!strcmp(queryName, "Supported")) {
-                    if(sl->chip_id==STLINK_CHIPID_STM32_F4
-                       || sl->chip_id==STLINK_CHIPID_STM32_F4_HD
-                       || sl->core_id==STM32F7_CORE_ID) {
-                        reply = strdup("PacketSize=3fff;qXfer:memory-map:read+;qXfer:features:read+");
-                    }
-                    else {
-                        reply = strdup("PacketSize=3fff;qXfer:memory-map:read+");
-                    }
-                } else if(!strcmp(queryName, "Xfer")) {
-                    char *type, *op, *__s_addr, *s_length;
-                    char *tok = params;
-                    char *annex __attribute__((unused));
-
-                    type     = strsep(&tok, ":");
-                    op       = strsep(&tok, ":");
-                    annex    = strsep(&tok, ":");
-                    __s_addr   = strsep(&tok, ",");
-                    s_length = tok;
-
-                    unsigned addr = (unsigned) strtoul(__s_addr, NULL, 16),
-                             length = (unsigned) strtoul(s_length, NULL, 16);
-
-                    DLOG("Xfer: type:%s;op:%s;annex:%s;addr:%d;length:%d\n",
-                                type, op, annex, addr, length);
-
-                    const char* data = NULL;
-
-                    if(!strcmp(type, "memory-map") && !strcmp(op, "read"))
-                        data = current_memory_map;
-
-                    if(!strcmp(type, "features") && !strcmp(op, "read"))
-                        data = target_description_F4;
-
-                    if(data) {
-                        unsigned data_length = (unsigned) strlen(data);
-                        if(addr + length > data_length)
-                            length = data_length - addr;
-
-                        if(length == 0) {
-                            reply = strdup("l");
-                        } else {
-                            reply = calloc(length + 2, 1);
-                            reply[0] = 'm';
-                            strncpy(&reply[1], data, length);
-                        }
-                    }
-                } else if(!strncmp(queryName, "Rcmd,",4)) {
-                    // Rcmd uses the wrong separator
-                    separator = strstr(packet, ",");
-                    params = "";
-                    if(separator == NULL) {
-                        separator = packet + strlen(packet);
-                    } else {
-                        params = separator + 1;
-                    }
+                cmd_len = gdb_hex_decode(params, (unsigned) (alloc_size - 1), (uint8_t*) cmd);
+                cmd[cmd_len] = 0;
 
-                    size_t hex_len = strlen(params);
-                    size_t alloc_size = (hex_len / 2) + 1;
-                    size_t cmd_len;
-                    char *cmd = malloc(alloc_size);
+                DLOG("unhexified Rcmd: '%s'\n", cmd);
 
-                    if (cmd == NULL) {
-                        DLOG("Rcmd unhexify allocation error\n");
-                        break;
+                if (!strncmp(cmd, "resume", 6)) {// resume
+                    DLOG("Rcmd: resume\n");
+                    cache_sync(gs);
+                    stlink_run(sl);
+
+                    reply = arena_strdup(gs, "OK");
+                } else if (!strncmp(cmd, "halt", 4)) { //halt
+                    reply = arena_strdup(gs, "OK");
+
+                    stlink_force_debug(sl);
+
+                    DLOG("Rcmd: halt\n");
+                } else if (!strncmp(cmd, "jtag_reset", 10)) { //jtag_reset
+                    reply = arena_strdup(gs, "OK");
+
+                    stlink_jtag_reset(sl, 0);
+                    stlink_jtag_reset(sl, 1);
+                    stlink_force_debug(sl);
+
+                    DLOG("Rcmd: jtag_reset\n");
+                } else if (!strncmp(cmd, "reset", 5)) { //reset
+                    reply = arena_strdup(gs, "OK");
+
+                    stlink_force_debug(sl);
+                    stlink_reset(sl);
+                    init_code_breakpoints(gs);
+                    init_data_watchpoints(gs);
+
+                    DLOG("Rcmd: reset\n");
+                } else if (!strncmp(cmd, "semihosting ", 12)) {
+                    DLOG("Rcmd: got semihosting cmd '%s'", cmd);
+                    char *arg = cmd + 12;
+
+                    /* Skip whitespaces */
+                    while (isspace(*arg)) {
+                        arg++;
                     }
 
-                    cmd_len = unhexify(params, cmd, alloc_size - 1);
-                    cmd[cmd_len] = 0;
-
-                    DLOG("unhexified Rcmd: '%s'\n", cmd);
-
-                    if (!strncmp(cmd, "resume", 6)) {// resume
-                        DLOG("Rcmd: resume\n");
-                        cache_sync(sl);
-                        stlink_run(sl);
-
-                        reply = strdup("OK");
-                    } else if (!strncmp(cmd, "halt", 4)) { //halt
-                        reply = strdup("OK");
-
-                        stlink_force_debug(sl);
-
-                        DLOG("Rcmd: halt\n");
-                    } else if (!strncmp(cmd, "jtag_reset", 10)) { //jtag_reset
-                        reply = strdup("OK");
-
-                        stlink_jtag_reset(sl, 0);
-                        stlink_jtag_reset(sl, 1);
-                        stlink_force_debug(sl);
-
-                        DLOG("Rcmd: jtag_reset\n");
-                    } else if (!strncmp(cmd, "reset", 5)) { //reset
-                        reply = strdup("OK");
-
-                        stlink_force_debug(sl);
-                        stlink_reset(sl);
-                        init_code_breakpoints(sl);
-                        init_data_watchpoints(sl);
-
-                        DLOG("Rcmd: reset\n");
-                    } else if (!strncmp(cmd, "semihosting ", 12)) {
-                        DLOG("Rcmd: got semihosting cmd '%s'", cmd);
-                        char *arg = cmd + 12;
-
-                        /* Skip whitespaces */
-                        while (isspace(*arg)) {
-                            arg++;
-                        }
-
-                        if (!strncmp(arg, "enable", 6)
-                            || !strncmp(arg, "1", 1))
-                        {
-                            semihosting = true;
-                            reply = strdup("OK");
-                        } else if (!strncmp(arg, "disable", 7)
-                            || !strncmp(arg, "0", 1))
-                        {
-                            semihosting = false;
-                            reply = strdup("OK");
-                        } else {
-                            DLOG("Rcmd: unknown semihosting arg: '%s'\n", arg);
-                        }
+                    if (!strncmp(arg, "enable", 6)
+                        || !strncmp(arg, "1", 1))
+                    {
+                        gs->semihosting = true;
+                        reply = arena_strdup(gs, "OK");
+                    } else if (!strncmp(arg, "disable", 7)
+                        || !strncmp(arg, "0", 1))
+                    {
+                        gs->semihosting = false;
+                        reply = arena_strdup(gs, "OK");
                     } else {
-                        DLOG("Rcmd: %s\n", cmd);
+                        DLOG("Rcmd: unknown semihosting arg: '%s'\n", arg);
                     }
-                    free(cmd);
+                } else {
+                    DLOG("Rcmd: %s\n", cmd);
                 }
-
-                if(reply == NULL)
-                    reply = strdup("");
-
-                free(queryName);
-
-                break;
             }
 
-            case 'v': {
-                char *params = NULL;
-                char *cmdName = strtok_r(packet, ":;", &params);
+            if(reply == NULL)
+                reply = arena_strdup(gs, "");
 
-                cmdName++; // vCommand -> Command
 
-                if(!strcmp(cmdName, "FlashErase")) {
-                    char *__s_addr, *s_length;
-                    char *tok = params;
+            break;
+        }
 
-                    __s_addr   = strsep(&tok, ",");
-                    s_length = tok;
+        case 'v': {
+            char *params = NULL;
+            char *cmdName = strtok_r(packet, ":;", &params);
 
-                    unsigned addr = (unsigned) strtoul(__s_addr, NULL, 16),
-                             length = (unsigned) strtoul(s_length, NULL, 16);
+            cmdName++; // vCommand -> Command
 
-                    DLOG("FlashErase: addr:%08x,len:%04x\n",
-                                addr, length);
+            if(!strcmp(cmdName, "FlashErase")) {
+                mem_cache_invalidate(gs);
 
-                    if(flash_add_block(addr, length, sl) < 0) {
-                        reply = strdup("E00");
-                    } else {
-                        reply = strdup("OK");
-                    }
-                } else if(!strcmp(cmdName, "FlashWrite")) {
-                    char *__s_addr, *data;
-                    char *tok = params;
-
-                    __s_addr = strsep(&tok, ":");
-                    data   = tok;
-
-                    unsigned addr = (unsigned) strtoul(__s_addr, NULL, 16);
-                    unsigned data_length = status - (unsigned) (data - packet);
-
-                    // Length of decoded data cannot be more than
-                    // encoded, as escapes are removed.
-                    // Additional byte is reserved for alignment fix.
-                    uint8_t *decoded = calloc(data_length + 1, 1);
-                    unsigned dec_index = 0;
-                    for(unsigned int i = 0; i < data_length; i++) {
-                        if(data[i] == 0x7d) {
-                            i++;
-                            decoded[dec_index++] = data[i] ^ 0x20;
-                        } else {
-                            decoded[dec_index++] = data[i];
-                        }
-                    }
+                char *__s_addr, *s_length;
+                char *tok = params;
 
-                    // Fix alignment
-                    if(dec_index % 2 != 0)
-                        dec_index++;
+                __s_addr   = strsep(&tok, ",");
+                s_length = tok;
 
-                    DLOG("binary packet %d -> %d\n", data_length, dec_index);
+                unsigned addr = (unsigned) strtoul(__s_addr, NULL, 16),
+                         length = (unsigned) strtoul(s_length, NULL, 16);
 
-                    if(flash_populate(addr, decoded, dec_index) < 0) {
-                        reply = strdup("E00");
-                    } else {
-                        reply = strdup("OK");
-                    }
-                } else if(!strcmp(cmdName, "FlashDone")) {
-                    if(flash_go(sl) < 0) {
-                        reply = strdup("E00");
-                    } else {
-                        reply = strdup("OK");
-                    }
-                } else if(!strcmp(cmdName, "Kill")) {
-                    attached = 0;
+                DLOG("FlashErase: addr:%08x,len:%04x\n",
+                            addr, length);
 
-                    reply = strdup("OK");
+                if(flash_add_block(gs, addr, length) < 0) {
+                    reply = arena_strdup(gs, "E00");
+                } else {
+                    reply = arena_strdup(gs, "OK");
                 }
+            } else if(!strcmp(cmdName, "FlashWrite")) {
+                char *__s_addr, *data;
+                char *tok = params;
 
-                if(reply == NULL)
-                    reply = strdup("");
+                __s_addr = strsep(&tok, ":");
+                data   = tok;
 
-                break;
-            }
+                unsigned addr = (unsigned) strtoul(__s_addr, NULL, 16);
+                unsigned data_length = status - (unsigned) (data - packet);
 
-            case 'c':
-                cache_sync(sl);
-                stlink_run(sl);
+                // Decoded in place, escapes only make the data shorter.
+                // The packet is NUL terminated, so there is always a
+                // byte left for the alignment fix.
+                unsigned dec_index = gdb_unescape_binary(data, data_length);
 
-                while(1) {
-                    status = gdb_check_for_interrupt(client);
-                    if(status < 0) {
-                        ELOG("cannot check for int: %d\n", status);
-#ifdef __MINGW32__
-                        win32_close_socket(sock);
-#endif
-                        return 1;
-                    }
+                // Fix alignment
+                if(dec_index % 2 != 0)
+                    data[dec_index++] = 0;
+
+                DLOG("binary packet %d -> %d\n", data_length, dec_index);
 
-                    if(status == 1) {
-                        stlink_force_debug(sl);
+                if(flash_populate(gs, addr, (uint8_t*) data, dec_index) < 0) {
+                    reply = arena_strdup(gs, "E00");
+                } else {
+                    reply = arena_strdup(gs, "OK");
+                }
+            } else if(!strcmp(cmdName, "FlashDone")) {
+                mem_cache_invalidate(gs);
+                reg_cache_invalidate(gs);
+                if(flash_go(gs) < 0) {
+                    reply = arena_strdup(gs, "E00");
+                } else {
+                    reply = arena_strdup(gs, "OK");
+                }
+            } else if(!strcmp(cmdName, "Cont?")) {
+                reply = arena_strdup(gs, "vCont;c;C;s;S;r");
+            } else if(!strcmp(cmdName, "Cont")) {
+                /* there is one thread only, so the first action is its own */
+                char action = params != NULL ? params[0] : 0;
+                int ret = 0;
+
+                if(action == 'c' || action == 'C' || action == 's' || action == 'S' || action == 'r') {
+                    mem_cache_invalidate(gs);
+                    reg_cache_invalidate(gs);
+
+                    if(action == 'c' || action == 'C') {
+                        /* the stop reply follows once the core halts */
+                        continue_start(gs);
                         break;
+                    } else if(action == 's' || action == 'S') {
+                        cache_sync(gs);
+                        stlink_step(sl);
+                    } else {
+                        char *s_end;
+                        stm32_addr_t start = (stm32_addr_t) strtoul(&params[1], &s_end, 16);
+                        stm32_addr_t end = *s_end == ',' ? (stm32_addr_t) strtoul(s_end + 1, NULL, 16) : start;
+
+                        DLOG("range step %08x..%08x\n", start, end);
+                        ret = do_range_step(gs, start, end);
                     }
 
-                    stlink_status(sl);
-                    if(sl->core_stat == STLINK_CORE_HALTED) {
-                        struct stlink_reg reg;
-                        int ret;
-                        stm32_addr_t pc;
-                        stm32_addr_t addr;
-                        int offset = 0;
-                        uint16_t insn;
+                    if(ret < 0)
+                        return -1;
 
-                        if (!semihosting) {
-                            break;
-                        }
+                    reply = stop_reply(gs); // TRAP
+                } else {
+                    reply = arena_strdup(gs, "E00");
+                }
+            } else if(!strcmp(cmdName, "Kill")) {
+                mem_cache_invalidate(gs);
+                reg_cache_invalidate(gs);
+                gs->attached = 0;
 
-                        stlink_read_all_regs (sl, &reg);
+                reply = arena_strdup(gs, "OK");
+            }
 
-                        /* Read PC */
-                        pc = reg.r[15];
+            if(reply == NULL)
+                reply = arena_strdup(gs, "");
 
-                        /* Compute aligned value */
-                        offset = pc % 4;
-                        addr = pc - offset;
+            break;
+        }
 
-                        /* Read instructions (address and length must be
-                         * aligned).
-                         */
-                        ret = stlink_read_mem32(sl, addr, (offset > 2 ? 8 : 4));
+        case 'Q':
+            if(!strcmp(packet, "QStartNoAckMode")) {
+                reply = arena_strdup(gs, "OK");
+            } else {
+                reply = arena_strdup(gs, "");
+            }
+            break;
 
-                        if (ret != 0) {
-                            DLOG("Semihost: cannot read instructions at: "
-                                 "0x%08x\n", addr);
-                            break;
-                        }
+        case 'c':
+            mem_cache_invalidate(gs);
+            reg_cache_invalidate(gs);
+            /* the stop reply follows once the core halts */
+            continue_start(gs);
+            break;
 
-                        memcpy(&insn, &sl->q_buf[offset], sizeof(insn));
+        case 's':
+            mem_cache_invalidate(gs);
+            reg_cache_invalidate(gs);
+	        cache_sync(gs);
+            stlink_step(sl);
 
-                        if (insn == 0xBEAB && !has_breakpoint(addr)) {
+            reply = stop_reply(gs); // TRAP
+            break;
 
-                            do_semihosting (sl, reg.r[0], reg.r[1], &reg.r[0]);
+        case '?':
+            if(gs->attached) {
+                reply = stop_reply(gs); // TRAP
+            } else {
+                /* Stub shall reply OK if not attached. */
+                reply = arena_strdup(gs, "OK");
+            }
+            break;
 
-                            /* Write return value */
-                            stlink_write_reg(sl, reg.r[0], 0);
+        case 'g': {
+            struct stlink_reg *regs = reg_cache_get(gs, false);
 
-                            /* Jump over the break instruction */
-                            stlink_write_reg(sl, reg.r[15] + 2, 15);
+            if(regs == NULL) {
+                reply = arena_strdup(gs, "E00");
+                break;
+            }
 
-                            /* continue execution */
-                            cache_sync(sl);
-                            stlink_run(sl);
-                        } else {
-                            break;
-                        }
-                    }
+            reply = arena_calloc(gs, 8 * 16 + 1);
+            if(reply == NULL) {
+                reply = arena_strdup(gs, "E00");
+                break;
+            }
+            for(int i = 0; i < 16; i++)
+                reg_to_hex(regs->r[i], &reply[i * 8]);
 
-                    usleep(100000);
-                }
+            break;
+        }
 
-                reply = strdup("S05"); // TRAP
-                break;
+        case 'p': {
+            unsigned id = (unsigned) strtoul(&packet[1], NULL, 16);
+            struct stlink_reg *regs = reg_cache_get(gs, id >= 0x1C);
+            uint32_t myreg;
 
-            case 's':
-	        cache_sync(sl);
-                stlink_step(sl);
+            if(regs == NULL) {
+                reply = arena_strdup(gs, "E00");
+                break;
+            }
 
-                reply = strdup("S05"); // TRAP
+            if(id < 16) {
+                myreg = regs->r[id];
+            } else if(id == 0x19) {
+                myreg = regs->xpsr;
+            } else if(id == 0x1A) {
+                myreg = regs->main_sp;
+            } else if(id == 0x1B) {
+                myreg = regs->process_sp;
+            } else if(id == 0x1C) {
+                myreg = regs->control;
+            } else if(id == 0x1D) {
+                myreg = regs->faultmask;
+            } else if(id == 0x1E) {
+                myreg = regs->basepri;
+            } else if(id == 0x1F) {
+                myreg = regs->primask;
+            } else if(id >= 0x20 && id < 0x40) {
+                myreg = regs->s[id-0x20];
+            } else if(id == 0x40) {
+                myreg = regs->fpscr;
+            } else {
+                reply = arena_strdup(gs, "E00");
                 break;
+            }
 
-            case '?':
-                if(attached) {
-                    reply = strdup("S05"); // TRAP
-                } else {
-                    /* Stub shall reply OK if not attached. */
-                    reply = strdup("OK");
-                }
+            reply = arena_calloc(gs, 8 + 1);
+            if(reply == NULL) {
+                reply = arena_strdup(gs, "E00");
                 break;
+            }
+            reg_to_hex(myreg, reply);
 
-            case 'g':
-                stlink_read_all_regs(sl, &regp);
+            break;
+        }
 
-                reply = calloc(8 * 16 + 1, 1);
-                for(int i = 0; i < 16; i++)
-                    sprintf(&reply[i * 8], "%08x", htonl(regp.r[i]));
+        case 'P': {
+            char* s_reg = &packet[1];
+            char* s_value = strstr(&packet[1], "=") + 1;
+
+            unsigned reg = (unsigned) strtoul(s_reg, NULL, 16);
+            uint32_t value;
+
+            if(reg_from_hex(s_value, &value) != 0) {
+                reply = arena_strdup(gs, "E00");
+            } else if(reg < 16) {
+                stlink_write_reg(sl, value, reg);
+                gs->reg_cache.regs.r[reg] = value;
+            } else if(reg == 0x19) {
+                stlink_write_reg(sl, value, 16);
+                gs->reg_cache.regs.xpsr = value;
+            } else if(reg == 0x1A) {
+                stlink_write_reg(sl, value, 17);
+                gs->reg_cache.regs.main_sp = value;
+            } else if(reg == 0x1B) {
+                stlink_write_reg(sl, value, 18);
+                gs->reg_cache.regs.process_sp = value;
+            } else if(reg == 0x1C) {
+                stlink_write_unsupported_reg(sl, value, reg, &regp);
+            } else if(reg == 0x1D) {
+                stlink_write_unsupported_reg(sl, value, reg, &regp);
+            } else if(reg == 0x1E) {
+                stlink_write_unsupported_reg(sl, value, reg, &regp);
+            } else if(reg == 0x1F) {
+                stlink_write_unsupported_reg(sl, value, reg, &regp);
+            } else if(reg >= 0x20 && reg < 0x40) {
+                stlink_write_unsupported_reg(sl, value, reg, &regp);
+            } else if(reg == 0x40) {
+                stlink_write_unsupported_reg(sl, value, reg, &regp);
+            } else {
+                reply = arena_strdup(gs, "E00");
+            }
+
+            /* the special ones are read back as a group */
+            if(reg >= 0x1C)
+                gs->reg_cache.extra = false;
 
+            if(!reply) {
+                reply = arena_strdup(gs, "OK");
+            }
+
+            break;
+        }
+
+        case 'G': {
+            uint8_t regs[16 * 4];
+            unsigned count = gdb_hex_decode(&packet[1], sizeof(regs), regs) / 4;
+
+            for(unsigned i = 0; i < count; i++) {
+                uint32_t value = read_uint32(regs, (int) i * 4);
+                stlink_write_reg(sl, value, (int) i);
+                gs->reg_cache.regs.r[i] = value;
+            }
+
+            reply = arena_strdup(gs, "OK");
+            break;
+        }
+
+        case 'm': {
+            char* s_start = &packet[1];
+            char* s_count = strchr(&packet[1], ',');
+
+            if (s_count == NULL) {
+                reply = arena_strdup(gs, "E00");
                 break;
+            }
 
-            case 'p': {
-                unsigned id = (unsigned) strtoul(&packet[1], NULL, 16);
-                unsigned myreg = 0xDEADDEAD;
-
-                if(id < 16) {
-                    stlink_read_reg(sl, id, &regp);
-                    myreg = htonl(regp.r[id]);
-                } else if(id == 0x19) {
-                    stlink_read_reg(sl, 16, &regp);
-                    myreg = htonl(regp.xpsr);
-                } else if(id == 0x1A) {
-                    stlink_read_reg(sl, 17, &regp);
-                    myreg = htonl(regp.main_sp);
-                } else if(id == 0x1B) {
-                    stlink_read_reg(sl, 18, &regp);
-                    myreg = htonl(regp.process_sp);
-                } else if(id == 0x1C) {
-                    stlink_read_unsupported_reg(sl, id, &regp);
-                    myreg = htonl(regp.control);
-                } else if(id == 0x1D) {
-                    stlink_read_unsupported_reg(sl, id, &regp);
-                    myreg = htonl(regp.faultmask);
-                } else if(id == 0x1E) {
-                    stlink_read_unsupported_reg(sl, id, &regp);
-                    myreg = htonl(regp.basepri);
-                } else if(id == 0x1F) {
-                    stlink_read_unsupported_reg(sl, id, &regp);
-                    myreg = htonl(regp.primask);
-                } else if(id >= 0x20 && id < 0x40) {
-                    stlink_read_unsupported_reg(sl, id, &regp);
-                    myreg = htonl(regp.s[id-0x20]);
-                } else if(id == 0x40) {
-                    stlink_read_unsupported_reg(sl, id, &regp);
-                    myreg = htonl(regp.fpscr);
-                } else {
-                    reply = strdup("E00");
-                }
+            stm32_addr_t start = (stm32_addr_t) strtoul(s_start, NULL, 16);
+            unsigned     count = (unsigned) strtoul(s_count + 1, NULL, 16);
 
-                reply = calloc(8 + 1, 1);
-                sprintf(reply, "%08x", myreg);
+            count = gdb_read_limit(sl, count);
 
+            uint8_t *data = arena_alloc(gs, count + 1);
+            if (data == NULL) {
+                reply = arena_strdup(gs, "E00");
                 break;
             }
+            if (mem_cache_read(gs, start, data, count) != 0) {
+                /* read failed somehow, don't return stale buffer */
+                count = 0;
+            }
 
-            case 'P': {
-                char* s_reg = &packet[1];
-                char* s_value = strstr(&packet[1], "=") + 1;
-
-                unsigned reg   = (unsigned) strtoul(s_reg,   NULL, 16);
-                unsigned value = (unsigned) strtoul(s_value, NULL, 16);
-
-                if(reg < 16) {
-                    stlink_write_reg(sl, ntohl(value), reg);
-                } else if(reg == 0x19) {
-                    stlink_write_reg(sl, ntohl(value), 16);
-                } else if(reg == 0x1A) {
-                    stlink_write_reg(sl, ntohl(value), 17);
-                } else if(reg == 0x1B) {
-                    stlink_write_reg(sl, ntohl(value), 18);
-                } else if(reg == 0x1C) {
-                    stlink_write_unsupported_reg(sl, ntohl(value), reg, &regp);
-                } else if(reg == 0x1D) {
-                    stlink_write_unsupported_reg(sl, ntohl(value), reg, &regp);
-                } else if(reg == 0x1E) {
-                    stlink_write_unsupported_reg(sl, ntohl(value), reg, &regp);
-                } else if(reg == 0x1F) {
-                    stlink_write_unsupported_reg(sl, ntohl(value), reg, &regp);
-                } else if(reg >= 0x20 && reg < 0x40) {
-                    stlink_write_unsupported_reg(sl, ntohl(value), reg, &regp);
-                } else if(reg == 0x40) {
-                    stlink_write_unsupported_reg(sl, ntohl(value), reg, &regp);
-                } else {
-                    reply = strdup("E00");
-                }
+            reply = arena_calloc(gs, count * 2 + 1);
+            if (reply == NULL) {
+                reply = arena_strdup(gs, "E00");
+                break;
+            }
+            gdb_hex_encode(data, count, reply);
 
-                if(!reply) {
-                    reply = strdup("OK");
-                }
+            break;
+        }
 
+        case 'M': {
+            char* s_start = &packet[1];
+            char* s_count = strchr(&packet[1], ',');
+            char* hexdata = strchr(&packet[1], ':');
+
+            if (s_count == NULL || hexdata == NULL) {
+                reply = arena_strdup(gs, "E00");
                 break;
             }
+            hexdata++;
 
-            case 'G':
-                for(int i = 0; i < 16; i++) {
-                    char str[9] = {0};
-                    strncpy(str, &packet[1 + i * 8], 8);
-                    uint32_t reg = (uint32_t) strtoul(str, NULL, 16);
-                    stlink_write_reg(sl, ntohl(reg), i);
-                }
+            stm32_addr_t start = (stm32_addr_t) strtoul(s_start, NULL, 16);
+            unsigned     count = (unsigned) strtoul(s_count + 1, NULL, 16);
+            int err;
 
-                reply = strdup("OK");
+            /* no more than the packet actually carries */
+            if (count > (status - (unsigned) (hexdata - packet)) / 2) {
+                reply = arena_strdup(gs, "E00");
                 break;
+            }
+
+            uint8_t *data = arena_alloc(gs, count + 1);
+            if (data == NULL) {
+                err = -1;
+            } else if (gdb_hex_decode(hexdata, count, data) != count) {
+                err = -1;
+            } else {
+                err = mem_cache_write(gs, start, data, count);
+                cache_change(gs, start, count);
+            }
 
-            case 'm': {
-                char* s_start = &packet[1];
-                char* s_count = strstr(&packet[1], ",") + 1;
+            reply = arena_strdup(gs, err ? "E00" : "OK");
+            break;
+        }
 
+        case 'X': {
+            /* like M, but binary: data is decoded in place in the packet */
+            char* s_start = &packet[1];
+            char* s_count = strchr(&packet[1], ',');
+            char* bindata = strchr(&packet[1], ':');
+            int err = -1;
+
+            if (s_count != NULL && bindata != NULL) {
                 stm32_addr_t start = (stm32_addr_t) strtoul(s_start, NULL, 16);
-                unsigned     count = (unsigned) strtoul(s_count, NULL, 16);
-
-                unsigned adj_start = start % 4;
-                unsigned count_rnd = (count + adj_start + 4 - 1) / 4 * 4;
-                if (count_rnd > sl->flash_pgsz)
-                    count_rnd = (unsigned) sl->flash_pgsz;
-                if (count_rnd > 0x1800)
-                    count_rnd = 0x1800;
-                if (count_rnd < count)
-                    count = count_rnd;
-
-                if (stlink_read_mem32(sl, start - adj_start, count_rnd) != 0) {
-                    /* read failed somehow, don't return stale buffer */
-                    count = 0;
-                }
+                unsigned     count = (unsigned) strtoul(s_count + 1, NULL, 16);
+                bindata++;
 
-                reply = calloc(count * 2 + 1, 1);
-                for(unsigned int i = 0; i < count; i++) {
-                    reply[i * 2 + 0] = hex[sl->q_buf[i + adj_start] >> 4];
-                    reply[i * 2 + 1] = hex[sl->q_buf[i + adj_start] & 0xf];
+                unsigned len = gdb_unescape_binary(bindata, status - (unsigned) (bindata - packet));
+                if (len == count) {
+                    err = count ? mem_cache_write(gs, start, (uint8_t*) bindata, count) : 0;
+                    cache_change(gs, start, count);
                 }
+            }
 
+            reply = arena_strdup(gs, err ? "E00" : "OK");
+            break;
+        }
+
+        case 'x': {
+            /* like m, but the reply is 'b' and the escaped binary data */
+            char* s_start = &packet[1];
+            char* s_count = strchr(&packet[1], ',');
+
+            if (s_count == NULL) {
+                reply = arena_strdup(gs, "E00");
                 break;
             }
 
-            case 'M': {
-                char* s_start = &packet[1];
-                char* s_count = strstr(&packet[1], ",") + 1;
-                char* hexdata = strstr(packet, ":") + 1;
+            stm32_addr_t start = (stm32_addr_t) strtoul(s_start, NULL, 16);
+            unsigned     count = (unsigned) strtoul(s_count + 1, NULL, 16);
 
-                stm32_addr_t start = (stm32_addr_t) strtoul(s_start, NULL, 16);
-                unsigned     count = (unsigned) strtoul(s_count, NULL, 16);
-                int err = 0;
-
-                if(start % 4) {
-                    unsigned align_count = 4 - start % 4;
-                    if (align_count > count) align_count = count;
-                    for(unsigned int i = 0; i < align_count; i ++) {
-                        char hextmp[3] = { hexdata[i*2], hexdata[i*2+1], 0 };
-                        uint8_t byte = strtoul(hextmp, NULL, 16);
-                        sl->q_buf[i] = byte;
-                    }
-                    err |= stlink_write_mem8(sl, start, align_count);
-                    cache_change(start, align_count);
-                    start += align_count;
-                    count -= align_count;
-                    hexdata += 2*align_count;
-                }
-
-                if(count - count % 4) {
-                    unsigned aligned_count = count - count % 4;
+            count = gdb_read_limit(sl, count);
 
-                    for(unsigned int i = 0; i < aligned_count; i ++) {
-                        char hextmp[3] = { hexdata[i*2], hexdata[i*2+1], 0 };
-                        uint8_t byte = strtoul(hextmp, NULL, 16);
-                        sl->q_buf[i] = byte;
-                    }
-                    err |= stlink_write_mem32(sl, start, aligned_count);
-                    cache_change(start, aligned_count);
-                    count -= aligned_count;
-                    start += aligned_count;
-                    hexdata += 2*aligned_count;
-                }
+            uint8_t *data = arena_alloc(gs, count + 1);
+            if (data == NULL || mem_cache_read(gs, start, data, count) != 0) {
+                reply = arena_strdup(gs, "E00");
+                break;
+            }
 
-                if(count) {
-                    for(unsigned int i = 0; i < count; i ++) {
-                        char hextmp[3] = { hexdata[i*2], hexdata[i*2+1], 0 };
-                        uint8_t byte = strtoul(hextmp, NULL, 16);
-                        sl->q_buf[i] = byte;
-                    }
-                    err |= stlink_write_mem8(sl, start, count);
-                    cache_change(start, count);
-                }
-                reply = strdup(err ? "E00" : "OK");
+            reply = arena_alloc(gs, count * 2 + 2);
+            if (reply == NULL) {
+                reply = arena_strdup(gs, "E00");
                 break;
             }
+            reply[0] = 'b';
+            reply_len = 1 + gdb_escape_binary(data, count, reply + 1);
+            reply[reply_len] = 0;
 
-            case 'Z': {
-                char *endptr;
-                stm32_addr_t addr = (stm32_addr_t) strtoul(&packet[3], &endptr, 16);
-                stm32_addr_t len  = (stm32_addr_t) strtoul(&endptr[1], NULL, 16);
-
-                switch (packet[1]) {
-                    case '1':
-                        if(update_code_breakpoint(sl, addr, 1) < 0) {
-                            reply = strdup("E00");
-                        } else {
-                            reply = strdup("OK");
-                        }
-                        break;
+            break;
+        }
+
+        case 'Z': {
+            char *endptr;
+            stm32_addr_t addr = (stm32_addr_t) strtoul(&packet[3], &endptr, 16);
+            stm32_addr_t len  = (stm32_addr_t) strtoul(&endptr[1], NULL, 16);
 
-                    case '2':   // insert write watchpoint
-                    case '3':   // insert read  watchpoint
-                    case '4': { // insert access watchpoint
-                        enum watchfun wf;
-                        if(packet[1] == '2') {
-                            wf = WATCHWRITE;
-                        } else if(packet[1] == '3') {
-                            wf = WATCHREAD;
-                        } else {
-                            wf = WATCHACCESS;
-                        }
-
-                        if(add_data_watchpoint(sl, wf, addr, len) < 0) {
-                            reply = strdup("E00");
-                        } else {
-                            reply = strdup("OK");
-                            break;
-                        }
+            switch (packet[1]) {
+                case '1':
+                    if(update_code_breakpoint(gs, addr, 1) < 0) {
+                        reply = arena_strdup(gs, "E00");
+                    } else {
+                        reply = arena_strdup(gs, "OK");
+                    }
+                    break;
+
+                case '2':   // insert write watchpoint
+                case '3':   // insert read  watchpoint
+                case '4': { // insert access watchpoint
+                    enum watchfun wf;
+                    if(packet[1] == '2') {
+                        wf = WATCHWRITE;
+                    } else if(packet[1] == '3') {
+                        wf = WATCHREAD;
+                    } else {
+                        wf = WATCHACCESS;
                     }
 
-                    default:
-                        reply = strdup("");
+                    if(add_data_watchpoint(gs, wf, addr, len) < 0) {
+                        reply = arena_strdup(gs, "E00");
+                    } else {
+                        reply = arena_strdup(gs, "OK");
+                        break;
+                    }
                 }
-                break;
+
+                default:
+                    reply = arena_strdup(gs, "");
             }
-            case 'z': {
-                char *endptr;
-                stm32_addr_t addr = (stm32_addr_t) strtoul(&packet[3], &endptr, 16);
-                //stm32_addr_t len  = strtoul(&endptr[1], NULL, 16);
-
-                switch (packet[1]) {
-                    case '1': // remove breakpoint
-                        update_code_breakpoint(sl, addr, 0);
-                        reply = strdup("OK");
+            break;
+        }
+        case 'z': {
+            char *endptr;
+            stm32_addr_t addr = (stm32_addr_t) strtoul(&packet[3], &endptr, 16);
+            //stm32_addr_t len  = strtoul(&endptr[1], NULL, 16);
+
+            switch (packet[1]) {
+                case '1': // remove breakpoint
+                    update_code_breakpoint(gs, addr, 0);
+                    reply = arena_strdup(gs, "OK");
+                    break;
+
+                case '2' : // remove write watchpoint
+                case '3' : // remove read watchpoint
+                case '4' : // remove access watchpoint
+                    if(delete_data_watchpoint(gs, addr) < 0) {
+                        reply = arena_strdup(gs, "E00");
+                    } else {
+                        reply = arena_strdup(gs, "OK");
                         break;
+                    }
 
-                    case '2' : // remove write watchpoint
-                    case '3' : // remove read watchpoint
-                    case '4' : // remove access watchpoint
-                        if(delete_data_watchpoint(sl, addr) < 0) {
-                            reply = strdup("E00");
-                        } else {
-                            reply = strdup("OK");
-                            break;
-                        }
-
-                    default:
-                        reply = strdup("");
-                }
-                break;
+                default:
+                    reply = arena_strdup(gs, "");
             }
+            break;
+        }
 
-            case '!': {
-                /*
-                 * Enter extended mode which allows restarting.
-                 * We do support that always.
-                 */
+        case '!': {
+            /*
+             * Enter extended mode which allows restarting.
+             * We do support that always.
+             */
 
-                /*
-                 * Also, set to persistent mode
-                 * to allow GDB disconnect.
-                 */
-                st->persistent = 1;
+            /*
+             * Also, set to persistent mode
+             * to allow GDB disconnect.
+             */
+            gs->st.persistent = 1;
 
-                reply = strdup("OK");
+            reply = arena_strdup(gs, "OK");
 
-                break;
-            }
+            break;
+        }
 
-            case 'R': {
-                /* Reset the core. */
+        case 'R': {
+            /* Reset the core. */
 
-                stlink_reset(sl);
-                init_code_breakpoints(sl);
-                init_data_watchpoints(sl);
+            mem_cache_invalidate(gs);
+            reg_cache_invalidate(gs);
+            stlink_reset(sl);
+            init_code_breakpoints(gs);
+            init_data_watchpoints(gs);
 
-                attached = 1;
+            gs->attached = 1;
 
-                reply = strdup("OK");
+            reply = arena_strdup(gs, "OK");
 
-                break;
+            break;
+        }
+        case 'k':
+            /* Kill request - start over, the probe stays open */
+            mem_cache_invalidate(gs);
+            reg_cache_invalidate(gs);
+
+            if (gs->st.reset) {
+                stlink_reset(sl);
             }
-            case 'k':
-                /* Kill request - reset the connection itself */
-                stlink_run(sl);
-                stlink_exit_debug_mode(sl);
-                stlink_close(sl);
+            stlink_force_debug(sl);
+            init_cache(gs);
+            init_code_breakpoints(gs);
+            init_data_watchpoints(gs);
 
-                sl = do_connect(st);
-                if(sl == NULL) cleanup(0);
-                connected_stlink = sl;
+            reply = NULL;		/* no response */
 
-                if (st->reset) {
-                    stlink_reset(sl);
-                }
-                stlink_force_debug(sl);
-                init_cache(sl);
-                init_code_breakpoints(sl);
-                init_data_watchpoints(sl);
+            break;
+
+        default:
+            reply = arena_strdup(gs, "");
+    }
 
-                reply = NULL;		/* no response */
+    if(reply && send_reply(gs, reply, reply_len) != 0)
+        return -1;
 
-                break;
+    /* the OK to QStartNoAckMode itself is still acked */
+    if(!strcmp(packet, "QStartNoAckMode"))
+        gs->conn.noack = 1;
 
-            default:
-                reply = strdup("");
+    return 0;
+}
+
+/*
+ * One thread serves every probe: poll() waits on the listening sockets, the
+ * GDB connections and, while a core runs, the next halt poll.  Client fds
+ * are non-blocking, so a half sent packet or a reply GDB does not read only
+ * holds up its own session.
+ */
+int serve(struct gdb_session **all, int count) {
+    struct pollfd *fds = calloc(2 * count, sizeof(*fds));
+    int *client_fd = calloc(count, sizeof(*client_fd));
+    int open_sessions = 0;
+
+    if(fds == NULL || client_fd == NULL) {
+        free(fds);
+        free(client_fd);
+        return 1;
+    }
+
+    for(int i = 0; i < count; i++) {
+        if(session_listen(all[i]) != 0) {
+            free(fds);
+            free(client_fd);
+            return 1;
         }
+        open_sessions++;
+    }
 
-        if(reply) {
-            DLOG("send: %s\n", reply);
+    while(open_sessions > 0) {
+        long long now = now_ms();
+        int timeout = -1, nfds = 0;
+
+        /* the listening socket and, if connected, the client of each session */
+        for(int i = 0; i < count; i++) {
+            struct gdb_session *gs = all[i];
+
+            client_fd[i] = -1;
+            if(gs->sl == NULL)
+                continue;
+
+            fds[nfds].fd = gs->listen_sock;
+            fds[nfds].events = POLLIN;
+            fds[nfds++].revents = 0;
+            if(gs->client < 0)
+                continue;
+
+            client_fd[i] = nfds;
+            fds[nfds].fd = gs->client;
+            fds[nfds].events = POLLIN;
+            fds[nfds].revents = 0;
+            if(gs->conn.out_pos < gs->conn.out_len) {
+                /* with --pipe the replies go to another fd, wait on that one */
+                if(gs->conn.out_fd != gs->client) {
+                    fds[nfds].fd = gs->conn.out_fd;
+                    fds[nfds].events = 0;
+                }
+                fds[nfds].events |= POLLOUT;
+            } else if(gs->conn.in_pos < gs->conn.in_len) {
+                /* a packet may already sit in the input buffer */
+                timeout = 0;
+            }
+            nfds++;
 
-            int result = gdb_send_packet(client, reply);
-            if(result != 0) {
-                ELOG("cannot send: %d\n", result);
-                free(reply);
-                free(packet);
-#ifdef __MINGW32__
-                win32_close_socket(sock);
-#endif
-                return 1;
+            if(gs->running) {
+                int left = gs->next_poll > now ? (int) (gs->next_poll - now) : 0;
+                if(timeout < 0 || left < timeout)
+                    timeout = left;
             }
+        }
 
-            free(reply);
+        if(poll(fds, nfds, timeout) < 0) {
+            perror("poll");
+            continue;
         }
 
-        free(packet);
-    }
+        for(int i = 0, n = 0; i < count; i++) {
+            struct gdb_session *gs = all[i];
+            int ret = 0;
+
+            if(gs->sl == NULL)
+                continue;
+            if(fds[n++].revents & POLLIN)
+                session_accept(gs);
+            if(client_fd[i] < 0)
+                continue;       /* not connected when polled */
+            n++;
+
+            short revents = fds[client_fd[i]].revents;
+            bool polled_in = fds[client_fd[i]].fd == gs->client;
+            bool input = gs->conn.in_pos < gs->conn.in_len ||
+                         (polled_in && (revents & (POLLIN | POLLHUP | POLLERR)));
+
+            if(gs->conn.out_pos < gs->conn.out_len && (revents & (POLLOUT | POLLHUP | POLLERR))) {
+                ret = gdb_flush(&gs->conn);
+                if(ret == GDB_AGAIN)
+                    ret = 0;
+                else if(ret < 0)
+                    ELOG("cannot send: %d\n", ret);
+            }
 
-#ifdef __MINGW32__
-    win32_close_socket(sock);
-#endif
+            if(ret == 0 && gs->running) {
+                /* GDB sends nothing but ^C while the core runs */
+                if(input) {
+                    ret = gdb_check_for_interrupt(&gs->conn);
+                    if(ret < 0) {
+                        ELOG("cannot check for int: %d\n", ret);
+                    } else if(ret == 1) {
+                        stlink_force_debug(gs->sl);
+                        gs->running = false;
+                    }
+                }
+                if(ret == 0 && gs->running && now_ms() >= gs->next_poll && continue_poll(gs))
+                    gs->running = false;
+                if(ret >= 0 && !gs->running) {
+                    arena_reset(gs);
+                    ret = send_reply(gs, stop_reply(gs), 0); // TRAP
+                }
+            } else if(ret == 0 && input && gs->conn.out_pos == gs->conn.out_len) {
+                char* packet;
+
+                /* the next packet only once the last reply is out */
+                ret = gdb_recv_packet(&gs->conn, &packet);
+                if(ret == GDB_AGAIN)
+                    ret = 0;
+                else if(ret < 0)
+                    ELOG("cannot recv: %d\n", ret);
+                else
+                    ret = process_packet(gs, packet, ret);
+            }
+
+            if(ret < 0) {
+                session_disconnect(gs);
+                if(gs->sl == NULL)
+                    open_sessions--;
+            }
+        }
+    }
 
+    free(fds);
+    free(client_fd);
     return 0;
 }
@@ -10,107 +10,53 @@
 #include <stlink.h>
 #include <stlink/logging.h>
 
+/* The library takes care of any alignment */
 static int mem_read_u8(stlink_t *sl, uint32_t addr, uint8_t *data)
 {
-    int offset = addr % 4;
-    int len = 4;
-
     if (sl == NULL || data == NULL) {
         return -1;
     }
 
-    /* Read address and length must be aligned */
-    if (stlink_read_mem32(sl, addr - offset, len) != 0) {
-        return -1;
-    }
-
-    *data = sl->q_buf[offset];
-    return 0;
+    return stlink_read_mem(sl, addr, data, sizeof(*data));
 }
 
 #ifdef UNUSED
 static int mem_read_u16(stlink_t *sl, uint32_t addr, uint16_t *data)
 {
-    int offset = addr % 4;
-    int len = (offset > 2 ? 8 : 4);
-
     if (sl == NULL || data == NULL) {
         return -1;
     }
 
-    /* Read address and length must be aligned */
-    if (stlink_read_mem32(sl, addr - offset, len) != 0) {
-        return -1;
-    }
-
-    memcpy(data, &sl->q_buf[offset], sizeof(*data));
-    return 0;
+    return stlink_read_mem(sl, addr, data, sizeof(*data));
 }
 
 static int mem_read_u32(stlink_t *sl, uint32_t addr, uint32_t *data)
 {
-    int offset = addr % 4;
-    int len = (offset > 0 ? 8 : 4);
-
     if (sl == NULL || data == NULL) {
         return -1;
     }
 
-    /* Read address and length must be aligned */
-    if (stlink_read_mem32(sl, addr - offset, len) != 0) {
-        return -1;
-    }
-
-    memcpy(data, &sl->q_buf[offset], sizeof(*data));
-    return 0;
+    return stlink_read_mem(sl, addr, data, sizeof(*data));
 }
 #endif
 
 static int mem_read(stlink_t *sl, uint32_t addr, void *data, uint16_t len)
 {
-    int offset = addr % 4;
-    int read_len = len + offset;
-
     if (sl == NULL || data == NULL) {
         return -1;
     }
 
-    /* Align read size */
-    if ((read_len % 4) != 0) {
-        read_len += 4 - (read_len % 4);
-    }
-
-    /* Address and length must be aligned */
-    if (stlink_read_mem32(sl, addr - offset, read_len) != 0) {
-        return -1;
-    }
-
-    memcpy(data, &sl->q_buf[offset], len);
-    return 0;
+    return stlink_read_mem(sl, addr, data, len);
 }
 
 static int mem_write(stlink_t *sl, uint32_t addr, void *data, uint16_t len)
 {
-    int offset = addr % 4;
-    int write_len = len + offset;
-
     if (sl == NULL || data == NULL) {
         return -1;
     }
 
-    /* Align read size */
-    if ((write_len % 4) != 0) {
-        write_len += 4 - (write_len % 4);
-    }
-
-    memcpy(&sl->q_buf[offset], data, len);
-
-    /* Address and length must be aligned */
-    if (stlink_write_mem32(sl, addr - offset, write_len) != 0) {
-        return -1;
-    }
-
-    return 0;
+    /* only the bytes given are written, their neighbours are left alone */
+    return stlink_write_mem(sl, addr, data, len);
 }
 
 /* For the SYS_WRITE0 call, we don't know the size of the null-terminated buffer
@@ -120,10 +66,10 @@ static int mem_write(stlink_t *sl, uint32_t addr, void *data, uint16_t len)
 #define WRITE0_BUFFER_SIZE 64
 
 /* Define a maximum size for buffers transmitted by semihosting. There is no
- * limit in the ARM specification but this is a safety net.
- * We remove 4 byte from Q_BUF_LEN to handle alignment correction.
+ * limit in the ARM specification but this is a safety net, and mem_read()
+ * and mem_write() take a 16 bit length.
  */
-#define MAX_BUFFER_SIZE (Q_BUF_LEN - 4)
+#define MAX_BUFFER_SIZE (UINT16_MAX - 3)
 
 /* Flags for Open syscall */
 
@@ -2,56 +2,282 @@
  * UglyLogging.  Slow, yet another wheel reinvented, but enough to make the
  * rest of our code pretty enough.
  *
+ * Each message is formatted into one line and written with a single call.
+ * With ugly_set_async(1) the line is instead pushed into a lock free ring
+ * and written out by a background thread, so the caller only pays for the
+ * vsnprintf.  Lines longer than a slot are cut to fit and end in "...", so
+ * the caller never waits for the writer; only a full ring falls back to a
+ * direct write.  Without the ring long lines are written out whole.  The
+ * timestamp prefix is only rebuilt when the second changes.
  */
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "stlink/logging.h"
 
-static int max_level = UINFO;
+int ugly_max_level = UINFO;
+
+/* ring size must be a power of two */
+#define UGLY_RING_SLOTS 256
+#define UGLY_SLOT_LEN   256
+#define UGLY_STAMP_LEN  21  /* "YYYY-MM-DDTHH:MM:SS " + \0 */
+
+struct ugly_slot {
+    unsigned seq;
+    time_t when;
+    int len;
+    char text[UGLY_SLOT_LEN];
+};
+
+static struct ugly_slot ugly_ring[UGLY_RING_SLOTS];
+static unsigned ugly_ring_head;  /* next slot to fill, shared by producers */
+static unsigned ugly_ring_tail;  /* next slot to drain, writer thread only */
+
+static pthread_t ugly_writer;
+static int ugly_async;
+static int ugly_writer_stop;
 
 int ugly_init(int maximum_threshold) {
-    max_level = maximum_threshold;
+    ugly_max_level = maximum_threshold;
+    return 0;
+}
+
+/* localtime() is only called once per second per thread */
+static void ugly_stamp(time_t when, char *out) {
+    static __thread time_t cached_when = (time_t) -1;
+    static __thread char cached[64];
+
+    if (when != cached_when) {
+        struct tm tt;
+#ifdef _WIN32
+        localtime_s(&tt, &when);
+#else
+        localtime_r(&when, &tt);
+#endif
+        snprintf(cached, sizeof(cached), "%d-%02d-%02dT%02d:%02d:%02d ",
+                 tt.tm_year + 1900, tt.tm_mon + 1, tt.tm_mday,
+                 tt.tm_hour, tt.tm_min, tt.tm_sec);
+        cached_when = when;
+    }
+    memcpy(out, cached, UGLY_STAMP_LEN);
+}
+
+/* Appends "stamp text" to out, returns the number of bytes added */
+static size_t ugly_format_line(char *out, time_t when, const char *text, size_t len) {
+    ugly_stamp(when, out);
+    memcpy(out + UGLY_STAMP_LEN - 1, text, len);
+    return UGLY_STAMP_LEN - 1 + len;
+}
+
+static void ugly_write_line(time_t when, const char *text, size_t len) {
+    char out[UGLY_STAMP_LEN + UGLY_SLOT_LEN];
+
+    fwrite(out, 1, ugly_format_line(out, when, text, len), stderr);
+}
+
+static int ugly_ring_push(time_t when, const char *text, int len) {
+    struct ugly_slot *slot;
+    unsigned pos = __atomic_load_n(&ugly_ring_head, __ATOMIC_RELAXED);
+
+    for (;;) {
+        slot = &ugly_ring[pos & (UGLY_RING_SLOTS - 1)];
+        unsigned seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int diff = (int) (seq - pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ugly_ring_head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return -1;  /* full */
+        } else {
+            pos = __atomic_load_n(&ugly_ring_head, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->when = when;
+    slot->len = len;
+    memcpy(slot->text, text, len);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Only called from the writer thread, or with the writer stopped.
+ * Queued lines are batched so stderr sees one write per batch. */
+static int ugly_ring_drain(void) {
+    static char batch[16 * (UGLY_STAMP_LEN + UGLY_SLOT_LEN)];
+    size_t used = 0;
+    int count = 0;
+
+    for (;;) {
+        struct ugly_slot *slot = &ugly_ring[ugly_ring_tail & (UGLY_RING_SLOTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ugly_ring_tail + 1)
+            break;
+
+        if (used + UGLY_STAMP_LEN + slot->len > sizeof(batch)) {
+            fwrite(batch, 1, used, stderr);
+            used = 0;
+        }
+        used += ugly_format_line(batch + used, slot->when, slot->text, slot->len);
+
+        __atomic_store_n(&slot->seq, ugly_ring_tail + UGLY_RING_SLOTS, __ATOMIC_RELEASE);
+        __atomic_store_n(&ugly_ring_tail, ugly_ring_tail + 1, __ATOMIC_RELEASE);
+        count++;
+    }
+
+    if (used)
+        fwrite(batch, 1, used, stderr);
+
+    return count;
+}
+
+static void *ugly_writer_main(void *arg) {
+    unsigned idle_us = 100;
+    (void) arg;
+
+    while (!__atomic_load_n(&ugly_writer_stop, __ATOMIC_ACQUIRE)) {
+        if (ugly_ring_drain()) {
+            idle_us = 100;
+        } else {
+            usleep(idle_us);
+            if (idle_us < 10000)
+                idle_us *= 2;
+        }
+    }
+
+    ugly_ring_drain();
+    return NULL;
+}
+
+static void ugly_atexit(void) {
+    ugly_set_async(0);
+}
+
+int ugly_set_async(int enable) {
+    static int atexit_registered;
+
+    if (enable && !ugly_async) {
+        for (unsigned i = 0; i < UGLY_RING_SLOTS; i++)
+            ugly_ring[i].seq = ugly_ring_tail + i;
+        ugly_ring_head = ugly_ring_tail;
+        ugly_writer_stop = 0;
+
+        if (pthread_create(&ugly_writer, NULL, ugly_writer_main, NULL) != 0)
+            return -1;
+
+        if (!atexit_registered) {
+            atexit(ugly_atexit);
+            atexit_registered = 1;
+        }
+        __atomic_store_n(&ugly_async, 1, __ATOMIC_RELEASE);
+    } else if (!enable && ugly_async) {
+        __atomic_store_n(&ugly_async, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&ugly_writer_stop, 1, __ATOMIC_RELEASE);
+        pthread_join(ugly_writer, NULL);
+    }
+
     return 0;
 }
 
+void ugly_flush(void) {
+    if (__atomic_load_n(&ugly_async, __ATOMIC_ACQUIRE)) {
+        /* let the writer catch up with what is queued right now */
+        unsigned head = __atomic_load_n(&ugly_ring_head, __ATOMIC_ACQUIRE);
+        while ((int) (head - __atomic_load_n(&ugly_ring_tail, __ATOMIC_ACQUIRE)) > 0 &&
+               __atomic_load_n(&ugly_async, __ATOMIC_ACQUIRE))
+            usleep(100);
+    }
+    fflush(stderr);
+}
+
 int ugly_log(int level, const char *tag, const char *format, ...) {
-    if (level > max_level) {
+    char line[UGLY_SLOT_LEN];
+    const char *name;
+    int len;
+
+    if (level > ugly_max_level) {
         return 0;
     }
-    va_list args;
-    va_start(args, format);
-    time_t mytt = time(NULL);
-    struct tm *tt;
-    tt = localtime(&mytt);
-    fprintf(stderr, "%d-%02d-%02dT%02d:%02d:%02d ", tt->tm_year + 1900, tt->tm_mon + 1, tt->tm_mday, tt->tm_hour, tt->tm_min, tt->tm_sec);
+
     switch (level) {
     case UDEBUG:
-        fprintf(stderr, "DEBUG %s: ", tag);
+        name = "DEBUG";
         break;
     case UINFO:
-        fprintf(stderr, "INFO %s: ", tag);
+        name = "INFO";
         break;
     case UWARN:
-        fprintf(stderr, "WARN %s: ", tag);
+        name = "WARN";
         break;
     case UERROR:
-        fprintf(stderr, "ERROR %s: ", tag);
+        name = "ERROR";
         break;
     case UFATAL:
-        fprintf(stderr, "FATAL %s: ", tag);
-        vfprintf(stderr, format, args);
-        exit(EXIT_FAILURE);
-        // NEVER GETS HERE!!!
+        name = "FATAL";
         break;
     default:
-        fprintf(stderr, "%d %s: ", level, tag);
+        name = NULL;
         break;
     }
-    vfprintf(stderr, format, args);
+
+    if (name)
+        len = snprintf(line, sizeof(line), "%s %s: ", name, tag);
+    else
+        len = snprintf(line, sizeof(line), "%d %s: ", level, tag);
+    if (len < 0 || len >= (int) sizeof(line))
+        len = 0;
+
+    va_list args;
+    va_start(args, format);
+    int msg_len = vsnprintf(line + len, sizeof(line) - len, format, args);
     va_end(args);
+    if (msg_len < 0)
+        return 0;
+
+    time_t when = time(NULL);
+    int async = level != UFATAL && __atomic_load_n(&ugly_async, __ATOMIC_ACQUIRE);
+
+    if (async && len + msg_len >= (int) sizeof(line)) {
+        /* vsnprintf kept what fits, mark the cut */
+        len = (int) sizeof(line) - 1;
+        memcpy(line + len - 4, "...\n", 4);
+        msg_len = 0;
+    }
+
+    if (len + msg_len < (int) sizeof(line)) {
+        len += msg_len;
+        if (!async || ugly_ring_push(when, line, len) != 0) {
+            ugly_flush();
+            ugly_write_line(when, line, len);
+        }
+    } else {
+        /* too long for a slot, format it again into a buffer of its own */
+        char *big = malloc(UGLY_STAMP_LEN + len + msg_len);
+
+        if (level == UFATAL)
+            ugly_flush();
+        if (big != NULL) {
+            ugly_stamp(when, big);
+            memcpy(big + UGLY_STAMP_LEN - 1, line, len);
+            va_start(args, format);
+            vsnprintf(big + UGLY_STAMP_LEN - 1 + len, msg_len + 1, format, args);
+            va_end(args);
+            fwrite(big, 1, UGLY_STAMP_LEN - 1 + len + msg_len, stderr);
+            free(big);
+        }
+    }
+
+    if (level == UFATAL) {
+        ugly_flush();
+        exit(EXIT_FAILURE);
+        // NEVER GETS HERE!!!
+    }
+
     return 1;
 }
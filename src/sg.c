@@ -104,8 +104,10 @@ void _stlink_sg_close(stlink_t *sl) {
     if (sl) {
         struct stlink_libsg *slsg = sl->backend_data;
         libusb_close(slsg->usb_handle);
-        libusb_exit(slsg->libusb_ctx);
+        stlink_usb_context_unref();
         free(slsg);
+        free(sl->q_buf);
+        sl->q_buf = NULL;
     }
 }
 
@@ -175,10 +177,8 @@ int send_usb_mass_storage_command(libusb_device_handle *handle, uint8_t endpoint
     DLOG("Sending usb m-s cmd: cdblen:%d, rxsize=%d\n", cdb_length, expected_rx_size);
     dump_CDB_command(cdb, cdb_length);
 
+    /* shared by all handles, the first tag used is 1 */
     static uint32_t tag;
-    if (tag == 0) {
-        tag = 1;
-    }
 
     int try = 0;
     int ret = 0;
@@ -191,8 +191,8 @@ int send_usb_mass_storage_command(libusb_device_handle *handle, uint8_t endpoint
     c_buf[i++] = 'S';
     c_buf[i++] = 'B';
     c_buf[i++] = 'C';
-    write_uint32(&c_buf[i], tag);
-    uint32_t this_tag = tag++;
+    uint32_t this_tag = __atomic_add_fetch(&tag, 1, __ATOMIC_RELAXED);
+    write_uint32(&c_buf[i], this_tag);
     write_uint32(&c_buf[i+4], expected_rx_size);
     i+= 8;
     c_buf[i++] = flags;
@@ -934,21 +934,34 @@ static stlink_backend_t _stlink_sg_backend = {
     _stlink_sg_current_mode,
     _stlink_sg_force_debug,
     NULL, /* target_voltage */
-    NULL /* set_swdclk */
+    NULL, /* set_swdclk */
+    NULL, /* mem_ops */
+    NULL  /* write_regs */
 };
 
 static stlink_t* stlink_open(const int verbose) {
 
-    stlink_t *sl = malloc(sizeof (stlink_t));
-    memset(sl, 0, sizeof(stlink_t));
+    stlink_t *sl = calloc(1, sizeof (stlink_t));
     struct stlink_libsg *slsg = malloc(sizeof (struct stlink_libsg));
-    if (sl == NULL || slsg == NULL) {
+    unsigned char *q_buf = malloc(Q_BUF_LEN);
+    if (sl == NULL || slsg == NULL || q_buf == NULL) {
         WLOG("Couldn't malloc stlink and stlink_sg structures out of memory!\n");
+        free(sl);
+        free(slsg);
+        free(q_buf);
+        return NULL;
+    }
+    sl->q_buf = q_buf;
+    if (stlink_init_lock(sl)) {
+        free(sl);
+        free(slsg);
+        free(q_buf);
         return NULL;
     }
 
-    if (libusb_init(&(slsg->libusb_ctx))) {
-        WLOG("failed to init libusb context, wrong version of libraries?\n");
+    slsg->libusb_ctx = stlink_usb_context_ref();
+    if (slsg->libusb_ctx == NULL) {
+        free(sl->q_buf);
         free(sl);
         free(slsg);
         return NULL;
@@ -960,7 +973,8 @@ static stlink_t* stlink_open(const int verbose) {
     if (slsg->usb_handle == NULL) {
         WLOG("Failed to find an stlink v1 by VID:PID\n");
         libusb_close(slsg->usb_handle);
-        libusb_exit(slsg->libusb_ctx);
+        stlink_usb_context_unref();
+        free(sl->q_buf);
         free(sl);
         free(slsg);
         return NULL;
@@ -975,7 +989,8 @@ static stlink_t* stlink_open(const int verbose) {
         if (r < 0) {
             WLOG("libusb_detach_kernel_driver(() error %s\n", strerror(-r));
             libusb_close(slsg->usb_handle);
-            libusb_exit(slsg->libusb_ctx);
+            stlink_usb_context_unref();
+            free(sl->q_buf);
             free(sl);
             free(slsg);
             return NULL;
@@ -988,7 +1003,8 @@ static stlink_t* stlink_open(const int verbose) {
         /* this may fail for a previous configured device */
         WLOG("libusb_get_configuration()\n");
         libusb_close(slsg->usb_handle);
-        libusb_exit(slsg->libusb_ctx);
+        stlink_usb_context_unref();
+        free(sl->q_buf);
         free(sl);
         free(slsg);
         return NULL;
@@ -1003,7 +1019,8 @@ static stlink_t* stlink_open(const int verbose) {
             /* this may fail for a previous configured device */
             WLOG("libusb_set_configuration() failed\n");
             libusb_close(slsg->usb_handle);
-            libusb_exit(slsg->libusb_ctx);
+            stlink_usb_context_unref();
+            free(sl->q_buf);
             free(sl);
             free(slsg);
             return NULL;
@@ -1013,7 +1030,8 @@ static stlink_t* stlink_open(const int verbose) {
     if (libusb_claim_interface(slsg->usb_handle, 0)) {
         WLOG("libusb_claim_interface() failed\n");
         libusb_close(slsg->usb_handle);
-        libusb_exit(slsg->libusb_ctx);
+        stlink_usb_context_unref();
+        free(sl->q_buf);
         free(sl);
         free(slsg);
         return NULL;
@@ -1037,7 +1055,6 @@ static stlink_t* stlink_open(const int verbose) {
 
 
 stlink_t* stlink_v1_open_inner(const int verbose) {
-    ugly_init(verbose);
     stlink_t *sl = stlink_open(verbose);
     if (sl == NULL) {
         ELOG("Could not open stlink device\n");
@@ -7,13 +7,54 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include <stlink.h>
+#include <stlink/mmap.h>
 #include <stlink/tools/flash.h>
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 static stlink_t *connected_stlink = NULL;
 
+/* gang mode, every device is closed by cleanup() */
+static stlink_t **gang_stlinks = NULL;
+static size_t gang_size = 0;
+
+/* The image shared by all gang workers, binary files are mapped once and
+ * intel hex files are parsed once per erased pattern */
+struct flash_image {
+    pthread_mutex_t lock;
+    uint8_t *map;
+    size_t map_len;
+    int ihex_parsed[2];
+    uint8_t *ihex_mem[2];
+    size_t ihex_size[2];
+    stm32_addr_t ihex_addr[2];
+};
+
+struct gang_job {
+    pthread_t thread;
+    uint8_t serial[16];
+    int serial_size;
+    struct flash_opts *o;
+    struct flash_image *img;
+    stlink_t **slot;        /* entry in gang_stlinks */
+    stlink_t *sl;
+    int busy;               /* in use elsewhere, not flashed */
+    uint8_t bus, addr;      /* with --gang all, for a serial that cannot be read */
+    int started;
+    int err;
+    double seconds;
+};
+
 static void cleanup(int signum) {
     (void)signum;
 
@@ -24,6 +65,14 @@ static void cleanup(int signum) {
         stlink_close(connected_stlink);
     }
 
+    for (size_t n = 0; n < gang_size; n++) {
+        if (gang_stlinks[n] == NULL)
+            continue;
+        stlink_run(gang_stlinks[n]);
+        stlink_exit_debug_mode(gang_stlinks[n]);
+        stlink_close(gang_stlinks[n]);
+    }
+
     exit(1);
 }
 
@@ -31,95 +80,360 @@ static void usage(void)
 {
     puts("stlinkv1 command line: ./st-flash [--debug] [--reset] [--format <format>] {read|write} /dev/sgX <path> <addr> <size>");
     puts("stlinkv1 command line: ./st-flash [--debug] /dev/sgX erase");
-    puts("stlinkv2 command line: ./st-flash [--debug] [--reset] [--serial <serial>] [--format <format>] {read|write} <path> <addr> <size>");
+    puts("stlinkv2 command line: ./st-flash [--debug] [--reset] [--tune-swdclk] [--serial <serial>] [--format <format>] {read|write} <path> <addr> <size>");
     puts("stlinkv2 command line: ./st-flash [--debug] [--serial <serial>] erase");
     puts("stlinkv2 command line: ./st-flash [--debug] [--serial <serial>] reset");
+    puts("gang command line:     ./st-flash [--debug] [--reset] --gang {all|<serial>[,<serial>...]} [--format <format>] {write|erase|reset} ...");
     puts("                       Use hex format for addr, <serial> and <size>.");
     puts("                       Format may be 'binary' (default) or 'ihex', although <addr> must be specified for binary format only.");
     puts("                       ./st-flash [--version]");
 }
 
-int main(int ac, char** av)
+/* Get the core halted and ready for the flash loader */
+static int flash_prepare(stlink_t *sl, const struct flash_opts *o)
 {
-    stlink_t* sl = NULL;
-    struct flash_opts o;
-    int err = -1;
-    uint8_t * mem = NULL;
-
-    o.size = 0;
-    if (flash_get_opts(&o, ac - 1, av + 1) == -1)
-    {
-        printf("invalid command line\n");
-        usage();
-        return -1;
-    }
-
-    printf("st-flash %s\n", STLINK_VERSION);
-
-    if (o.devname != NULL) /* stlinkv1 */
-        sl = stlink_v1_open(o.log_level, 1);
-    else /* stlinkv2 */
-        sl = stlink_open_usb(o.log_level, 1, (char *)o.serial);
-
-    if (sl == NULL)
-        return -1;
-
-    sl->verbose = o.log_level;
-
-    connected_stlink = sl;
-    signal(SIGINT, &cleanup);
-    signal(SIGTERM, &cleanup);
-    signal(SIGSEGV, &cleanup);
-
     if (stlink_current_mode(sl) == STLINK_DEV_DFU_MODE) {
         if (stlink_exit_dfu_mode(sl)) {
             printf("Failed to exit DFU mode\n");
-            goto on_error;
+            return -1;
         }
     }
 
     if (stlink_current_mode(sl) != STLINK_DEV_DEBUG_MODE) {
         if (stlink_enter_swd_mode(sl)) {
             printf("Failed to enter SWD mode\n");
-            goto on_error;
+            return -1;
         }
     }
 
-    if (o.reset){
+    if (o->tune_swdclk && stlink_swdclk_autotune(sl) < 0)
+        printf("SWD clock tuning failed, keeping the default clock\n");
+
+    if (o->reset){
         if (stlink_jtag_reset(sl, 2)) {
             printf("Failed to reset JTAG\n");
-            goto on_error;
+            return -1;
         }
 
         if (stlink_reset(sl)) {
             printf("Failed to reset device\n");
-            goto on_error;
+            return -1;
         }
     }
 
     // Disable DMA - Set All DMA CCR Registers to zero. - AKS 1/7/2013
     if (sl->chip_id == STLINK_CHIPID_STM32_F4)
     {
-        memset(sl->q_buf,0,4);
+        static uint32_t zero;
+        struct stlink_mem_seg segs[32];
+        int n = 0;
         for (int i=0;i<8;i++) {
-            stlink_write_mem32(sl,0x40026000+0x10+0x18*i,4);
-            stlink_write_mem32(sl,0x40026400+0x10+0x18*i,4);
-            stlink_write_mem32(sl,0x40026000+0x24+0x18*i,4);
-            stlink_write_mem32(sl,0x40026400+0x24+0x18*i,4);
+            segs[n++] = (struct stlink_mem_seg) { 0x40026000+0x10+0x18*i, &zero, 4 };
+            segs[n++] = (struct stlink_mem_seg) { 0x40026400+0x10+0x18*i, &zero, 4 };
+            segs[n++] = (struct stlink_mem_seg) { 0x40026000+0x24+0x18*i, &zero, 4 };
+            segs[n++] = (struct stlink_mem_seg) { 0x40026400+0x24+0x18*i, &zero, 4 };
         }
+        stlink_write_memv(sl, segs, n);
     }
 
     // Core must be halted to use RAM based flashloaders
     if (stlink_force_debug(sl)) {
         printf("Failed to halt the core\n");
-        goto on_error;
+        return -1;
     }
 
     if (stlink_status(sl)) {
         printf("Failed to get Core's status\n");
-        goto on_error;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int flash_image_map(struct flash_image *img, const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_BINARY);
+
+    if (fd == -1) {
+        printf("open(%s) == -1\n", path);
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        printf("fstat() == -1\n");
+        close(fd);
+        return -1;
+    }
+
+    img->map = (uint8_t *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (img->map == MAP_FAILED) {
+        img->map = NULL;
+        printf("mmap() == MAP_FAILED\n");
+        return -1;
+    }
+
+    img->map_len = st.st_size;
+    return 0;
+}
+
+/* Parse the intel hex file for the erased pattern of this device, only the
+ * first worker that needs it does the parsing */
+static int flash_image_ihex(struct flash_image *img, stlink_t *sl, const char *path,
+                            uint8_t **mem, size_t *size, stm32_addr_t *addr)
+{
+    uint8_t pattern = stlink_get_erased_pattern(sl);
+    int idx = pattern ? 1 : 0;
+    int err = 0;
+
+    pthread_mutex_lock(&img->lock);
+    if (!img->ihex_parsed[idx]) {
+        err = stlink_parse_ihex(path, pattern, &img->ihex_mem[idx], &img->ihex_size[idx],
+                                &img->ihex_addr[idx]);
+        img->ihex_parsed[idx] = err == -1 ? -1 : 1;
+    }
+    if (img->ihex_parsed[idx] == -1)
+        err = -1;
+    pthread_mutex_unlock(&img->lock);
+
+    *mem = img->ihex_mem[idx];
+    *size = img->ihex_size[idx];
+    *addr = img->ihex_addr[idx];
+    return err;
+}
+
+static int flash_write_image(stlink_t *sl, const struct flash_opts *o, struct flash_image *img)
+{
+    uint8_t *mem;
+    size_t size;
+    stm32_addr_t addr = o->addr;
+    int err;
+
+    if (o->format == FLASH_FORMAT_IHEX) {
+        if (flash_image_ihex(img, sl, o->filename, &mem, &size, &addr) == -1) {
+            printf("Cannot parse %s as Intel-HEX file\n", o->filename);
+            return -1;
+        }
+    } else {
+        mem = img->map;
+        size = img->map_len;
+    }
+
+    if ((addr >= sl->flash_base) && (addr < sl->flash_base + sl->flash_size)) {
+        err = stlink_mwrite_flash(sl, mem, (uint32_t)size, addr);
+        if (err == -1)
+            printf("stlink_mwrite_flash() == -1\n");
+    } else if ((addr >= sl->sram_base) && (addr < sl->sram_base + sl->sram_size)) {
+        err = stlink_mwrite_sram(sl, mem, (uint32_t)size, addr);
+        if (err == -1)
+            printf("stlink_mwrite_sram() == -1\n");
+    } else {
+        err = -1;
+        printf("Unknown memory region\n");
+    }
+
+    return err;
+}
+
+static void *gang_worker(void *arg)
+{
+    struct gang_job *job = arg;
+    const struct flash_opts *o = job->o;
+    stlink_t *sl;
+    struct timeval start, end;
+
+    gettimeofday(&start, NULL);
+    job->err = -1;
+
+    sl = stlink_open_usb(o->log_level, 1, (char *)job->serial);
+    if (sl == NULL)
+        goto done;
+
+    sl->verbose = o->log_level;
+    *job->slot = job->sl = sl;
+
+    if (flash_prepare(sl, o) == -1)
+        goto done;
+
+    if (o->cmd == FLASH_CMD_WRITE) {
+        if (flash_write_image(sl, o, job->img) == -1)
+            goto done;
+    } else if (o->cmd == FLASH_CMD_ERASE) {
+        if (stlink_erase_flash_mass(sl) == -1) {
+            printf("stlink_erase_flash_mass() == -1\n");
+            goto done;
+        }
+    }
+
+    if (o->reset || o->cmd == CMD_RESET) {
+        if (stlink_jtag_reset(sl, 2) || stlink_reset(sl)) {
+            printf("Failed to reset device\n");
+            goto done;
+        }
     }
 
+    job->err = 0;
+
+done:
+    gettimeofday(&end, NULL);
+    job->seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    return NULL;
+}
+
+static void print_serial(const uint8_t *serial, int size)
+{
+    for (int n = 0; n < size; n++)
+        printf("%02x", serial[n]);
+}
+
+static int flash_gang(struct flash_opts *o)
+{
+    struct flash_image img;
+    struct gang_job *jobs;
+    int count, failed = 0;
+
+    memset(&img, 0, sizeof(img));
+    pthread_mutex_init(&img.lock, NULL);
+
+    if (o->gang_all) {
+        struct stlink_usb_info *infos;
+        size_t n, cnt = stlink_enumerate_usb(&infos);
+
+        jobs = calloc(cnt ? cnt : 1, sizeof(struct gang_job));
+        count = (int) cnt;
+        /* busy ones get no worker but still show up in the summary */
+        for (n = 0; jobs != NULL && n < cnt; n++) {
+            memcpy(jobs[n].serial, infos[n].serial, sizeof(infos[n].serial));
+            jobs[n].serial_size = infos[n].serial_size;
+            jobs[n].busy = infos[n].busy;
+            jobs[n].bus = infos[n].bus;
+            jobs[n].addr = infos[n].addr;
+        }
+        free(infos);
+    } else {
+        count = o->gang_count;
+        jobs = calloc(count, sizeof(struct gang_job));
+        for (int n = 0; jobs != NULL && n < count; n++) {
+            memcpy(jobs[n].serial, o->gang_serials[n], sizeof(jobs[n].serial));
+            jobs[n].serial_size = o->gang_serial_sizes[n];
+        }
+    }
+
+    if (jobs == NULL || count == 0) {
+        printf("No stlink programmers to flash\n");
+        free(jobs);
+        return -1;
+    }
+
+    if (o->cmd == FLASH_CMD_WRITE && o->format == FLASH_FORMAT_BINARY &&
+        flash_image_map(&img, o->filename) == -1) {
+        free(jobs);
+        return -1;
+    }
+
+    gang_stlinks = calloc(count, sizeof(stlink_t *));
+    if (gang_stlinks == NULL) {
+        free(jobs);
+        return -1;
+    }
+
+    gang_size = count;
+    signal(SIGINT, &cleanup);
+    signal(SIGTERM, &cleanup);
+    signal(SIGSEGV, &cleanup);
+
+    /* One worker per device, each one opens its own stlink */
+    for (int n = 0; n < count; n++) {
+        jobs[n].o = o;
+        jobs[n].img = &img;
+        jobs[n].slot = &gang_stlinks[n];
+        jobs[n].err = -1;
+        if (jobs[n].busy)
+            continue;
+        jobs[n].started = pthread_create(&jobs[n].thread, NULL, gang_worker, &jobs[n]) == 0;
+    }
+
+    for (int n = 0; n < count; n++) {
+        if (jobs[n].started)
+            pthread_join(jobs[n].thread, NULL);
+    }
+
+    printf("\nGang summary:\n");
+    for (int n = 0; n < count; n++) {
+        stlink_t *sl = jobs[n].sl;
+
+        printf(" serial: ");
+        if (sl != NULL) {
+            print_serial((uint8_t *)sl->serial, sl->serial_size);
+            printf(" %s (%.2f s)\n", jobs[n].err ? "FAILED" : "OK", jobs[n].seconds);
+            stlink_exit_debug_mode(sl);
+            gang_stlinks[n] = NULL;
+            stlink_close(sl);
+        } else {
+            print_serial(jobs[n].serial, jobs[n].serial_size);
+            if (jobs[n].serial_size == 0 && o->gang_all)
+                printf("? (bus %u, device %u)", jobs[n].bus, jobs[n].addr);
+            printf(" FAILED (%s)\n", jobs[n].busy ? "in use by another process" : "cannot open");
+        }
+
+        if (sl == NULL || jobs[n].err)
+            failed++;
+    }
+    printf("%d of %d devices OK\n", count - failed, count);
+
+    if (img.map != NULL)
+        munmap((void *) img.map, img.map_len);
+    free(img.ihex_mem[0]);
+    free(img.ihex_mem[1]);
+    pthread_mutex_destroy(&img.lock);
+    free(gang_stlinks);
+    gang_stlinks = NULL;
+    gang_size = 0;
+    free(jobs);
+
+    return failed ? -1 : 0;
+}
+
+int main(int ac, char** av)
+{
+    stlink_t* sl = NULL;
+    struct flash_opts o;
+    int err = -1;
+    uint8_t * mem = NULL;
+
+    o.size = 0;
+    if (flash_get_opts(&o, ac - 1, av + 1) == -1)
+    {
+        printf("invalid command line\n");
+        usage();
+        return -1;
+    }
+
+    printf("st-flash %s\n", STLINK_VERSION);
+    ugly_init(o.log_level);
+
+    if (o.gang_all || o.gang_count)
+        return flash_gang(&o);
+
+    if (o.devname != NULL) /* stlinkv1 */
+        sl = stlink_v1_open(o.log_level, 1);
+    else /* stlinkv2 */
+        sl = stlink_open_usb(o.log_level, 1, (char *)o.serial);
+
+    if (sl == NULL)
+        return -1;
+
+    sl->verbose = o.log_level;
+
+    connected_stlink = sl;
+    signal(SIGINT, &cleanup);
+    signal(SIGTERM, &cleanup);
+    signal(SIGSEGV, &cleanup);
+
+    if (flash_prepare(sl, &o) == -1)
+        goto on_error;
+
     if (o.cmd == FLASH_CMD_WRITE) /* write */
     {
         size_t size = 0;
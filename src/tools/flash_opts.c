@@ -11,6 +11,45 @@ static bool starts_with(const char * str, const char * prefix) {
     return (0 == strncmp(str, prefix, n));
 }
 
+/* Hex string to binary serial, returns -1 when it does not fit */
+static int parse_serial(const char * str, size_t len, uint8_t serial[16]) {
+    if (len % 2 != 0 || len / 2 > 16) return -1;
+
+    memset(serial, 0, 16);
+    for (size_t k = 0; k < len / 2; ++k) {
+        char buffer[3] = {0};
+        char * tail;
+        memcpy(buffer, str + 2 * k, 2);
+        serial[k] = (uint8_t)strtol(buffer, &tail, 16);
+        if (tail[0] != '\0') return -1;
+    }
+
+    return 0;
+}
+
+/* "all" or a comma separated list of serials */
+static int parse_gang(struct flash_opts * o, const char * list) {
+    if (strcmp(list, "all") == 0) {
+        o->gang_all = 1;
+        return 0;
+    }
+
+    while (*list) {
+        const char * end = strchr(list, ',');
+        size_t len = end ? (size_t)(end - list) : strlen(list);
+
+        if (len == 0 || o->gang_count >= FLASH_GANG_MAX) return -1;
+        if (parse_serial(list, len, o->gang_serials[o->gang_count]) == -1) return -1;
+        o->gang_serial_sizes[o->gang_count] = (int)(len / 2);
+        o->gang_count++;
+
+        list += len;
+        if (*list == ',') list++;
+    }
+
+    return o->gang_count ? 0 : -1;
+}
+
 int flash_get_opts(struct flash_opts* o, int ac, char** av)
 {
     bool serial_specified = false;
@@ -33,6 +72,9 @@ int flash_get_opts(struct flash_opts* o, int ac, char** av)
         else if (strcmp(av[0], "--reset") == 0) {
             o->reset = 1;
         }
+        else if (strcmp(av[0], "--tune-swdclk") == 0) {
+            o->tune_swdclk = 1;
+        }
         else if (strcmp(av[0], "--serial") == 0 || starts_with(av[0], "--serial=")) {
             const char * serial;
             if(strcmp(av[0], "--serial") == 0) {
@@ -45,19 +87,24 @@ int flash_get_opts(struct flash_opts* o, int ac, char** av)
                 serial = av[0] + strlen("--serial=");
             }
 
-            /** @todo This is not really portable, as strlen really returns size_t we need to obey and not cast it to a signed type. */
-            int j = (int)strlen(serial);
-            int length = j / 2;  //the length of the destination-array
-            if(j % 2 != 0) return -1;
- 
-            for(size_t k = 0; j >= 0 && k < sizeof(o->serial); ++k, j -= 2) {
-                char buffer[3] = {0};
-                memcpy(buffer, serial + j, 2);
-                o->serial[length - k] = (uint8_t)strtol(buffer, NULL, 16);
-            }
+            if (parse_serial(serial, strlen(serial), o->serial) == -1) return -1;
 
             serial_specified = true;
         }
+        else if (strcmp(av[0], "--gang") == 0 || starts_with(av[0], "--gang=")) {
+            const char * list;
+            if(strcmp(av[0], "--gang") == 0) {
+                ac--;
+                av++;
+                if (ac < 1) return -1;
+                list = av[0];
+            }
+            else {
+                list = av[0] + strlen("--gang=");
+            }
+
+            if (parse_gang(o, list) == -1) return -1;
+        }
         else if (strcmp(av[0], "--format") == 0 || starts_with(av[0], "--format=")) {
             const char * format;
             if(strcmp(av[0], "--format") == 0) {
@@ -162,6 +209,11 @@ int flash_get_opts(struct flash_opts* o, int ac, char** av)
     
     if(serial_specified && o->devname != NULL) return -1; // serial not supported for v1
 
+    if(o->gang_all || o->gang_count) {
+        if(serial_specified || o->devname != NULL) return -1;
+        if(o->cmd == FLASH_CMD_READ) return -1;  // all devices would read into the same file
+    }
+
     return 0;
 }
 
@@ -246,21 +246,14 @@ stlink_gui_populate_devmem_view (STlinkGUI *gui)
 
         if (off + MEM_READ_SIZE > gui->sl->flash_size) {
             n_read = (guint) gui->sl->flash_size - off;
-
-            /* align if needed */
-            if (n_read & 3) {
-                n_read = (n_read + 4) & ~(3);
-            }
         }
-        /* reads to sl->q_buf */
-        stlink_read_mem32(gui->sl, addr + off, n_read);
-        if (gui->sl->q_len < 0) {
+        /* straight into our buffer, q_buf belongs to whoever holds the handle lock */
+        if (stlink_read_mem (gui->sl, addr + off, gui->flash_mem.memory + off, n_read)) {
             stlink_gui_set_info_error_message (gui, "Failed to read memory");
             g_free (gui->flash_mem.memory);
             gui->flash_mem.memory = NULL;
             return;
         }
-        memcpy (gui->flash_mem.memory + off, gui->sl->q_buf, n_read);
         gui->progress.fraction = (gdouble) (off + n_read) / gui->sl->flash_size;
     }
     g_idle_add ((GSourceFunc) stlink_gui_update_devmem_view, gui);
@@ -530,6 +523,7 @@ connect_button_cb (GtkWidget *widget, gpointer data)
         return;
 
     /* try version 1 then version 2 */
+    ugly_init(0);
     gui->sl = stlink_v1_open(0, 1);
     if (gui->sl == NULL) {
 	    gui->sl = stlink_open_usb(0, 1, NULL);
@@ -547,13 +541,16 @@ connect_button_cb (GtkWidget *widget, gpointer data)
 
     /* Disable DMA - Set All DMA CCR Registers to zero. - AKS 1/7/2013 */
     if (gui->sl->chip_id == STLINK_CHIPID_STM32_F4) {
-        memset(gui->sl->q_buf, 0, 4);
+        static const uint32_t zero;
+        struct stlink_mem_seg segs[32];
+
         for (i = 0; i < 8; i++) {
-            stlink_write_mem32(gui->sl, 0x40026000 + 0x10 + 0x18 * i, 4);
-            stlink_write_mem32(gui->sl, 0x40026400 + 0x10 + 0x18 * i, 4);
-            stlink_write_mem32(gui->sl, 0x40026000 + 0x24 + 0x18 * i, 4);
-            stlink_write_mem32(gui->sl, 0x40026400 + 0x24 + 0x18 * i, 4);
+            segs[4 * i + 0] = (struct stlink_mem_seg) { 0x40026000 + 0x10 + 0x18 * i, (void *) &zero, 4 };
+            segs[4 * i + 1] = (struct stlink_mem_seg) { 0x40026400 + 0x10 + 0x18 * i, (void *) &zero, 4 };
+            segs[4 * i + 2] = (struct stlink_mem_seg) { 0x40026000 + 0x24 + 0x18 * i, (void *) &zero, 4 };
+            segs[4 * i + 3] = (struct stlink_mem_seg) { 0x40026400 + 0x24 + 0x18 * i, (void *) &zero, 4 };
         }
+        stlink_write_memv(gui->sl, segs, 32);
     }
     stlink_gui_set_connected (gui);
 }
@@ -15,7 +15,7 @@ static void usage(void)
     puts("st-info --chipid");
     puts("st-info --serial");
     puts("st-info --hla-serial");
-    puts("st-info --probe");
+    puts("st-info --probe [--deep]");
 }
 
 /* Print normal or OpenOCD hla_serial with newline */
@@ -61,19 +61,43 @@ static void stlink_print_info(stlink_t *sl)
 		printf("  descr: %s\n", params->description);
 }
 
-static void stlink_probe(void)
+static void stlink_print_usb_info(const struct stlink_usb_info *info)
 {
-    stlink_t **stdevs;
-    size_t size;
+    printf(" serial: ");
+    for (int n = 0; n < info->serial_size; n++)
+        printf("%02x", info->serial[n]);
+    printf("\n    usb: %03u:%03u (pid: %04x)\n", info->bus, info->addr, info->pid);
+
+    if (info->busy)
+        printf("version: unknown (in use)\n");
+    else
+        printf("version: V%uJ%uS%u\n", info->version.stlink_v,
+               info->version.jtag_v, info->version.swim_v);
+}
+
+static void stlink_probe(bool deep)
+{
+    if (deep) {
+        stlink_t **stdevs;
+        size_t size = stlink_probe_usb(&stdevs);
 
-    size = stlink_probe_usb(&stdevs);
+        printf("Found %u stlink programmers\n", (unsigned int)size);
 
-    printf("Found %u stlink programmers\n", (unsigned int)size);
+        for (size_t n = 0; n < size; n++)
+            stlink_print_info(stdevs[n]);
 
-    for (size_t n = 0; n < size; n++)
-        stlink_print_info(stdevs[n]);
+        stlink_probe_usb_free(&stdevs, size);
+    } else {
+        struct stlink_usb_info *infos;
+        size_t size = stlink_enumerate_usb(&infos);
+
+        printf("Found %u stlink programmers\n", (unsigned int)size);
 
-    stlink_probe_usb_free(&stdevs, size);
+        for (size_t n = 0; n < size; n++)
+            stlink_print_usb_info(&infos[n]);
+
+        free(infos);
+    }
 }
 
 static stlink_t *stlink_open_first(void)
@@ -92,7 +116,7 @@ static int print_data(char **av)
 
     // Probe needs all devices unclaimed
     if (strcmp(av[1], "--probe") == 0) {
-        stlink_probe();
+        stlink_probe(av[2] != NULL && strcmp(av[2], "--deep") == 0);
         return 0;
     } else if (strcmp(av[1], "--version") == 0) {
         printf("v%s\n", STLINK_VERSION);
@@ -149,6 +173,7 @@ int main(int ac, char** av)
         return -1;
     }
 
+    ugly_init(0);
     err = print_data(av);
 
     return err;
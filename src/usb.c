@@ -7,11 +7,80 @@
 #include <libusb.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "stlink.h"
 
 enum SCSI_Generic_Direction {SG_DXFER_TO_DEV=0, SG_DXFER_FROM_DEV=0x80};
 
+/* One libusb context for all open programmers, created by the first
+ * reference and torn down with the last one.  Its events are handled
+ * by a single background thread. */
+static pthread_mutex_t stlink_usb_ctx_lock = PTHREAD_MUTEX_INITIALIZER;
+static libusb_context *stlink_usb_ctx;
+static int stlink_usb_ctx_refs;
+static pthread_t stlink_usb_event_thread;
+static int stlink_usb_event_running;
+static int stlink_usb_event_stop;
+
+static void *stlink_usb_event_main(void *arg) {
+    libusb_context *ctx = arg;
+
+    while (!__atomic_load_n(&stlink_usb_event_stop, __ATOMIC_ACQUIRE)) {
+        struct timeval tv = { 0, 100000 };
+        int ret = libusb_handle_events_timeout_completed(ctx, &tv, &stlink_usb_event_stop);
+
+        if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+            /* synchronous transfers keep working, they handle their own events */
+            WLOG("libusb event handling failed: %s\n", libusb_error_name(ret));
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+libusb_context *stlink_usb_context_ref(void) {
+    libusb_context *ctx = NULL;
+
+    pthread_mutex_lock(&stlink_usb_ctx_lock);
+    if (stlink_usb_ctx_refs == 0) {
+        if (libusb_init(&stlink_usb_ctx)) {
+            WLOG("failed to init libusb context, wrong version of libraries?\n");
+            stlink_usb_ctx = NULL;
+            goto out;
+        }
+
+        stlink_usb_event_stop = 0;
+        stlink_usb_event_running = pthread_create(&stlink_usb_event_thread, NULL,
+                                                  stlink_usb_event_main, stlink_usb_ctx) == 0;
+    }
+
+    stlink_usb_ctx_refs++;
+    ctx = stlink_usb_ctx;
+out:
+    pthread_mutex_unlock(&stlink_usb_ctx_lock);
+    return ctx;
+}
+
+void stlink_usb_context_unref(void) {
+    pthread_mutex_lock(&stlink_usb_ctx_lock);
+    if (stlink_usb_ctx_refs > 0 && --stlink_usb_ctx_refs == 0) {
+        if (stlink_usb_event_running) {
+            __atomic_store_n(&stlink_usb_event_stop, 1, __ATOMIC_RELEASE);
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+            libusb_interrupt_event_handler(stlink_usb_ctx);
+#endif
+            pthread_join(stlink_usb_event_thread, NULL);
+            stlink_usb_event_running = 0;
+        }
+
+        libusb_exit(stlink_usb_ctx);
+        stlink_usb_ctx = NULL;
+    }
+    pthread_mutex_unlock(&stlink_usb_ctx_lock);
+}
+
 void _stlink_usb_close(stlink_t* sl) {
     if (!sl)
         return;
@@ -19,11 +88,20 @@ void _stlink_usb_close(stlink_t* sl) {
     struct stlink_libusb * const handle = sl->backend_data;
     // maybe we couldn't even get the usb device?
     if (handle != NULL) {
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+        if (handle->q_buf_dev_mem) {
+            libusb_dev_mem_free(handle->usb_handle, sl->q_buf, Q_BUF_LEN);
+            sl->q_buf = NULL;
+        }
+#endif
+        free(sl->q_buf);
+        sl->q_buf = NULL;
+
         if (handle->usb_handle != NULL) {
             libusb_close(handle->usb_handle);
         }
 
-        libusb_exit(handle->libusb_ctx);
+        stlink_usb_context_unref();
         free(handle);
     }
 }
@@ -728,6 +806,215 @@ sl->q_len = (int) size;
     return 0;
 }
 
+/*
+ * Command lists are queued on the endpoints in one go and only then waited
+ * for, instead of a round trip per command.  The v2 protocol has no status
+ * stage, so the replies simply come back in the order of the commands.
+ * v1 wraps every command in a SCSI status, it keeps going one at a time.
+ */
+#define STLINK_USB_PIPELINE_DEPTH 32
+
+struct stlink_usb_cmd {
+    unsigned char cmd[STLINK_CMD_SIZE];
+    unsigned int ep;        /* endpoint of the data stage */
+    unsigned char *data;
+    uint16_t len;
+};
+
+struct stlink_usb_pipeline {
+    int pending;
+    int completed;
+    int failed;
+};
+
+static void LIBUSB_CALL stlink_usb_pipeline_done(struct libusb_transfer *transfer) {
+    struct stlink_usb_pipeline *p = transfer->user_data;
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+        transfer->actual_length != transfer->length)
+        __atomic_store_n(&p->failed, 1, __ATOMIC_RELEASE);
+    if (__atomic_sub_fetch(&p->pending, 1, __ATOMIC_ACQ_REL) == 0)
+        __atomic_store_n(&p->completed, 1, __ATOMIC_RELEASE);
+}
+
+static int stlink_usb_pipeline_window(stlink_t *sl, struct stlink_usb_cmd *cmds, int count) {
+    struct stlink_libusb * const slu = sl->backend_data;
+    struct libusb_transfer *xfer[2 * STLINK_USB_PIPELINE_DEPTH];
+    struct stlink_usb_pipeline p;
+    int n = 0, submitted, cancelled = 0, i;
+
+    for (i = 0; i < count; i++) {
+        int stages = cmds[i].len ? 2 : 1;
+
+        while (stages--) {
+            xfer[n] = libusb_alloc_transfer(0);
+            if (xfer[n] == NULL) {
+                while (n-- > 0)
+                    libusb_free_transfer(xfer[n]);
+                return -1;
+            }
+            n++;
+        }
+    }
+
+    for (i = 0, n = 0; i < count; i++) {
+        libusb_fill_bulk_transfer(xfer[n++], slu->usb_handle, slu->ep_req, cmds[i].cmd,
+                                  (int) slu->cmd_len, stlink_usb_pipeline_done, &p, 3000);
+        if (cmds[i].len)
+            libusb_fill_bulk_transfer(xfer[n++], slu->usb_handle, cmds[i].ep, cmds[i].data,
+                                      cmds[i].len, stlink_usb_pipeline_done, &p, 3000);
+    }
+
+    /* callbacks may already run while the rest is being submitted */
+    p.pending = n;
+    p.completed = 0;
+    p.failed = 0;
+    for (submitted = 0; submitted < n; submitted++) {
+        int t = libusb_submit_transfer(xfer[submitted]);
+        if (t) {
+            printf("[!] pipelined transfer failed: %s\n", libusb_error_name(t));
+            p.failed = 1;
+            if (__atomic_sub_fetch(&p.pending, n - submitted, __ATOMIC_ACQ_REL) == 0)
+                p.completed = 1;
+            break;
+        }
+    }
+
+    while (!__atomic_load_n(&p.completed, __ATOMIC_ACQUIRE)) {
+        int t = libusb_handle_events_completed(slu->libusb_ctx, &p.completed);
+
+        if ((t < 0 && t != LIBUSB_ERROR_INTERRUPTED) ||
+            __atomic_load_n(&p.failed, __ATOMIC_ACQUIRE)) {
+            p.failed = 1;
+            if (!cancelled) {
+                for (i = 0; i < submitted; i++)
+                    libusb_cancel_transfer(xfer[i]);
+                cancelled = 1;
+            }
+        }
+    }
+
+    for (i = 0; i < n; i++)
+        libusb_free_transfer(xfer[i]);
+
+    return p.failed ? -1 : 0;
+}
+
+static int stlink_usb_pipeline_run(stlink_t *sl, struct stlink_usb_cmd *cmds, int count) {
+    for (int i = 0; i < count; i += STLINK_USB_PIPELINE_DEPTH) {
+        int n = count - i;
+        if (n > STLINK_USB_PIPELINE_DEPTH)
+            n = STLINK_USB_PIPELINE_DEPTH;
+        if (stlink_usb_pipeline_window(sl, cmds + i, n))
+            return -1;
+    }
+    return 0;
+}
+
+int _stlink_usb_mem_ops(stlink_t *sl, const struct stlink_mem_op *ops, int count) {
+    struct stlink_libusb * const slu = sl->backend_data;
+    struct stlink_usb_cmd *cmds;
+    int i, ret;
+
+    if (slu->protocoll != 1) {
+        cmds = calloc(count + 1, sizeof(*cmds));
+        if (cmds == NULL)
+            return -1;
+
+        for (i = 0; i < count; i++) {
+            unsigned char *cmd = cmds[i].cmd;
+
+            cmd[0] = STLINK_DEBUG_COMMAND;
+            cmds[i].ep = slu->ep_req;
+            switch (ops[i].type) {
+            case STLINK_MEM_READ32:
+                cmd[1] = STLINK_DEBUG_READMEM_32BIT;
+                cmds[i].ep = slu->ep_rep;
+                break;
+            case STLINK_MEM_WRITE32:
+                cmd[1] = STLINK_DEBUG_WRITEMEM_32BIT;
+                break;
+            default:
+                cmd[1] = STLINK_DEBUG_WRITEMEM_8BIT;
+                break;
+            }
+            write_uint32(&cmd[2], ops[i].addr);
+            write_uint16(&cmd[6], ops[i].len);
+            cmds[i].data = ops[i].data;
+            cmds[i].len = ops[i].len;
+        }
+
+        ret = stlink_usb_pipeline_run(sl, cmds, count);
+        free(cmds);
+        return ret;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (ops[i].type == STLINK_MEM_READ32) {
+            ret = _stlink_usb_read_mem32(sl, ops[i].addr, ops[i].len);
+            memcpy(ops[i].data, sl->q_buf, ops[i].len);
+        } else {
+            memcpy(sl->q_buf, ops[i].data, ops[i].len);
+            if (ops[i].type == STLINK_MEM_WRITE32)
+                ret = _stlink_usb_write_mem32(sl, ops[i].addr, ops[i].len);
+            else
+                ret = _stlink_usb_write_mem8(sl, ops[i].addr, ops[i].len);
+        }
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+int _stlink_usb_write_regs(stlink_t *sl, uint32_t mask, const uint32_t *regs, int run) {
+    struct stlink_libusb * const slu = sl->backend_data;
+    struct stlink_usb_cmd cmds[STLINK_REG_COUNT + 1];
+    unsigned char status[STLINK_REG_COUNT + 1][2];
+    int n = 0, i;
+
+    if (slu->protocoll == 1) {
+        for (i = 0; i < STLINK_REG_COUNT; i++) {
+            if ((mask & (1u << i)) && _stlink_usb_write_reg(sl, regs[i], i))
+                return -1;
+        }
+        return run ? _stlink_usb_run(sl) : 0;
+    }
+
+    memset(cmds, 0, sizeof(cmds));
+    for (i = 0; i < STLINK_REG_COUNT; i++) {
+        if (!(mask & (1u << i)))
+            continue;
+        cmds[n].cmd[0] = STLINK_DEBUG_COMMAND;
+        cmds[n].cmd[1] = STLINK_DEBUG_WRITEREG;
+        cmds[n].cmd[2] = (uint8_t) i;
+        write_uint32(&cmds[n].cmd[3], regs[i]);
+        n++;
+    }
+    if (run) {
+        cmds[n].cmd[0] = STLINK_DEBUG_COMMAND;
+        cmds[n].cmd[1] = STLINK_DEBUG_RUNCORE;
+        n++;
+    }
+    for (i = 0; i < n; i++) {
+        cmds[i].ep = slu->ep_rep;
+        cmds[i].data = status[i];
+        cmds[i].len = sizeof(status[i]);
+    }
+
+    if (stlink_usb_pipeline_run(sl, cmds, n))
+        return -1;
+
+    /* every WRITEREG and the RUNCORE report their own status */
+    for (i = 0; i < n; i++) {
+        if (status[i][0] != STLINK_DEBUG_ERR_OK) {
+            ELOG("%s failed: %#x\n", cmds[i].cmd[1] == STLINK_DEBUG_RUNCORE ? "RUNCORE" : "WRITEREG",
+                 status[i][0]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
 static stlink_backend_t _stlink_usb_backend = {
     _stlink_usb_close,
     _stlink_usb_exit_debug_mode,
@@ -755,7 +1042,9 @@ static stlink_backend_t _stlink_usb_backend = {
     _stlink_usb_current_mode,
     _stlink_usb_force_debug,
     _stlink_usb_target_voltage,
-    _stlink_usb_set_swdclk
+    _stlink_usb_set_swdclk,
+    _stlink_usb_mem_ops,
+    _stlink_usb_write_regs
 };
 
 stlink_t *stlink_open_usb(enum ugly_loglevel verbose, bool reset, char serial[16])
@@ -769,18 +1058,22 @@ stlink_t *stlink_open_usb(enum ugly_loglevel verbose, bool reset, char serial[16
     slu = calloc(1, sizeof (struct stlink_libusb));
     if (sl == NULL)
         goto on_malloc_error;
+    if (stlink_init_lock(sl)) {
+        free(sl);
+        sl = NULL;
+        goto on_malloc_error;
+    }
     if (slu == NULL)
         goto on_malloc_error;
 
-    ugly_init(verbose);
+    sl->verbose = verbose;
     sl->backend = &_stlink_usb_backend;
     sl->backend_data = slu;
 
     sl->core_stat = STLINK_CORE_STAT_UNKNOWN;
-    if (libusb_init(&(slu->libusb_ctx))) {
-        WLOG("failed to init libusb context, wrong version of libraries?\n");
+    slu->libusb_ctx = stlink_usb_context_ref();
+    if (slu->libusb_ctx == NULL)
         goto on_error;
-    }
 
     libusb_device **list;
     /** @todo We should use ssize_t and use it as a counter if > 0. As per libusb API: ssize_t libusb_get_device_list (libusb_context *ctx, libusb_device ***list) */
@@ -889,6 +1182,19 @@ stlink_t *stlink_open_usb(enum ugly_loglevel verbose, bool reset, char serial[16
         goto on_libusb_error;
     }
 
+    /* Memory the kernel can DMA from directly, where libusb supports it */
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+    sl->q_buf = libusb_dev_mem_alloc(slu->usb_handle, Q_BUF_LEN);
+    slu->q_buf_dev_mem = sl->q_buf != NULL;
+#endif
+    if (sl->q_buf == NULL)
+        sl->q_buf = malloc(Q_BUF_LEN);
+    if (sl->q_buf == NULL) {
+        WLOG("Couldn't allocate the transfer buffer\n");
+        ret = -1;
+        goto on_libusb_error;
+    }
+
     // TODO - could use the scanning techniq from stm8 code here...
     slu->ep_rep = 1 /* ep rep */ | LIBUSB_ENDPOINT_IN;
     if (desc.idProduct == STLINK_USB_PID_STLINK_NUCLEO) {
@@ -901,12 +1207,14 @@ stlink_t *stlink_open_usb(enum ugly_loglevel verbose, bool reset, char serial[16
     // TODO - never used at the moment, always CMD_SIZE
     slu->cmd_len = (slu->protocoll == 1)? STLINK_SG_SIZE: STLINK_CMD_SIZE;
 
-    if (stlink_current_mode(sl) == STLINK_DEV_DFU_MODE) {
+    int mode = stlink_current_mode(sl);
+    if (mode == STLINK_DEV_DFU_MODE) {
         ILOG("-- exit_dfu_mode\n");
         stlink_exit_dfu_mode(sl);
+        mode = stlink_current_mode(sl);
     }
 
-    if (stlink_current_mode(sl) != STLINK_DEV_DEBUG_MODE) {
+    if (mode != STLINK_DEV_DEBUG_MODE) {
         stlink_enter_swd_mode(sl);
     }
 	
@@ -921,8 +1229,9 @@ stlink_t *stlink_open_usb(enum ugly_loglevel verbose, bool reset, char serial[16
 
     ret = stlink_load_device_params(sl);
 
-    // Set the stlink clock speed (default is 1800kHz)
-    stlink_set_swdclk(sl, STLINK_SWDCLK_1P8MHZ_DIVISOR);    
+    // Set the stlink clock speed, the tuned one for this stlink if any (default is 1800kHz)
+    if (stlink_swdclk_restore(sl) != 0)
+        stlink_set_swdclk(sl, STLINK_SWDCLK_1P8MHZ_DIVISOR);
 
 on_libusb_error:
     if (ret == -1) {
@@ -934,118 +1243,190 @@ on_libusb_error:
 
 on_error:
     if (slu->libusb_ctx)
-        libusb_exit(slu->libusb_ctx);
+        stlink_usb_context_unref();
 
 on_malloc_error:
-    if (sl != NULL)
+    if (sl != NULL) {
+        pthread_mutex_destroy(&sl->lock);
         free(sl);
+    }
     if (slu != NULL)
         free(slu);
 
     return NULL;
 }
 
-static size_t stlink_probe_usb_devs(libusb_device **devs, stlink_t **sldevs[]) {
-    stlink_t **_sldevs;
+/* Ask an unclaimed programmer for its firmware version, the target is not touched */
+static int stlink_usb_query_version(libusb_device_handle *handle, uint16_t pid,
+                                    struct stlink_version_ *version) {
+    struct stlink_libusb slu;
+    unsigned char buf[64];
+    stlink_t *sl;
+    int ret;
+
+    if (libusb_claim_interface(handle, 0))
+        return -1;
+
+    sl = calloc(1, sizeof(stlink_t));
+    if (sl == NULL) {
+        libusb_release_interface(handle, 0);
+        return -1;
+    }
+
+    memset(&slu, 0, sizeof(slu));
+    slu.usb_handle = handle;
+    slu.ep_rep = 1 /* ep rep */ | LIBUSB_ENDPOINT_IN;
+    slu.ep_req = ((pid == STLINK_USB_PID_STLINK_NUCLEO) ? 1 : 2) | LIBUSB_ENDPOINT_OUT;
+    slu.cmd_len = STLINK_CMD_SIZE;
+    sl->backend = &_stlink_usb_backend;
+    sl->backend_data = &slu;
+    sl->q_buf = buf;
+
+    ret = stlink_init_lock(sl);
+    if (ret == 0) {
+        ret = stlink_version(sl);
+        if (ret == 0)
+            *version = sl->version;
+        pthread_mutex_destroy(&sl->lock);
+    }
+
+    free(sl);
+    libusb_release_interface(handle, 0);
+    return ret;
+}
+
+size_t stlink_enumerate_usb(struct stlink_usb_info **infos) {
+    libusb_context *ctx;
+    libusb_device **devs;
     libusb_device *dev;
-    int i = 0;
-    int ret = 0;
+    struct stlink_usb_info *list;
+    ssize_t cnt;
     size_t slcnt = 0;
-    size_t slcur = 0;
-
-    /* Count stlink */
-    while ((dev = devs[i++]) != NULL) {
-        struct libusb_device_descriptor desc;
-        int r = libusb_get_device_descriptor(dev, &desc);
-        if (r < 0) {
-            WLOG("failed to get libusb device descriptor\n");
-            break;
-        }
+    int i = 0;
 
-        if (desc.idProduct != STLINK_USB_PID_STLINK_32L &&
-            desc.idProduct != STLINK_USB_PID_STLINK_NUCLEO)
-            continue;
+    *infos = NULL;
+    ctx = stlink_usb_context_ref();
+    if (ctx == NULL)
+        return 0;
 
-        slcnt++;
+    cnt = libusb_get_device_list(ctx, &devs);
+    if (cnt <= 0) {
+        stlink_usb_context_unref();
+        return 0;
     }
 
-    /* Allocate list of pointers */
-    _sldevs = calloc(slcnt, sizeof(stlink_t *));
-    if (!_sldevs) {
-        *sldevs = NULL;
+    list = calloc(cnt, sizeof(struct stlink_usb_info));
+    if (list == NULL) {
+        libusb_free_device_list(devs, 1);
+        stlink_usb_context_unref();
         return 0;
     }
 
-    /* Open stlinks and attach to list */
-    i = 0;
     while ((dev = devs[i++]) != NULL) {
         struct libusb_device_descriptor desc;
-        ret = libusb_get_device_descriptor(dev, &desc);
-        if (ret < 0) {
+        struct libusb_device_handle *handle;
+        struct stlink_usb_info *info = &list[slcnt];
+
+        if (libusb_get_device_descriptor(dev, &desc) < 0) {
             WLOG("failed to get libusb device descriptor\n");
-            break;
+            continue;
         }
 
-        if (desc.idProduct != STLINK_USB_PID_STLINK_32L &&
-            desc.idProduct != STLINK_USB_PID_STLINK_NUCLEO)
+        if (desc.idVendor != STLINK_USB_VID_ST ||
+            (desc.idProduct != STLINK_USB_PID_STLINK_32L &&
+             desc.idProduct != STLINK_USB_PID_STLINK_NUCLEO))
             continue;
 
-        struct libusb_device_handle* handle;
-        char serial[13];
-        memset(serial, 0, sizeof(serial));
-
-        ret = libusb_open(dev, &handle);
-        if (ret < 0) {
-            WLOG("failed to get libusb device descriptor\n");
-            break;
-        }
-
-        ret = libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, (unsigned char *)&serial, sizeof(serial));
-        if (ret < 0)
-          *serial = 0;
+        info->pid = desc.idProduct;
+        info->bus = libusb_get_bus_number(dev);
+        info->addr = libusb_get_device_address(dev);
 
-        libusb_close(handle);
+        if (libusb_open(dev, &handle) == 0) {
+            info->serial_size = libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber,
+                    (unsigned char *)info->serial, sizeof(info->serial));
+            if (info->serial_size < 0)
+                info->serial_size = 0;
 
-        stlink_t *sl = NULL;
-        sl = stlink_open_usb(0, 1, serial);
-        if (!sl)
-            continue;
+            /* busy when another tool has the programmer open */
+            info->busy = stlink_usb_query_version(handle, desc.idProduct, &info->version) != 0;
+            libusb_close(handle);
+        } else {
+            info->busy = 1;
+        }
 
-        _sldevs[slcur] = sl;
-        slcur++;
+        slcnt++;
     }
 
-    /* Something went wrong */
-    if (ret < 0) {
-        free(_sldevs);
-        *sldevs = NULL;
-        return 0;
+    libusb_free_device_list(devs, 1);
+    stlink_usb_context_unref();
+
+    if (slcnt == 0) {
+        free(list);
+        list = NULL;
     }
 
-    *sldevs = _sldevs;
+    *infos = list;
     return slcnt;
 }
 
+struct stlink_probe_job {
+    pthread_t thread;
+    char serial[16];
+    stlink_t *sl;
+};
+
+static void *stlink_probe_usb_worker(void *arg) {
+    struct stlink_probe_job *job = arg;
+
+    /* never reset here, the targets may be running */
+    job->sl = stlink_open_usb(0, 0, job->serial);
+    return NULL;
+}
+
 size_t stlink_probe_usb(stlink_t **stdevs[]) {
-    libusb_device **devs;
+    struct stlink_usb_info *infos;
+    struct stlink_probe_job *jobs;
     stlink_t **sldevs;
+    size_t cnt, slcnt = 0;
+    size_t n;
 
-    size_t slcnt = 0;
-    int r;
-    ssize_t cnt;
-
-    r = libusb_init(NULL);
-    if (r < 0)
+    *stdevs = NULL;
+    cnt = stlink_enumerate_usb(&infos);
+    if (cnt == 0)
         return 0;
 
-    cnt = libusb_get_device_list(NULL, &devs);
-    if (cnt < 0)
+    jobs = calloc(cnt, sizeof(struct stlink_probe_job));
+    sldevs = calloc(cnt, sizeof(stlink_t *));
+    if (jobs == NULL || sldevs == NULL) {
+        free(jobs);
+        free(sldevs);
+        free(infos);
         return 0;
+    }
 
-    slcnt = stlink_probe_usb_devs(devs, &sldevs);
-    libusb_free_device_list(devs, 1);
+    /* Connect to all programmers at once; they share the refcounted libusb context */
+    for (n = 0; n < cnt; n++) {
+        memcpy(jobs[n].serial, infos[n].serial, sizeof(jobs[n].serial));
+        if (infos[n].busy ||
+            pthread_create(&jobs[n].thread, NULL, stlink_probe_usb_worker, &jobs[n]) != 0)
+            infos[n].busy = 1;
+    }
+
+    for (n = 0; n < cnt; n++) {
+        if (infos[n].busy)
+            continue;
+        pthread_join(jobs[n].thread, NULL);
+        if (jobs[n].sl != NULL)
+            sldevs[slcnt++] = jobs[n].sl;
+    }
+
+    free(jobs);
+    free(infos);
 
-    libusb_exit(NULL);
+    if (slcnt == 0) {
+        free(sldevs);
+        return 0;
+    }
 
     *stdevs = sldevs;
     return slcnt;
@@ -53,6 +53,13 @@ static bool execute_test(const struct Test * test) {
         ret &= (opts.reset == test->opts.reset);
         ret &= (opts.log_level == test->opts.log_level);
         ret &= (opts.format == test->opts.format);
+        ret &= (opts.gang_all == test->opts.gang_all);
+        ret &= (opts.gang_count == test->opts.gang_count);
+        ret &= (opts.tune_swdclk == test->opts.tune_swdclk);
+        ret &= cmp_mem(opts.gang_serials[0], test->opts.gang_serials[0],
+                       sizeof(opts.gang_serials[0]) * opts.gang_count);
+        ret &= cmp_mem((const uint8_t *)opts.gang_serial_sizes, (const uint8_t *)test->opts.gang_serial_sizes,
+                       sizeof(opts.gang_serial_sizes[0]) * opts.gang_count);
     }
 
     printf("[%s] (%d) %s\n", ret ? "OK" : "ERROR", res, test->cmd_line);
@@ -92,6 +99,22 @@ static struct Test tests[] = {
     { "--serial=A1020304 erase", 0,
         { .cmd = FLASH_CMD_ERASE, .devname = NULL, .serial = "\0\0\0\0\0\0\0\0\xA1\x02\x03\x04", .filename = NULL,
           .addr = 0, .size = 0, .reset = 0, .log_level = STND_LOG_LEVEL, .format = FLASH_FORMAT_BINARY } },
+    { "--gang all erase", 0,
+        { .cmd = FLASH_CMD_ERASE, .devname = NULL, .serial = {}, .filename = NULL,
+          .addr = 0, .size = 0, .reset = 0, .log_level = STND_LOG_LEVEL, .format = FLASH_FORMAT_BINARY,
+          .gang_all = 1 } },
+    { "--gang=A102,3031 --reset write test.bin 0x8000000", 0,
+        { .cmd = FLASH_CMD_WRITE, .devname = NULL, .serial = {}, .filename = "test.bin",
+          .addr = 0x8000000, .size = 0, .reset = 1, .log_level = STND_LOG_LEVEL, .format = FLASH_FORMAT_BINARY,
+          .gang_count = 2, .gang_serials = { "\xA1\x02", "\x30\x31" },
+          .gang_serial_sizes = { 2, 2 } } },
+    { "--gang all read test.bin 0x8000000 0x1000", -1, FLASH_OPTS_INITIALIZER },
+    { "--gang all --serial A102 erase", -1, FLASH_OPTS_INITIALIZER },
+    { "--gang A10,3031 erase", -1, FLASH_OPTS_INITIALIZER },
+    { "--tune-swdclk --reset write test.bin 0x8000000", 0,
+        { .cmd = FLASH_CMD_WRITE, .devname = NULL, .serial = {}, .filename = "test.bin",
+          .addr = 0x8000000, .size = 0, .reset = 1, .log_level = STND_LOG_LEVEL, .format = FLASH_FORMAT_BINARY,
+          .tune_swdclk = 1 } },
 };
 
 int main()
@@ -0,0 +1,333 @@
+/*
+ * Scatter/gather memory and batched register access, and flash loader
+ * residency, against a fake target in memory.  Checks the data and how many
+ * adapter transfers they take.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <stlink.h>
+
+#define MEM_SIZE    0x4000
+
+struct mock_target {
+    uint8_t mem[MEM_SIZE];
+    int mem32;
+    int mem8;
+    int batches;
+    int bad;        /* misaligned mem32 or oversized mem8 */
+    uint32_t regs[STLINK_REG_COUNT];
+    int reg_calls;
+    int running;
+};
+
+static struct mock_target *target(stlink_t *sl) {
+    return sl->backend_data;
+}
+
+static void mock_close(stlink_t *sl) {
+    free(sl->q_buf);
+    free(sl->backend_data);
+}
+
+static int mock_read_mem32(stlink_t *sl, uint32_t addr, uint16_t len) {
+    struct mock_target *t = target(sl);
+    t->mem32++;
+    if ((addr | len) & 3 || addr + len > MEM_SIZE)
+        t->bad++;
+    else
+        memcpy(sl->q_buf, t->mem + addr, len);
+    return 0;
+}
+
+static int mock_write_mem32(stlink_t *sl, uint32_t addr, uint16_t len) {
+    struct mock_target *t = target(sl);
+    t->mem32++;
+    if ((addr | len) & 3 || addr + len > MEM_SIZE)
+        t->bad++;
+    else
+        memcpy(t->mem + addr, sl->q_buf, len);
+    return 0;
+}
+
+static int mock_write_mem8(stlink_t *sl, uint32_t addr, uint16_t len) {
+    struct mock_target *t = target(sl);
+    t->mem8++;
+    if (len > 0x40 || addr + len > MEM_SIZE)
+        t->bad++;
+    else
+        memcpy(t->mem + addr, sl->q_buf, len);
+    return 0;
+}
+
+static int mock_mem_ops(stlink_t *sl, const struct stlink_mem_op *ops, int count) {
+    target(sl)->batches++;
+    for (int i = 0; i < count; i++) {
+        if (ops[i].type == STLINK_MEM_READ32) {
+            mock_read_mem32(sl, ops[i].addr, ops[i].len);
+            memcpy(ops[i].data, sl->q_buf, ops[i].len);
+        } else {
+            memcpy(sl->q_buf, ops[i].data, ops[i].len);
+            if (ops[i].type == STLINK_MEM_WRITE32)
+                mock_write_mem32(sl, ops[i].addr, ops[i].len);
+            else
+                mock_write_mem8(sl, ops[i].addr, ops[i].len);
+        }
+    }
+    return 0;
+}
+
+static int mock_write_reg(stlink_t *sl, uint32_t reg, int idx) {
+    target(sl)->regs[idx] = reg;
+    target(sl)->reg_calls++;
+    return 0;
+}
+
+static int mock_run(stlink_t *sl) {
+    target(sl)->running = 1;
+    target(sl)->reg_calls++;
+    return 0;
+}
+
+static int mock_reset(stlink_t *sl) {
+    (void) sl;
+    return 0;
+}
+
+static int mock_read_reg(stlink_t *sl, int idx, struct stlink_reg *regp) {
+    target(sl)->reg_calls++;
+    if (idx == 17)
+        regp->main_sp = target(sl)->regs[idx];
+    else
+        regp->r[idx] = target(sl)->regs[idx];
+    return 0;
+}
+
+static int mock_read_all_regs(stlink_t *sl, struct stlink_reg *regp) {
+    struct mock_target *t = target(sl);
+    t->reg_calls++;
+    memcpy(regp->r, t->regs, sizeof(regp->r));
+    regp->xpsr = t->regs[16];
+    regp->main_sp = t->regs[17];
+    regp->process_sp = t->regs[18];
+    return 0;
+}
+
+static int mock_write_regs(stlink_t *sl, uint32_t mask, const uint32_t *regs, int run) {
+    struct mock_target *t = target(sl);
+    t->batches++;
+    for (int i = 0; i < STLINK_REG_COUNT; i++) {
+        if (mask & (1u << i))
+            t->regs[i] = regs[i];
+    }
+    t->running = run;
+    return 0;
+}
+
+static stlink_backend_t mock_backend = {
+    .close = mock_close,
+    .read_mem32 = mock_read_mem32,
+    .write_mem32 = mock_write_mem32,
+    .write_mem8 = mock_write_mem8,
+    .write_reg = mock_write_reg,
+    .run = mock_run,
+    .reset = mock_reset,
+    .read_reg = mock_read_reg,
+    .read_all_regs = mock_read_all_regs,
+};
+
+static stlink_backend_t mock_batch_backend = {
+    .close = mock_close,
+    .read_mem32 = mock_read_mem32,
+    .write_mem32 = mock_write_mem32,
+    .write_mem8 = mock_write_mem8,
+    .write_reg = mock_write_reg,
+    .run = mock_run,
+    .read_reg = mock_read_reg,
+    .read_all_regs = mock_read_all_regs,
+    .mem_ops = mock_mem_ops,
+    .write_regs = mock_write_regs,
+};
+
+static stlink_t *mock_open(stlink_backend_t *backend) {
+    stlink_t *sl = calloc(1, sizeof(stlink_t));
+    struct mock_target *t = calloc(1, sizeof(struct mock_target));
+
+    for (int i = 0; i < MEM_SIZE; i++)
+        t->mem[i] = (uint8_t) (i * 7);
+
+    sl->q_buf = malloc(Q_BUF_LEN);
+    sl->backend = backend;
+    sl->backend_data = t;
+    stlink_init_lock(sl);
+    return sl;
+}
+
+static void reset_counts(stlink_t *sl) {
+    target(sl)->mem32 = target(sl)->mem8 = target(sl)->batches = 0;
+}
+
+static bool report(bool ok, const char *what, stlink_t *sl) {
+    struct mock_target *t = target(sl);
+    printf("[%s] %s: %d mem32, %d mem8, %d batches\n",
+           (ok && !t->bad) ? "OK" : "ERROR", what, t->mem32, t->mem8, t->batches);
+    return ok && !t->bad;
+}
+
+static bool check_read(stlink_backend_t *backend) {
+    stlink_t *sl = mock_open(backend);
+    uint8_t a[5], b[9], c[3], d[0x2000];
+    /* out of order, overlapping and touching segments */
+    struct stlink_mem_seg segs[] = {
+        { 0x103, b, sizeof(b) },
+        { 0x101, a, sizeof(a) },
+        { 0x10c, c, sizeof(c) },
+        { 0x1001, d, sizeof(d) },
+    };
+    bool ok;
+
+    reset_counts(sl);
+    ok = stlink_read_memv(sl, segs, 4) == 0;
+    for (size_t n = 0; n < STLINK_ARRAY_SIZE(segs); n++) {
+        const uint8_t *buf = segs[n].buf;
+        for (size_t i = 0; i < segs[n].len; i++)
+            ok &= buf[i] == (uint8_t) ((segs[n].addr + i) * 7);
+    }
+    /* 0x100..0x110 in one go, 0x1000..0x3004 in two blocks */
+    ok &= target(sl)->mem32 == 3;
+
+    ok = report(ok, "read_memv", sl);
+    stlink_close(sl);
+    return ok;
+}
+
+static bool check_write(stlink_backend_t *backend) {
+    stlink_t *sl = mock_open(backend);
+    uint8_t expect[MEM_SIZE];
+    uint8_t a[6], b[10], c[0x81], d[3];
+    struct stlink_mem_seg segs[] = {
+        { 0x201, a, sizeof(a) },    /* a and b touch, one unaligned run < 64 bytes */
+        { 0x207, b, sizeof(b) },
+        { 0x402, c, sizeof(c) },    /* mem8 head, mem32 body, mem8 tail */
+        { 0x800, d, sizeof(d) },
+    };
+    bool ok;
+
+    memcpy(expect, target(sl)->mem, MEM_SIZE);
+    for (size_t n = 0; n < STLINK_ARRAY_SIZE(segs); n++) {
+        for (size_t i = 0; i < segs[n].len; i++) {
+            ((uint8_t *) segs[n].buf)[i] = (uint8_t) (0xa5 ^ i ^ n);
+            expect[segs[n].addr + i] = (uint8_t) (0xa5 ^ i ^ n);
+        }
+    }
+
+    reset_counts(sl);
+    ok = stlink_write_memv(sl, segs, 4) == 0;
+    ok &= memcmp(expect, target(sl)->mem, MEM_SIZE) == 0;
+    ok &= target(sl)->mem32 == 1 && target(sl)->mem8 == 4;
+
+    ok = report(ok, "write_memv", sl);
+    stlink_close(sl);
+    return ok;
+}
+
+/* single byte and odd length accesses leave their neighbours alone */
+static bool check_unaligned(stlink_backend_t *backend) {
+    stlink_t *sl = mock_open(backend);
+    uint8_t before[MEM_SIZE], buf[7] = { 1, 2, 3, 4, 5, 6, 7 }, back[7];
+    bool ok;
+
+    memcpy(before, target(sl)->mem, MEM_SIZE);
+    ok = stlink_write_mem(sl, 0x303, buf, sizeof(buf)) == 0;
+    ok &= stlink_write_mem(sl, 0x311, buf, 1) == 0;
+    ok &= memcmp(target(sl)->mem, before, 0x303) == 0;
+    ok &= memcmp(target(sl)->mem + 0x30a, before + 0x30a, 0x311 - 0x30a) == 0;
+    ok &= memcmp(target(sl)->mem + 0x312, before + 0x312, MEM_SIZE - 0x312) == 0;
+
+    ok &= stlink_read_mem(sl, 0x303, back, sizeof(back)) == 0;
+    ok &= memcmp(back, buf, sizeof(buf)) == 0;
+    ok &= stlink_read_mem(sl, 0x311, back, 1) == 0 && back[0] == 1;
+
+    ok = report(ok, "unaligned read_mem/write_mem", sl);
+    stlink_close(sl);
+    return ok;
+}
+
+static bool check_regs(stlink_backend_t *backend, int expect_calls) {
+    stlink_t *sl = mock_open(backend);
+    uint32_t regs[STLINK_REG_COUNT] = { 0 }, back[STLINK_REG_COUNT] = { 0 };
+    bool ok;
+
+    regs[0] = 0x20000100;
+    regs[1] = 0x08001000;
+    regs[2] = 64;
+    regs[15] = 0x20000000;
+    regs[17] = 0x20001000;
+
+    ok = stlink_write_regs_run(sl, 0x2800f, regs) == 0;
+    ok &= target(sl)->running && target(sl)->reg_calls == expect_calls;
+    ok &= memcmp(target(sl)->regs, regs, sizeof(regs)) == 0;
+
+    target(sl)->reg_calls = 0;
+    ok &= stlink_read_regs(sl, 1u << 2, back) == 0 && back[2] == 64;
+    ok &= stlink_read_regs(sl, 0x28003, back) == 0 && target(sl)->reg_calls == 2;
+    ok &= memcmp(back, regs, sizeof(regs)) == 0;
+
+    ok = report(ok, "write_regs_run/read_regs", sl);
+    stlink_close(sl);
+    return ok;
+}
+
+static bool check_loader(stlink_backend_t *backend) {
+    stlink_t *sl = mock_open(backend);
+    flash_loader_t fl;
+    uint8_t junk[4] = { 0xde, 0xad, 0xbe, 0xef };
+    int uploads[4];
+    bool ok = true;
+
+    sl->chip_id = STLINK_CHIPID_STM32_F0;
+    sl->sram_base = 0x1000;
+    sl->sram_size = 0x1000;
+
+    /* upload, reuse, check after the core ran, upload after it was overwritten */
+    for (int n = 0; n < 4; n++) {
+        reset_counts(sl);
+        if (n == 2)
+            stlink_run(sl);
+        if (n == 3)
+            stlink_write_mem(sl, sl->sram_base + 8, junk, sizeof(junk));
+        reset_counts(sl);
+        ok &= stlink_flash_loader_init(sl, &fl) == 0;
+        ok &= fl.loader_addr == sl->sram_base && fl.buf_addr > fl.loader_addr;
+        uploads[n] = target(sl)->mem32;
+    }
+    ok &= uploads[0] == 1 && uploads[1] == 0 && uploads[2] == 1 && uploads[3] == 2;
+
+    /* a reset forgets it without looking */
+    stlink_reset(sl);
+    reset_counts(sl);
+    ok &= stlink_flash_loader_init(sl, &fl) == 0 && target(sl)->mem32 == 1;
+
+    ok = report(ok, "resident flash loader", sl);
+    stlink_close(sl);
+    return ok;
+}
+
+int main(void)
+{
+    bool ok = true;
+
+    ugly_init(UERROR);
+
+    ok &= check_read(&mock_backend);
+    ok &= check_write(&mock_backend);
+    ok &= check_read(&mock_batch_backend);
+    ok &= check_write(&mock_batch_backend);
+    ok &= check_unaligned(&mock_backend);
+    ok &= check_regs(&mock_backend, 7);
+    ok &= check_regs(&mock_batch_backend, 0);
+    ok &= check_loader(&mock_backend);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,245 @@
+/*
+ * Hex and checksum kernels of the GDB remote protocol layer against the
+ * obvious printf/scanf versions, binary escaping, and packet reception
+ * through a pipe.  "rsp --bench" also times the kernels.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <gdb-remote.h>
+
+#define BENCH_LEN   0x8000
+#define BENCH_MB    16
+
+static void ref_encode(const uint8_t *in, unsigned len, char *out) {
+    for (unsigned i = 0; i < len; i++)
+        sprintf(&out[2 * i], "%02x", in[i]);
+}
+
+static void ref_decode(const char *in, unsigned len, uint8_t *out) {
+    for (unsigned i = 0; i < len; i++) {
+        unsigned v;
+        sscanf(&in[2 * i], "%02x", &v);
+        out[i] = (uint8_t) v;
+    }
+}
+
+static uint8_t ref_checksum(const char *data, unsigned len) {
+    uint8_t sum = 0;
+    for (unsigned i = 0; i < len; i++)
+        sum += (uint8_t) data[i];
+    return sum;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static bool check_hex(void) {
+    uint8_t bytes[256], back[256];
+    char text[513], ref[513];
+    bool ok = true;
+
+    for (int i = 0; i < 256; i++)
+        bytes[i] = (uint8_t) i;
+
+    text[gdb_hex_encode(bytes, 256, text)] = '\0';
+    ref_encode(bytes, 256, ref);
+    ok &= strcmp(text, ref) == 0;
+    ok &= gdb_hex_decode(text, 256, back) == 256 && memcmp(back, bytes, 256) == 0;
+
+    ok &= gdb_hex_decode("DEADbeef", 4, back) == 4 &&
+          back[0] == 0xde && back[1] == 0xad && back[2] == 0xbe && back[3] == 0xef;
+    ok &= gdb_hex_decode("12g4", 2, back) == 1 && back[0] == 0x12;
+    ok &= gdb_hex_decode("123", 2, back) == 1;
+    ok &= gdb_hex_decode("", 2, back) == 0;
+
+    for (unsigned len = 0; len < 1000; len += 7) {
+        char data[1000];
+        for (unsigned i = 0; i < len; i++)
+            data[i] = (char) (rand() & 0xff);
+        ok &= gdb_checksum(data, len) == ref_checksum(data, len);
+    }
+
+    printf("[%s] hex encode/decode and checksum\n", ok ? "OK" : "ERROR");
+    return ok;
+}
+
+static bool check_escape(void) {
+    uint8_t bytes[512];
+    char text[2 * sizeof(bytes)];
+    unsigned len;
+    bool ok = true;
+
+    /* every byte value, then the four special ones back to back */
+    for (int i = 0; i < 256; i++)
+        bytes[i] = (uint8_t) i;
+    for (int i = 256; i < 512; i++)
+        bytes[i] = (uint8_t) "#$}*"[i & 3];
+
+    len = gdb_escape_binary(bytes, sizeof(bytes), text);
+    ok &= len == sizeof(bytes) + 4 + 256;
+    ok &= memchr(text, '#', len) == NULL && memchr(text, '$', len) == NULL &&
+          memchr(text, '*', len) == NULL;
+    ok &= gdb_unescape_binary(text, len) == sizeof(bytes) && memcmp(text, bytes, sizeof(bytes)) == 0;
+
+    ok &= gdb_escape_binary(bytes, 0, text) == 0;
+
+    /* a trailing '}' has nothing to escape and stays as it is */
+    memcpy(text, "a}", 2);
+    ok &= gdb_unescape_binary(text, 2) == 2 && text[1] == '}';
+
+    printf("[%s] binary escaping\n", ok ? "OK" : "ERROR");
+    return ok;
+}
+
+/* One packet as GDB would send it, with a wrong checksum first if asked */
+static bool recv_one(const char *payload, bool corrupt) {
+    int in[2], out[2];
+    struct gdb_conn conn;
+    unsigned len = (unsigned) strlen(payload);
+    char trailer[4], *packet = NULL, acks[2] = {0};
+    bool ok;
+
+    if (pipe(in) || pipe(out))
+        return false;
+
+    uint8_t sum = gdb_checksum(payload, len);
+    if (corrupt) {
+        snprintf(trailer, sizeof(trailer), "#%02x", (uint8_t) (sum + 1));
+        if (write(in[1], "$", 1) != 1 || write(in[1], payload, len) != (ssize_t) len ||
+            write(in[1], trailer, 3) != 3)
+            return false;
+    }
+    snprintf(trailer, sizeof(trailer), "#%02X", sum);
+    if (write(in[1], "+$", 2) != 2 || write(in[1], payload, len) != (ssize_t) len ||
+        write(in[1], trailer, 3) != 3)
+        return false;
+    close(in[1]);
+
+    gdb_conn_init(&conn, in[0]);
+    conn.out_fd = out[1];
+    ok = gdb_recv_packet(&conn, &packet) == (int) len && strcmp(packet, payload) == 0;
+    ok &= read(out[0], acks, corrupt ? 2 : 1) == (corrupt ? 2 : 1);
+    ok &= corrupt ? (acks[0] == '-' && acks[1] == '+') : acks[0] == '+';
+
+    gdb_conn_free(&conn);
+    close(in[0]);
+    close(out[0]);
+    close(out[1]);
+    return ok;
+}
+
+static bool check_recv(void) {
+    /* longer than the input buffer, so it arrives in several reads */
+    unsigned len = 3 * GDB_CONN_BUF + 17;
+    char *big = malloc(len + 1);
+    bool ok = true;
+
+    for (unsigned i = 0; i < len; i++)
+        big[i] = "0123456789abcdef"[i & 0xf];
+    big[len] = '\0';
+
+    ok &= recv_one("?", false);
+    ok &= recv_one("m8000000,4", true);
+    ok &= recv_one(big, false);
+    ok &= recv_one(big, true);
+    free(big);
+
+    printf("[%s] packet reception\n", ok ? "OK" : "ERROR");
+    return ok;
+}
+
+/* A packet that trickles in on a non-blocking pipe, then a resend on '-' */
+static bool check_partial(void) {
+    int in[2], out[2];
+    struct gdb_conn conn;
+    char *packet = NULL, buf[16] = {0};
+    bool ok = true;
+
+    if (pipe(in) || pipe(out))
+        return false;
+
+    gdb_conn_init(&conn, in[0]);
+    conn.out_fd = out[1];
+    gdb_conn_nonblock(&conn);
+
+    ok &= gdb_recv_packet(&conn, &packet) == GDB_AGAIN;
+    ok &= write(in[1], "$qSupp", 6) == 6;
+    ok &= gdb_recv_packet(&conn, &packet) == GDB_AGAIN;
+    ok &= write(in[1], "orted#3", 7) == 7;
+    ok &= gdb_recv_packet(&conn, &packet) == GDB_AGAIN;
+    ok &= write(in[1], "7", 1) == 1;
+    ok &= gdb_recv_packet(&conn, &packet) == 10 && strcmp(packet, "qSupported") == 0;
+    ok &= read(out[0], buf, 1) == 1 && buf[0] == '+';
+
+    /* the reply goes out right away, the ack is taken with the next packet */
+    ok &= gdb_send_packet(&conn, "OK") == 0 && conn.ack_pending;
+    ok &= read(out[0], buf, 6) == 6 && memcmp(buf, "$OK#9a", 6) == 0;
+    ok &= write(in[1], "-", 1) == 1;
+    ok &= gdb_recv_packet(&conn, &packet) == GDB_AGAIN;
+    ok &= read(out[0], buf, 6) == 6 && memcmp(buf, "$OK#9a", 6) == 0;
+    ok &= write(in[1], "+$?#3f", 6) == 6;
+    ok &= gdb_recv_packet(&conn, &packet) == 1 && !conn.ack_pending;
+
+    gdb_conn_free(&conn);
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+
+    printf("[%s] partial packets and acks\n", ok ? "OK" : "ERROR");
+    return ok;
+}
+
+static void bench(void) {
+    static uint8_t bytes[BENCH_LEN];
+    static char text[2 * BENCH_LEN + 1];
+    unsigned rounds = BENCH_MB * 1024 * 1024 / BENCH_LEN;
+    unsigned sink = 0;
+    double t0, t1, t2, t3, t4;
+
+    for (unsigned i = 0; i < BENCH_LEN; i++)
+        bytes[i] = (uint8_t) rand();
+    gdb_hex_encode(bytes, BENCH_LEN, text);
+
+    t0 = now();
+    for (unsigned r = 0; r < rounds; r++)
+        sink += gdb_hex_encode(bytes, BENCH_LEN, text);
+    t1 = now();
+    for (unsigned r = 0; r < rounds; r++)
+        sink += gdb_hex_decode(text, BENCH_LEN, bytes);
+    t2 = now();
+    for (unsigned r = 0; r < rounds; r++)
+        sink += gdb_checksum(text, 2 * BENCH_LEN);
+    t3 = now();
+    /* the old per byte sscanf, on a sixteenth of the data */
+    for (unsigned r = 0; r < rounds / 16; r++)
+        ref_decode(text, BENCH_LEN, bytes);
+    t4 = now();
+
+    printf("encode %.0f MB/s, decode %.0f MB/s (sscanf %.0f MB/s), checksum %.0f MB/s [%u]\n",
+           BENCH_MB / (t1 - t0), BENCH_MB / (t2 - t1), BENCH_MB / 16 / (t4 - t3),
+           2 * BENCH_MB / (t3 - t2), sink & 1);
+}
+
+int main(int argc, char** argv)
+{
+    bool ok = true;
+
+    ok &= check_hex();
+    ok &= check_escape();
+    ok &= check_recv();
+    ok &= check_partial();
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+        bench();
+
+    return ok ? 0 : 1;
+}
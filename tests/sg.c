@@ -10,7 +10,7 @@
 #include <stlink.h>
 
 static void __attribute__((unused)) mark_buf(stlink_t *sl) {
-    memset(sl->q_buf, 0, sizeof(sl->q_buf));
+    memset(sl->q_buf, 0, Q_BUF_LEN);
     sl->q_buf[0] = 0xaa;
     sl->q_buf[1] = 0xbb;
     sl->q_buf[2] = 0xcc;
@@ -39,6 +39,7 @@ int main(void)
                 "modprobe -r usb-storage && modprobe usb-storage quirks=483:3744:i\n\n",
                 stderr);
 
+    ugly_init(99);
     stlink_t *sl = stlink_v1_open(99, 1);
     if (sl == NULL)
         return 0;
@@ -84,7 +85,7 @@ int main(void)
     write_uint32(sl->q_buf, 0x44444411);
     stlink_write_mem32(sl, GPIOC_CRH, 4);
 
-    memset(sl->q_buf, 0, sizeof(sl->q_buf));
+    memset(sl->q_buf, 0, Q_BUF_LEN);
     for (int i = 0; i < 100; i++) {
         write_uint32(sl->q_buf, LED_BLUE | LED_GREEN);
         stlink_write_mem32(sl, GPIOC_ODR, 4);
@@ -92,7 +93,7 @@ int main(void)
         /* DD(sl, "GPIOC_ODR = 0x%08x", read_uint32(sl->q_buf, 0)); */
         usleep(100 * 1000);
 
-        memset(sl->q_buf, 0, sizeof(sl->q_buf));
+        memset(sl->q_buf, 0, Q_BUF_LEN);
         stlink_write_mem32(sl, GPIOC_ODR, 4); // PC lo
         usleep(100 * 1000);
     }
@@ -118,7 +119,7 @@ int main(void)
 #if 0
     // sram 0x20000000 8kB
     fputs("\n++++++++++ read/write 8bit, sram at 0x2000 0000 ++++++++++++++++\n\n", stderr);
-    memset(sl->q_buf, 0, sizeof(sl->q_buf));
+    memset(sl->q_buf, 0, Q_BUF_LEN);
     mark_buf(sl);
     //stlink_write_mem8(sl, 0x20000000, 16);
 
@@ -130,7 +131,7 @@ int main(void)
 #if 0
     // a not aligned mem32 access doesn't work indeed
     fputs("\n++++++++++ read/write 32bit, sram at 0x2000 0000 ++++++++++++++++\n\n", stderr);
-    memset(sl->q_buf, 0, sizeof(sl->q_buf));
+    memset(sl->q_buf, 0, Q_BUF_LEN);
     mark_buf(sl);
     stlink_write_mem32(sl, 0x20000000, 1);
     stlink_read_mem32(sl, 0x20000000, 16);
@@ -148,7 +149,7 @@ int main(void)
 #if 0
     // sram 0x20000000 8kB
     fputs("++++++++++ read/write 32bit, sram at 0x2000 0000 ++++++++++++\n", stderr);
-    memset(sl->q_buf, 0, sizeof(sl->q_buf));
+    memset(sl->q_buf, 0, Q_BUF_LEN);
     mark_buf(sl);
     stlink_write_mem8(sl, 0x20000000, 64);
     stlink_read_mem32(sl, 0x20000000, 64);
@@ -0,0 +1,201 @@
+/*
+ * Hammer stlink handles from several threads.  The backend is a fake target
+ * in memory that counts every time two threads are inside it at once.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <stlink.h>
+
+#define THREADS     8
+#define HANDLES     4
+#define ROUNDS      2000
+#define BLOCK       256
+
+struct mock_target {
+    uint8_t mem[THREADS * BLOCK];
+    uint32_t words[THREADS];
+    int inside;
+    int overlaps;
+};
+
+static void mock_enter(stlink_t *sl) {
+    struct mock_target *t = sl->backend_data;
+    if (__atomic_exchange_n(&t->inside, 1, __ATOMIC_ACQUIRE))
+        __atomic_add_fetch(&t->overlaps, 1, __ATOMIC_RELAXED);
+}
+
+static void mock_leave(stlink_t *sl) {
+    struct mock_target *t = sl->backend_data;
+    __atomic_store_n(&t->inside, 0, __ATOMIC_RELEASE);
+}
+
+static void mock_close(stlink_t *sl) {
+    free(sl->q_buf);
+    free(sl->backend_data);
+}
+
+static int mock_status(stlink_t *sl) {
+    mock_enter(sl);
+    sl->q_buf[0] = STLINK_CORE_HALTED;
+    mock_leave(sl);
+    return 0;
+}
+
+static int mock_read_mem32(stlink_t *sl, uint32_t addr, uint16_t len) {
+    struct mock_target *t = sl->backend_data;
+    mock_enter(sl);
+    memcpy(sl->q_buf, t->mem + addr, len);
+    mock_leave(sl);
+    return 0;
+}
+
+static int mock_write_mem32(stlink_t *sl, uint32_t addr, uint16_t len) {
+    struct mock_target *t = sl->backend_data;
+    mock_enter(sl);
+    memcpy(t->mem + addr, sl->q_buf, len);
+    mock_leave(sl);
+    return 0;
+}
+
+static int mock_read_debug32(stlink_t *sl, uint32_t addr, uint32_t *data) {
+    struct mock_target *t = sl->backend_data;
+    mock_enter(sl);
+    *data = t->words[addr];
+    mock_leave(sl);
+    return 0;
+}
+
+static int mock_write_debug32(stlink_t *sl, uint32_t addr, uint32_t data) {
+    struct mock_target *t = sl->backend_data;
+    mock_enter(sl);
+    t->words[addr] = data;
+    mock_leave(sl);
+    return 0;
+}
+
+static stlink_backend_t mock_backend = {
+    .close = mock_close,
+    .status = mock_status,
+    .read_mem32 = mock_read_mem32,
+    .write_mem32 = mock_write_mem32,
+    .read_debug32 = mock_read_debug32,
+    .write_debug32 = mock_write_debug32,
+};
+
+static stlink_t *mock_open(void) {
+    stlink_t *sl = calloc(1, sizeof(stlink_t));
+
+    sl->q_buf = malloc(Q_BUF_LEN);
+    sl->backend = &mock_backend;
+    sl->backend_data = calloc(1, sizeof(struct mock_target));
+    if (stlink_init_lock(sl))
+        return NULL;
+
+    return sl;
+}
+
+struct worker {
+    pthread_t thread;
+    stlink_t *sl;
+    int id;
+    int errors;
+};
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    stlink_t *sl = w->sl;
+    uint32_t addr = (uint32_t) w->id * BLOCK;
+
+    for (int round = 0; round < ROUNDS; round++) {
+        uint32_t word;
+
+        /* q_buf sequences need the lock held by the caller */
+        stlink_lock(sl);
+        for (int i = 0; i < BLOCK; i++)
+            sl->q_buf[i] = (uint8_t) (w->id + round + i);
+        stlink_write_mem32(sl, addr, BLOCK);
+        memset(sl->q_buf, 0, BLOCK);
+        stlink_read_mem32(sl, addr, BLOCK);
+        for (int i = 0; i < BLOCK; i++) {
+            if (sl->q_buf[i] != (uint8_t) (w->id + round + i)) {
+                w->errors++;
+                break;
+            }
+        }
+        stlink_unlock(sl);
+
+        /* single calls are atomic on their own */
+        stlink_write_debug32(sl, (uint32_t) w->id, (uint32_t) round);
+        if (stlink_read_debug32(sl, (uint32_t) w->id, &word) || word != (uint32_t) round)
+            w->errors++;
+        if (!stlink_is_core_halted(sl))
+            w->errors++;
+    }
+
+    return NULL;
+}
+
+static bool run_workers(stlink_t **handles, int nhandles) {
+    struct worker workers[THREADS];
+    int errors = 0, overlaps = 0;
+
+    for (int n = 0; n < THREADS; n++) {
+        workers[n].sl = handles[n % nhandles];
+        workers[n].id = n;
+        workers[n].errors = 0;
+        pthread_create(&workers[n].thread, NULL, worker_main, &workers[n]);
+    }
+
+    for (int n = 0; n < THREADS; n++) {
+        pthread_join(workers[n].thread, NULL);
+        errors += workers[n].errors;
+    }
+
+    for (int n = 0; n < nhandles; n++)
+        overlaps += ((struct mock_target *) handles[n]->backend_data)->overlaps;
+
+    printf("[%s] %d thread(s) on %d handle(s): %d errors, %d overlapping backend calls\n",
+           (errors || overlaps) ? "ERROR" : "OK", THREADS, nhandles, errors, overlaps);
+    return errors == 0 && overlaps == 0;
+}
+
+static bool check_pagesize(void) {
+    stlink_t *sl = mock_open();
+    uint32_t size;
+    bool ok;
+
+    sl->chip_id = STLINK_CHIPID_STM32_F4;
+    sl->flash_pgsz = 0x4000;
+    size = stlink_calculate_pagesize(sl, STM32_FLASH_BASE + 0x20000);
+    ok = size == 0x20000 && sl->flash_pgsz == 0x4000;
+
+    printf("[%s] stlink_calculate_pagesize leaves flash_pgsz alone\n", ok ? "OK" : "ERROR");
+    stlink_close(sl);
+    return ok;
+}
+
+int main(void)
+{
+    stlink_t *handles[HANDLES];
+    bool ok = true;
+
+    ugly_init(UERROR);
+
+    for (int n = 0; n < HANDLES; n++) {
+        handles[n] = mock_open();
+        if (handles[n] == NULL)
+            return 1;
+    }
+
+    ok &= run_workers(handles, 1);
+    ok &= run_workers(handles, HANDLES);
+    ok &= check_pagesize();
+
+    for (int n = 0; n < HANDLES; n++)
+        stlink_close(handles[n]);
+
+    return ok ? 0 : 1;
+}
@@ -9,6 +9,7 @@ int main(int ac, char** av)
     stlink_t* sl;
     struct stlink_reg regs;
 
+    ugly_init(10);
     sl = stlink_open_usb(10, 1, NULL);
     if (sl != NULL) {
         printf("-- version\n");